@@ -31,11 +31,19 @@
 #include "packet_parse.h"
 #include "buddy_list.h"
 #include "buddy_info.h"
+#include "buddy_opt.h"
 #include "char_conv.h"
 #include "im.h"
 #include "qq_define.h"
 #include "qq_base.h"
+#include "qq_cache.h"
 #include "qq_network.h"
+#include "qq_process.h"
+
+#define QQ_LEVEL_BATCH 100		/* uids in one get level packet */
+/* reply of get signature is uid, time and a byte string for each buddy,
+ * ask as many as the reply can hold in one packet */
+#define QQ_SIGN_BATCH ((MAX_PACKET_SIZE - 128) / (4 + 4 + 1 + 0xff))
 
 #define QQ_HOROSCOPE_SIZE 13
 static const gchar *horoscope_names[] = {
@@ -210,8 +218,7 @@ static void info_display_only(PurpleConnection *gc, guint8 *data)
 	g_free(value);
 
 	moodtext = purple_status_get_attr_string(purple_presence_get_status
-		(purple_buddy_get_presence(purple_find_buddy
-		(gc->account, who)), PURPLE_MOOD_NAME), PURPLE_MOOD_COMMENT);
+		(purple_buddy_get_presence(qq_buddy_find(gc, uid)), PURPLE_MOOD_NAME), PURPLE_MOOD_COMMENT);
 
 	if (moodtext)
 		purple_notify_user_info_add_pair(user_info, _("Signature"), moodtext);
@@ -880,7 +887,7 @@ void qq_process_get_buddy_info(guint8 *data, gint data_len, guint32 action, Purp
 		/* find me in buddy list */
 		buddy = qq_buddy_find_or_new(gc, uid, 0xFF);
 	} else {
-		buddy = purple_find_buddy(gc->account, who);
+		buddy = qq_buddy_find(gc, uid);
 		/* purple_debug_info("QQ", "buddy=%p\n", (void*)buddy); */
 	}
 
@@ -895,10 +902,10 @@ void qq_process_get_buddy_info(guint8 *data, gint data_len, guint32 action, Purp
 		bd->face = face;
 
 		if (nickname != NULL) {
-			if (bd->nickname) g_free(bd->nickname);
-			bd->nickname = g_strdup(nickname);
+			qq_nick_release(bd->nickname);
+			bd->nickname = qq_nick_intern(nickname);
 		}
-		bd->last_update = time(NULL);
+		qq_buddy_slot_find(gc, uid)->last_update = time(NULL);
 
 		purple_blist_server_alias_buddy(buddy, bd->nickname);
 
@@ -945,35 +952,56 @@ void qq_request_get_level(PurpleConnection *gc, guint32 uid)
 	qq_send_cmd(gc, QQ_CMD_GET_LEVEL, buf, bytes);
 }
 
-void qq_request_get_buddies_level( PurpleConnection *gc, guint32 update_class, guint pos )
+/* take uids of buddies once per update cycle, later pages index into it.
+ * Buddies whose level, or signature with sign, was got within
+ * QQ_CACHE_FRESH are left out */
+static GArray *buddy_uids_snapshot(PurpleConnection *gc, GArray *uids, gboolean sign)
 {
 	qq_data *qd = (qq_data *) gc->proto_data;
-	PurpleBuddy *buddy;
+	qq_buddy_slot *slot;
 	qq_buddy_data *bd;
+	time_t fresh_after = time(NULL) - QQ_CACHE_FRESH;
+	guint i;
+
+	if (uids == NULL) {
+		uids = g_array_new(FALSE, FALSE, sizeof(guint32));
+	}
+	g_array_set_size(uids, 0);
+	for (i = 0; qd->buddy_slots != NULL && i < qd->buddy_slots->len; i++) {
+		slot = &g_array_index(qd->buddy_slots, qq_buddy_slot, i);
+		bd = purple_buddy_get_protocol_data(slot->buddy);
+		if (bd == NULL) continue;
+		if ((sign ? bd->sign_update : bd->level_update) > fresh_after) continue;
+		g_array_append_val(uids, slot->uid);
+	}
+	return uids;
+}
+
+void qq_request_get_buddies_level( PurpleConnection *gc, guint32 update_class, guint pos )
+{
+	qq_data *qd = (qq_data *) gc->proto_data;
 	guint8 *buf;
-	GSList *buddies, *it;
-	gint bytes, i;
+	guint32 uid;
+	gint bytes;
+	guint i;
+
+	if (pos == 0 || qd->level_uids == NULL) {
+		qd->level_uids = buddy_uids_snapshot(gc, qd->level_uids, FALSE);
+	}
 
 	/* server only reply levels for online buddies */
-	buf = g_newa(guint8, 1024);
+	buf = g_newa(guint8, 1 + (QQ_LEVEL_BATCH + 1) * 4);
 
 	bytes = 0;
 	bytes += qq_put8(buf + bytes, 0x89);
-	buddies = purple_find_buddies(purple_connection_get_account(gc), NULL);
-
-	for (it = buddies,i=0; it; it = it->next) {
-		if (i<pos) { i++; continue; }
-		if (i>=pos+100) break;		//send 100 buddies one time
-		buddy = it->data;
-		if (buddy == NULL) continue;
-		if ((bd = purple_buddy_get_protocol_data(buddy)) == NULL) continue;
-		if (bd->uid == 0) continue;
-		if (bd->uid == qd->uid) continue;
-		bytes += qq_put32(buf + bytes, bd->uid);
-		i++;
+	for (i = pos; i < qd->level_uids->len && i < pos + QQ_LEVEL_BATCH; i++) {
+		uid = g_array_index(qd->level_uids, guint32, i);
+		if (uid == qd->uid) continue;
+		bytes += qq_put32(buf + bytes, uid);
 	}
 	bytes += qq_put32(buf + bytes, qd->uid);
-	qq_send_cmd_mess(gc, QQ_CMD_GET_LEVEL, buf, bytes, update_class, it ? i : 0);
+	qq_send_cmd_mess(gc, QQ_CMD_GET_LEVEL, buf, bytes, update_class,
+			i < qd->level_uids->len ? i : 0);
 }
 
 void qq_process_get_level_reply(guint8 *data, gint data_len, PurpleConnection *gc)
@@ -1007,6 +1035,7 @@ void qq_process_get_level_reply(guint8 *data, gint data_len, PurpleConnection *g
 					if (bd)
 					{
 						bd->level = level;
+						bd->level_update = time(NULL);
 						bd->onlineTime = onlineTime;
 					}
 				}
@@ -1027,6 +1056,7 @@ void qq_process_get_level_reply(guint8 *data, gint data_len, PurpleConnection *g
 				}
 
 				bd->level = level;
+				bd->level_update = time(NULL);
 			}
 			break;
 		default:
@@ -1038,34 +1068,35 @@ void qq_process_get_level_reply(guint8 *data, gint data_len, PurpleConnection *g
 void qq_request_get_buddies_sign( PurpleConnection *gc, guint32 update_class, guint32 pos )
 {
 	qq_data *qd = (qq_data *) gc->proto_data;
-	PurpleBuddy *buddy;
-	qq_buddy_data *bd;
 	guint8 *buf;
-	GSList *buddies, *it;
 	gint bytes;
-	guint16 i;
+	guint i;
 
-	buf = g_newa(guint8, MAX_PACKET_SIZE);
+	if (pos == 0 || qd->sign_uids == NULL) {
+		qd->sign_uids = buddy_uids_snapshot(gc, qd->sign_uids, TRUE);
+		if (qd->sign_uids->len == 0) {
+			purple_debug_info("QQ", "All signatures are fresh\n");
+			if (update_class == QQ_CMD_CLASS_UPDATE_ALL) {
+				qq_update_stage_done(gc, QQ_UPDATE_SIGN);
+			}
+			return;
+		}
+	}
+
+	buf = g_newa(guint8, 3 + QQ_SIGN_BATCH * 8);
 
 	bytes = 0;
 	bytes += qq_put8(buf + bytes, 0x83);
 	bytes += 2;	//num of buddies, fill it later
 
-	buddies = purple_find_buddies(purple_connection_get_account(gc), NULL);
-
-	for (it = buddies,i=0; it; it = it->next) {
-		if (i<pos) { i++; continue; }
-		if (i>=pos+10) break;		//send 10 buddies one time
-		buddy = it->data;
-		if (buddy == NULL) continue;
-		if ((bd = purple_buddy_get_protocol_data(buddy)) == NULL) continue;
-		bytes += qq_put32(buf + bytes, bd->uid);
+	for (i = pos; i < qd->sign_uids->len && i < pos + QQ_SIGN_BATCH; i++) {
+		bytes += qq_put32(buf + bytes, g_array_index(qd->sign_uids, guint32, i));
 		bytes += qq_put32(buf + bytes, 0x00000000);		//signature modified time, normally null
-		i++;
 	}
-	qq_put16(buf + 1, i-pos);	//num of buddies
+	qq_put16(buf + 1, (bytes - 3) / 8);	//num of buddies
 
-	qq_send_cmd_mess(gc, QQ_CMD_GET_BUDDIES_SIGN, buf, bytes, update_class, it ? i : 0);
+	qq_send_cmd_mess(gc, QQ_CMD_GET_BUDDIES_SIGN, buf, bytes, update_class,
+			i < qd->sign_uids->len ? i : 0);
 }
 
 void qq_process_get_buddies_sign(guint8 *data, gint data_len, PurpleConnection *gc)
@@ -1074,6 +1105,7 @@ void qq_process_get_buddies_sign(guint8 *data, gint data_len, PurpleConnection *
 	guint32 uid, last_uid;
 	guint8 ret;
 	gchar *sign, *who, *sign_escaped, *end;
+	qq_buddy_data *bd;
 	qq_data * qd = (qq_data *) gc->proto_data;
 	
 	//qq_show_packet("BUDDIES_SIGN", data, data_len);
@@ -1086,8 +1118,9 @@ void qq_process_get_buddies_sign(guint8 *data, gint data_len, PurpleConnection *
 	{
 		bytes += qq_get32(&uid, data+bytes);
 		bytes += 4;	//signature modified time, no need
-		if (qq_buddy_data_find(gc, uid))
+		if ((bd = qq_buddy_data_find(gc, uid)) != NULL)
 		{
+			bd->sign_update = time(NULL);
 			bytes += qq_get_vstr(&sign, NULL, sizeof(guint8), data+bytes);
 			if (sign)
 			{
@@ -1100,6 +1133,7 @@ void qq_process_get_buddies_sign(guint8 *data, gint data_len, PurpleConnection *
 				purple_debug_info("QQ", "QQ %d Signature: %s\n", uid, sign_escaped);
 				who = uid_to_purple_name(uid);
 				purple_prpl_got_user_status(gc->account, who, PURPLE_MOOD_NAME, PURPLE_MOOD_COMMENT, sign_escaped, NULL);
+				g_free(who);
 				g_free(sign);
 				g_free(sign_escaped);
 			}
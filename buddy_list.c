@@ -161,6 +161,7 @@ guint8 qq_process_get_buddies_online(guint8 *data, gint data_len, PurpleConnecti
 	guint8  position;
 	PurpleBuddy *buddy;
 	qq_buddy_data *bd;
+	qq_buddy_slot *slot;
 	int entry_len = 42;
 
 	qq_buddy_status bs;
@@ -214,15 +215,16 @@ guint8 qq_process_get_buddies_online(guint8 *data, gint data_len, PurpleConnecti
 			continue;
 		}
 
-		if (bd->status != bs.status || bd->comm_flag != bs.comm_flag) {
-			bd->status = bs.status;
-			bd->comm_flag = bs.comm_flag;
-			qq_update_buddy_status(gc, bd->uid, bd->status, bd->comm_flag);
-		}
 		bd->ip.s_addr = bs.ip.s_addr;
 		bd->port = bs.port;
 		bd->ext_flag = bs.ext_flag;
-		bd->last_update = time(NULL);
+		slot = qq_buddy_slot_find(gc, bs.uid);
+		slot->last_update = time(NULL);
+		if (slot->status != bs.status || bd->comm_flag != bs.comm_flag) {
+			slot->status = bs.status;
+			bd->comm_flag = bs.comm_flag;
+			qq_update_buddy_status(gc, bd->uid, bs.status, bd->comm_flag);
+		}
 		count++;
 	}
 
@@ -307,12 +309,14 @@ guint32 qq_process_get_group_list(guint8 *data, gint data_len, PurpleConnection
 guint16 qq_process_get_buddies_list(guint8 *data, gint data_len, PurpleConnection *gc)
 {
 	qq_data *qd;
-	qq_buddy_data bd;
+	qq_buddy_data bd, *old;
 	gint bytes_expected, count;
 	gint bytes, buddy_bytes;
 	gint nickname_len;
+	gchar *nick;
 	guint16 position, unknown;
 	PurpleBuddy *buddy;
+	qq_buddy_slot *slot;
 	gchar *who;
 
 	g_return_val_if_fail(data != NULL && data_len != 0, -1);
@@ -343,9 +347,11 @@ guint16 qq_process_get_buddies_list(guint8 *data, gint data_len, PurpleConnectio
 		/* 007-007: gender */
 		bytes += qq_get8(&bd.gender, data + bytes);
 
-		bytes += nickname_len = qq_get_vstr(&bd.nickname, NULL, sizeof(guint8), data+bytes);
+		bytes += nickname_len = qq_get_vstr(&nick, NULL, sizeof(guint8), data+bytes);
 
-		qq_filter_str(bd.nickname);
+		qq_filter_str(nick);
+		bd.nickname = qq_nick_intern(nick);
+		g_free(nick);
 
 		/* TODO: merge following as 32bit flag */
 		bytes += qq_get16(&unknown, data + bytes);
@@ -359,7 +365,7 @@ guint16 qq_process_get_buddies_list(guint8 *data, gint data_len, PurpleConnectio
 			purple_debug_info("QQ",
 					"Buddy entry, expect %d bytes, read %d bytes\n",
 					bytes_expected, bytes - buddy_bytes);
-			g_free(bd.nickname);
+			qq_nick_release(bd.nickname);
 			continue;
 		} else {
 			count++;
@@ -372,16 +378,26 @@ guint16 qq_process_get_buddies_list(guint8 *data, gint data_len, PurpleConnectio
 
 		buddy = qq_buddy_find_or_new(gc, bd.uid, 0xFF);
 		if (buddy == NULL || purple_buddy_get_protocol_data(buddy) == NULL) {
-			g_free(bd.nickname);
+			qq_nick_release(bd.nickname);
 			continue;
 		}
 		who = purple_buddy_get_name(buddy);
 		serv_got_alias(gc, who, bd.nickname);
 
-		bd.last_update = time(NULL);
-		qq_update_buddy_status(gc, bd.uid, bd.status, bd.comm_flag);
-
-		g_memmove(purple_buddy_get_protocol_data(buddy), &bd, sizeof(qq_buddy_data));
+		/* status is not in this reply either, shown offline until next online reply */
+		slot = qq_buddy_slot_find(gc, bd.uid);
+		slot->status = QQ_BUDDY_OFFLINE;
+		slot->last_update = time(NULL);
+		qq_update_buddy_status(gc, bd.uid, QQ_BUDDY_OFFLINE, bd.comm_flag);
+
+		/* level and signature are not in this reply, keep the ones got before or loaded from cache */
+		old = purple_buddy_get_protocol_data(buddy);
+		bd.level = old->level;
+		bd.level_update = old->level_update;
+		bd.sign_update = old->sign_update;
+		bd.onlineTime = old->onlineTime;
+		qq_nick_release(old->nickname);
+		g_memmove(old, &bd, sizeof(qq_buddy_data));
 	}
 
 	if(bytes > data_len) {
@@ -467,6 +483,7 @@ void qq_process_change_status(guint8 *data, gint data_len, PurpleConnection *gc)
 	gint bytes;
 	guint8 reply;
 	qq_buddy_data *bd;
+	qq_buddy_slot *slot;
 
 	g_return_if_fail(data != NULL && data_len != 0);
 
@@ -482,9 +499,10 @@ void qq_process_change_status(guint8 *data, gint data_len, PurpleConnection *gc)
 	/* purple_debug_info("QQ", "Change status OK\n"); */
 	bd = qq_buddy_data_find(gc, qd->uid);
 	if (bd != NULL) {
-		bd->status = get_status_from_purple(gc);
-		bd->last_update = time(NULL);
-		qq_update_buddy_status(gc, bd->uid, bd->status, bd->comm_flag);
+		slot = qq_buddy_slot_find(gc, qd->uid);
+		slot->status = get_status_from_purple(gc);
+		slot->last_update = time(NULL);
+		qq_update_buddy_status(gc, bd->uid, slot->status, bd->comm_flag);
 	}
 }
 
@@ -495,6 +513,7 @@ void qq_process_buddy_change_status(guint8 *data, gint data_len, PurpleConnectio
 	gint bytes;
 	PurpleBuddy *buddy;
 	qq_buddy_data *bd;
+	qq_buddy_slot *slot;
 	qq_buddy_status bs;
 
 	g_return_if_fail(data != NULL && data_len != 0);
@@ -538,13 +557,14 @@ void qq_process_buddy_change_status(guint8 *data, gint data_len, PurpleConnectio
 		bd->ip.s_addr = bs.ip.s_addr;
 		bd->port = bs.port;
 	}
-	if (bd->status != bs.status) {
-		bd->status = bs.status;
-		qq_update_buddy_status(gc, bd->uid, bd->status, bd->comm_flag);
+	slot = qq_buddy_slot_find(gc, bs.uid);
+	slot->last_update = time(NULL);
+	if (slot->status != bs.status) {
+		slot->status = bs.status;
+		qq_update_buddy_status(gc, bd->uid, bs.status, bd->comm_flag);
 	}
-	bd->last_update = time(NULL);
 
-	if (bd->status == QQ_BUDDY_ONLINE_NORMAL && bd->level <= 0) {
+	if (bs.status == QQ_BUDDY_ONLINE_NORMAL && bd->level <= 0) {
 			qq_request_get_level(gc, bd->uid);
 	}
 }
@@ -602,32 +622,30 @@ void qq_update_buddy_status(PurpleConnection *gc, guint32 uid, guint8 status, gu
 void qq_update_buddies_status(PurpleConnection *gc)
 {
 	qq_data *qd;
-	PurpleBuddy *buddy;
 	qq_buddy_data *bd;
-	GSList *buddies, *it;
+	qq_buddy_slot *slot;
 	time_t tm_limit = time(NULL);
+	guint i;
 
 	qd = (qq_data *) (gc->proto_data);
+	if (qd->buddy_slots == NULL) return;
 
 	tm_limit -= QQ_UPDATE_ONLINE_INTERVAL;
 
-	buddies = purple_find_buddies(purple_connection_get_account(gc), NULL);
-	for (it = buddies; it; it = it->next) {
-		buddy = it->data;
-		if (buddy == NULL) continue;
+	/* walk the dense slots, protocol data only of buddies going offline */
+	for (i = 0; i < qd->buddy_slots->len; i++) {
+		slot = &g_array_index(qd->buddy_slots, qq_buddy_slot, i);
+		if (slot->uid == qd->uid) continue;	/* my status is always online in my buddy list */
+		if (tm_limit < slot->last_update) continue;
+		if (slot->status == QQ_BUDDY_ONLINE_INVISIBLE) continue;
+		if (slot->status == QQ_BUDDY_CHANGE_TO_OFFLINE) continue;
 
-		bd = purple_buddy_get_protocol_data(buddy);
+		bd = purple_buddy_get_protocol_data(slot->buddy);
 		if (bd == NULL) continue;
 
-		if (bd->uid == 0) continue;
-		if (bd->uid == qd->uid) continue;	/* my status is always online in my buddy list */
-		if (tm_limit < bd->last_update) continue;
-		if (bd->status == QQ_BUDDY_ONLINE_INVISIBLE) continue;
-		if (bd->status == QQ_BUDDY_CHANGE_TO_OFFLINE) continue;
-
-		bd->status = QQ_BUDDY_CHANGE_TO_OFFLINE;
-		bd->last_update = time(NULL);
-		qq_update_buddy_status(gc, bd->uid, bd->status, bd->comm_flag);
+		slot->status = QQ_BUDDY_CHANGE_TO_OFFLINE;
+		slot->last_update = time(NULL);
+		qq_update_buddy_status(gc, slot->uid, QQ_BUDDY_CHANGE_TO_OFFLINE, bd->comm_flag);
 	}
 }
 
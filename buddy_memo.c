@@ -32,6 +32,7 @@
 #include "packet_parse.h"
 #include "buddy_list.h"
 #include "buddy_info.h"
+#include "buddy_opt.h"
 #include "char_conv.h"
 #include "im.h"
 #include "qq_define.h"
@@ -111,16 +112,13 @@ static void update_buddy_alias(PurpleConnection *gc, guint32 bd_uid, gchar *alia
 {
 	PurpleAccount *account;
 	PurpleBuddy *buddy;
-	gchar *who;
 	g_return_if_fail(NULL != gc && NULL != alias);
 
 	account = (PurpleAccount *)gc->account;
 	g_return_if_fail(NULL != account);
 
-	who = uid_to_purple_name(bd_uid);
-	buddy = purple_find_buddy(account, who);
+	buddy = qq_buddy_find(gc, bd_uid);
 	if (buddy == NULL || purple_buddy_get_protocol_data(buddy) == NULL) {
-		g_free(who);
 		purple_debug_info("QQ", "Error...Can NOT find %d!\n", bd_uid);
 		return;
 	}
@@ -282,8 +280,8 @@ static void qq_create_buddy_memo(PurpleConnection *gc, guint32 bd_uid, guint32 a
 	memo_modify_dialogue(gc, bd_uid, segments, action);
 }
 
-/* process reply to get_memo packet */
-void qq_process_get_buddy_memo( PurpleConnection *gc, guint8* data, gint data_len, guint32 update_class, guint32 index )
+/* process reply to get_memo packet, return TRUE if next page of aliases is requested */
+gboolean qq_process_get_buddy_memo( PurpleConnection *gc, guint8* data, gint data_len, guint32 update_class, guint32 index )
 {
 	gchar **segments;
 	gint bytes;
@@ -294,7 +292,7 @@ void qq_process_get_buddy_memo( PurpleConnection *gc, guint8* data, gint data_le
 	qq_data * qd;
 	guint i;
 
-	g_return_if_fail(NULL != gc && NULL != data && 0 != data_len);
+	g_return_val_if_fail(NULL != gc && NULL != data && 0 != data_len, FALSE);
 
 	//qq_show_packet("MEMO REACH", data, data_len);
 
@@ -367,14 +365,18 @@ void qq_process_get_buddy_memo( PurpleConnection *gc, guint8* data, gint data_le
 			}
 			if (!is_that_all)
 			{
-				qq_request_buddy_memo(gc, index+1, 0, QQ_BUDDY_MEMO_ALIAS);
+				qq_request_buddy_memo(gc, index+1, update_class, QQ_BUDDY_MEMO_ALIAS);
+				return TRUE;
 			}
+			qd = (qq_data *) gc->proto_data;
+			qd->memo_update = time(NULL);
 			
 			break;
 		default:
 			purple_debug_info("QQ", "received an UNKNOWN memo cmd!!!\n");
 			break;
 	}
+	return FALSE;
 }
 
 /* request buddy memo */
@@ -38,7 +38,7 @@
 #define  QQ_BUDDY_MEMO_ALIAS 0x68		/* get buddies alias list */
 
 
-void qq_process_get_buddy_memo(PurpleConnection *gc, guint8* data, gint data_len, guint32 update_class, guint32 index);
+gboolean qq_process_get_buddy_memo(PurpleConnection *gc, guint8* data, gint data_len, guint32 update_class, guint32 index);
 
 void qq_request_buddy_memo(PurpleConnection *gc, guint32 index, guint32 update_class, guint8 action);
 
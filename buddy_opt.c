@@ -27,6 +27,7 @@
 #include "notify.h"
 #include "request.h"
 #include "privacy.h"
+#include "signals.h"
 
 #include "buddy_info.h"
 #include "buddy_list.h"
@@ -86,17 +87,12 @@ static qq_buddy_data *qq_buddy_data_new(guint32 uid)
 
 qq_buddy_data *qq_buddy_data_find(PurpleConnection *gc, guint32 uid)
 {
-	gchar *who;
 	PurpleBuddy *buddy;
 	qq_buddy_data *bd;
 
 	g_return_val_if_fail(gc != NULL, NULL);
 
-	who = uid_to_purple_name(uid);
-	if (who == NULL)	return NULL;
-	buddy = purple_find_buddy(purple_connection_get_account(gc), who);
-	g_free(who);
-
+	buddy = qq_buddy_find(gc, uid);
 	if (buddy == NULL) {
 		purple_debug_error("QQ", "Can not find purple buddy of %u\n", uid);
 		return NULL;
@@ -109,11 +105,55 @@ qq_buddy_data *qq_buddy_data_find(PurpleConnection *gc, guint32 uid)
 	return bd;
 }
 
+/* One copy of each nickname for all accounts, the buddy list and every room
+ * point to it. Values are counts of references */
+static GHashTable *nick_pool = NULL;
+
+const gchar *qq_nick_intern(const gchar *nick)
+{
+	gpointer key, count;
+
+	if (nick == NULL) return NULL;
+
+	if (nick_pool == NULL) {
+		nick_pool = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	}
+	if (g_hash_table_lookup_extended(nick_pool, nick, &key, &count)) {
+		g_hash_table_insert(nick_pool, key, GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + 1));
+		return key;
+	}
+	key = g_strdup(nick);
+	g_hash_table_insert(nick_pool, key, GUINT_TO_POINTER(1));
+	return key;
+}
+
+void qq_nick_release(const gchar *nick)
+{
+	gpointer key, count;
+
+	if (nick == NULL || nick_pool == NULL) return;
+
+	if (!g_hash_table_lookup_extended(nick_pool, nick, &key, &count) || key != nick) {
+		purple_debug_error("QQ", "Release nickname not interned: %s\n", nick);
+		return;
+	}
+	if (GPOINTER_TO_UINT(count) > 1) {
+		g_hash_table_insert(nick_pool, key, GUINT_TO_POINTER(GPOINTER_TO_UINT(count) - 1));
+		return;
+	}
+	g_hash_table_remove(nick_pool, nick);
+	if (g_hash_table_size(nick_pool) == 0) {
+		g_hash_table_destroy(nick_pool);
+		nick_pool = NULL;
+	}
+}
+
 void qq_buddy_data_free(qq_buddy_data *bd)
 {
 	g_return_if_fail(bd != NULL);
 
-	if (bd->nickname) g_free(bd->nickname);
+	qq_nick_release(bd->nickname);
+	if (bd->conv_name) g_free(bd->conv_name);
 	g_free(bd);
 }
 
@@ -164,17 +204,128 @@ void qq_buddy_free(PurpleBuddy *buddy)
 	purple_blist_remove_buddy(buddy);
 }
 
-PurpleBuddy *qq_buddy_find(PurpleConnection *gc, guint32 uid)
+/* the slot moves when another buddy is removed, do not keep it */
+qq_buddy_slot *qq_buddy_slot_find(PurpleConnection *gc, guint32 uid)
 {
-	PurpleBuddy *buddy;
-	gchar *who;
+	qq_data *qd;
+	guint pos;
 
 	g_return_val_if_fail(gc->account != NULL && uid != 0, NULL);
 
-	who = uid_to_purple_name(uid);
-	buddy = purple_find_buddy(gc->account, who);
-	g_free(who);
-	return buddy;
+	qd = (qq_data *)gc->proto_data;
+	if (qd == NULL || qd->buddies == NULL) {
+		return NULL;
+	}
+	pos = GPOINTER_TO_UINT(g_hash_table_lookup(qd->buddies, GUINT_TO_POINTER(uid)));
+	return (pos == 0) ? NULL : &g_array_index(qd->buddy_slots, qq_buddy_slot, pos - 1);
+}
+
+PurpleBuddy *qq_buddy_find(PurpleConnection *gc, guint32 uid)
+{
+	qq_buddy_slot *slot = qq_buddy_slot_find(gc, uid);
+	return (slot == NULL) ? NULL : slot->buddy;
+}
+
+/* blist signals are global, only index buddies of this account.
+ * When a uid is in several groups, keep the first one like purple_find_buddy */
+static void buddy_index_added_cb(PurpleBuddy *buddy, PurpleConnection *gc)
+{
+	qq_data *qd = (qq_data *)gc->proto_data;
+	qq_buddy_slot slot;
+
+	if (purple_buddy_get_account(buddy) != purple_connection_get_account(gc)) return;
+
+	memset(&slot, 0, sizeof(slot));
+	slot.uid = purple_name_to_uid(purple_buddy_get_name(buddy));
+	if (slot.uid == 0) return;
+	if (g_hash_table_lookup(qd->buddies, GUINT_TO_POINTER(slot.uid)) != NULL) return;
+
+	slot.status = QQ_BUDDY_OFFLINE;
+	slot.buddy = buddy;
+	g_array_append_val(qd->buddy_slots, slot);
+	g_hash_table_insert(qd->buddies, GUINT_TO_POINTER(slot.uid),
+			GUINT_TO_POINTER(qd->buddy_slots->len));
+}
+
+/* emitted after the buddy is unlinked, so purple_find_buddy sees any other copy.
+ * The last slot is moved into the hole */
+static void buddy_index_removed_cb(PurpleBuddy *buddy, PurpleConnection *gc)
+{
+	qq_data *qd = (qq_data *)gc->proto_data;
+	PurpleAccount *account = purple_connection_get_account(gc);
+	PurpleBuddy *other;
+	qq_buddy_slot *slot;
+	guint32 uid;
+	guint pos;
+
+	if (purple_buddy_get_account(buddy) != account) return;
+
+	uid = purple_name_to_uid(purple_buddy_get_name(buddy));
+	pos = GPOINTER_TO_UINT(g_hash_table_lookup(qd->buddies, GUINT_TO_POINTER(uid)));
+	if (pos == 0) return;
+	slot = &g_array_index(qd->buddy_slots, qq_buddy_slot, pos - 1);
+	if (slot->buddy != buddy) return;
+
+	other = purple_find_buddy(account, purple_buddy_get_name(buddy));
+	if (other != NULL && other != buddy) {
+		slot->buddy = other;
+		return;
+	}
+
+	g_hash_table_remove(qd->buddies, GUINT_TO_POINTER(uid));
+	g_array_remove_index_fast(qd->buddy_slots, pos - 1);
+	if (pos - 1 < qd->buddy_slots->len) {
+		slot = &g_array_index(qd->buddy_slots, qq_buddy_slot, pos - 1);
+		g_hash_table_insert(qd->buddies, GUINT_TO_POINTER(slot->uid), GUINT_TO_POINTER(pos));
+	}
+}
+
+void qq_buddy_index_init(PurpleConnection *gc)
+{
+	qq_data *qd;
+	GSList *buddies, *it;
+
+	g_return_if_fail(gc != NULL && gc->proto_data != NULL);
+	qd = (qq_data *)gc->proto_data;
+	g_return_if_fail(qd->buddies == NULL);
+
+	qd->buddies = g_hash_table_new(g_direct_hash, g_direct_equal);
+	qd->buddy_slots = g_array_new(FALSE, FALSE, sizeof(qq_buddy_slot));
+
+	buddies = purple_find_buddies(purple_connection_get_account(gc), NULL);
+	for (it = buddies; it; it = it->next) {
+		if (it->data == NULL) continue;
+		buddy_index_added_cb(it->data, gc);
+	}
+	g_slist_free(buddies);
+
+	purple_signal_connect(purple_blist_get_handle(), "buddy-added", gc,
+			PURPLE_CALLBACK(buddy_index_added_cb), gc);
+	purple_signal_connect(purple_blist_get_handle(), "buddy-removed", gc,
+			PURPLE_CALLBACK(buddy_index_removed_cb), gc);
+
+	purple_debug_info("QQ", "%d buddies indexed\n", g_hash_table_size(qd->buddies));
+}
+
+void qq_buddy_index_free(PurpleConnection *gc)
+{
+	qq_data *qd;
+
+	g_return_if_fail(gc != NULL && gc->proto_data != NULL);
+	qd = (qq_data *)gc->proto_data;
+
+	purple_signal_disconnect(purple_blist_get_handle(), "buddy-added", gc,
+			PURPLE_CALLBACK(buddy_index_added_cb));
+	purple_signal_disconnect(purple_blist_get_handle(), "buddy-removed", gc,
+			PURPLE_CALLBACK(buddy_index_removed_cb));
+	if (qd->buddies != NULL) {
+		g_hash_table_destroy(qd->buddies);
+		qd->buddies = NULL;
+	}
+	if (qd->buddy_slots != NULL) {
+		g_array_free(qd->buddy_slots, TRUE);
+		qd->buddy_slots = NULL;
+	}
 }
 
 PurpleBuddy * qq_buddy_find_or_new( PurpleConnection *gc, guint32 uid, guint8 group_id)
@@ -981,7 +1132,7 @@ static void buddy_add_input(PurpleConnection *gc, guint32 uid, gchar *reason)
 	purple_account_request_authorization(account,
 	 		who, NULL,
 			NULL, reason,
-			purple_find_buddy(account, who) != NULL,
+			qq_buddy_find(gc, opt_req->uid) != NULL,
 			buddy_add_authorize_cb,
 			buddy_add_deny_cb,
 			opt_req);
@@ -1139,7 +1290,7 @@ static void server_buddy_added_deprecated(PurpleConnection *gc, gchar *from, gch
 	uid = strtoul(from, NULL, 10);
 	who = uid_to_purple_name(uid);
 
-	buddy = purple_find_buddy(account, who);
+	buddy = qq_buddy_find(gc, uid);
 	if (buddy != NULL) {
 		purple_account_notify_added(account, from, to, NULL, NULL);
 	}
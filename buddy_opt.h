@@ -62,6 +62,9 @@ typedef struct _qq_buddy_add_req {
 	guint8 auth_type;
 } qq_buddy_opt_req;
 
+const gchar *qq_nick_intern(const gchar *nick);
+void qq_nick_release(const gchar *nick);
+
 void qq_add_buddy(PurpleConnection *gc, PurpleBuddy *buddy, PurpleGroup *group);
 void qq_change_buddys_group(PurpleConnection *gc, const char *who,
 		const char *old_group, const char *new_group);
@@ -94,6 +97,9 @@ void auth_token_captcha_input_cb(PurpleUtilFetchUrlData *url_data,
 PurpleBuddy *qq_buddy_new(PurpleConnection *gc, guint32 uid, PurpleGroup * group);
 PurpleBuddy *qq_buddy_find_or_new(PurpleConnection *gc, guint32 uid, guint8 group_id);
 PurpleBuddy *qq_buddy_find(PurpleConnection *gc, guint32 uid);
+qq_buddy_slot *qq_buddy_slot_find(PurpleConnection *gc, guint32 uid);
+void qq_buddy_index_init(PurpleConnection *gc);
+void qq_buddy_index_free(PurpleConnection *gc);
 PurpleGroup *qq_group_find_or_new(const gchar *group_name);
 void add_buddy_authorize_input(PurpleConnection *gc, qq_buddy_opt_req *opt_req);
 guint8 group_name_to_id(PurpleConnection *gc, const gchar * group_name);
@@ -27,9 +27,11 @@
 #include "debug.h"
 #include "ft.h"
 #include "cipher.h"
+#include "util.h"
 
 #include "qq_crypt.h"
 #include "file_trans.h"
+#include "file_window.h"
 #include "qq_define.h"
 #include "im.h"
 #include "packet_parse.h"
@@ -72,33 +74,248 @@ static guint32 _encrypt_qq_uid(guint32 uid, guint32 key)
 	return (~uid) ^ key;
 }
 
-static void _fill_file_md5(const gchar *filename, gint filelen, guint8 *md5)
+/* only the head of a big file is hashed */
+#define QQ_FILE_MD5_MAXLEN	10002432
+#define QQ_FILE_MD5_CHUNK	(64 * 1024)
+/* drop all cached hashes when there are more */
+#define QQ_FILE_MD5_CACHE_MAX	64
+
+/* An unfinished receive leaves a journal next to the file, named
+ * <file>.qqpart. All numbers are big endian:
+ *
+ *   magic "QQPT", version 16, sender's file md5 16 bytes,
+ *   file size 32, fragment num 32, fragment len 32, file mtime 32,
+ *   max_fragment_index 32, then the window ring of received fragments
+ *   above it, QQ_FILE_WINDOW_MAX / 32 words of 32
+ *
+ * The head hashed by the sender must be complete to resume, so the
+ * written data can be checked against the file md5 */
+#define QQ_FILE_JOURNAL_SUFFIX	".qqpart"
+#define QQ_FILE_JOURNAL_MAGIC	"QQPT"
+#define QQ_FILE_JOURNAL_VERSION	1
+#define QQ_FILE_JOURNAL_LEN	(4 + 2 + 16 + 4 * 5 + QQ_FILE_WINDOW_MAX / 8)
+/* The basic info ack carries the first fragment wanted. Other clients
+ * send 0 there, so a resume also puts this magic and the file md5
+ * behind it; the sender skips nothing without both */
+#define QQ_FILE_RESUME_MAGIC	"QQRS"
+
+/* Hashing runs in a thread, so a 10MB read does not stall the main loop.
+ * The cipher context is made on the main loop, the thread only appends
+ * and the result comes back in an idle callback */
+struct _qq_file_md5_job {
+	PurpleXfer *xfer;
+	gchar *filename;
+	gint64 len;
+	gchar *cache_key;
+	PurpleCipherContext *context;
+	volatile gint cancelled;
+	gboolean failed;
+};
+
+/* md5 of sent files by path, size and mtime */
+static GHashTable *file_md5_cache = NULL;
+
+static void _qq_send_file_basic_info(PurpleXfer *xfer);
+static void _qq_recv_resume(PurpleXfer *xfer, const guint8 *head_md5);
+static void _qq_recv_journal_save(PurpleXfer *xfer);
+
+static gchar *_file_md5_cache_key(const gchar *filename)
 {
-	FILE *fp;
-	guint8 *buffer;
-	size_t wc;
+	struct stat st;
+
+	if (g_stat(filename, &st) != 0) return NULL;
+	return g_strdup_printf("%s\n%" G_GINT64_FORMAT "\n%ld",
+			filename, (gint64) st.st_size, (glong) st.st_mtime);
+}
+
+static void _file_md5_job_free(qq_file_md5_job *job)
+{
+	purple_xfer_unref(job->xfer);
+	purple_cipher_context_destroy(job->context);
+	g_free(job->cache_key);
+	g_free(job->filename);
+	g_free(job);
+}
 
-	const gint QQ_MAX_FILE_MD5_LENGTH = 10002432;
+/* md5 of the file head is known. A sender goes on with basic info,
+ * a receiver checks the head it wrote before resuming */
+static void _file_md5_ready(PurpleXfer *xfer, const guint8 *md5)
+{
+	ft_info *info = (ft_info *) xfer->data;
 
-	g_return_if_fail(filename != NULL && md5 != NULL);
-	if (filelen > QQ_MAX_FILE_MD5_LENGTH)
-		filelen = QQ_MAX_FILE_MD5_LENGTH;
+	if (purple_xfer_get_type(xfer) == PURPLE_XFER_RECEIVE) {
+		_qq_recv_resume(xfer, md5);
+		return;
+	}
+
+	memcpy(info->file_md5, md5, sizeof(info->file_md5));
+	info->md5_ready = TRUE;
+	if (info->basic_info_wait) {
+		info->basic_info_wait = FALSE;
+		_qq_send_file_basic_info(xfer);
+	}
+}
 
-	fp = g_fopen(filename, "rb");
-	g_return_if_fail(fp != NULL);
+static gboolean _file_md5_done(gpointer data)
+{
+	qq_file_md5_job *job = (qq_file_md5_job *) data;
+	PurpleXfer *xfer = job->xfer;
+	ft_info *info;
+	guint8 md5[QQ_KEY_LENGTH];
 
-	buffer = g_newa(guint8, filelen);
-	g_return_if_fail(buffer != NULL);
-	wc = fread(buffer, filelen, 1, fp);
+	if (g_atomic_int_get(&job->cancelled) || purple_xfer_is_canceled(xfer) || xfer->data == NULL) {
+		_file_md5_job_free(job);
+		return FALSE;
+	}
+	info = (ft_info *) xfer->data;
+	info->md5_job = NULL;
+
+	if (job->failed) {
+		purple_debug_error("QQ", "Unable to read file: %s\n", job->filename);
+		if (purple_xfer_get_type(xfer) == PURPLE_XFER_RECEIVE) {
+			/* nothing to resume from, take the whole file */
+			_qq_recv_resume(xfer, NULL);
+		} else {
+			purple_xfer_cancel_local(xfer);
+		}
+		_file_md5_job_free(job);
+		return FALSE;
+	}
+
+	purple_cipher_context_digest(job->context, sizeof(md5), md5, NULL);
+	purple_debug_info("QQ", "Got md5 of %s\n", job->filename);
+
+	if (job->cache_key != NULL) {
+		if (file_md5_cache == NULL) {
+			file_md5_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		} else if (g_hash_table_size(file_md5_cache) >= QQ_FILE_MD5_CACHE_MAX) {
+			g_hash_table_remove_all(file_md5_cache);
+		}
+		g_hash_table_insert(file_md5_cache, job->cache_key, g_memdup(md5, sizeof(md5)));
+		job->cache_key = NULL;
+	}
+
+	_file_md5_ready(xfer, md5);
+	_file_md5_job_free(job);
+	return FALSE;
+}
+
+static gpointer _file_md5_thread(gpointer data)
+{
+	qq_file_md5_job *job = (qq_file_md5_job *) data;
+	guint8 *buffer;
+	gint64 left;
+	size_t chunk;
+	FILE *fp;
+
+	fp = g_fopen(job->filename, "rb");
+	if (fp == NULL) {
+		job->failed = TRUE;
+		g_idle_add(_file_md5_done, job);
+		return NULL;
+	}
+
+	buffer = g_malloc(QQ_FILE_MD5_CHUNK);
+	for (left = job->len; left > 0; left -= chunk) {
+		if (g_atomic_int_get(&job->cancelled)) break;
+		chunk = MIN(left, QQ_FILE_MD5_CHUNK);
+		if (fread(buffer, chunk, 1, fp) != 1) {
+			job->failed = TRUE;
+			break;
+		}
+		purple_cipher_context_append(job->context, buffer, chunk);
+	}
+	g_free(buffer);
 	fclose(fp);
-	if (wc != 1) {
-		purple_debug_error("qq", "Unable to read file: %s\n", filename);
 
-		/* TODO: XXX: Really, the caller should be modified to deal with this properly. */
+	g_idle_add(_file_md5_done, job);
+	return NULL;
+}
+
+/* start hashing the head of the local file, the file to send as soon as
+ * it is known, or the partly received one before resuming */
+void qq_xfer_md5_start(PurpleXfer *xfer)
+{
+	ft_info *info;
+	qq_file_md5_job *job;
+	const gchar *filename;
+	gchar *cache_key;
+	guint8 *md5;
+	GThread *thread;
+
+	g_return_if_fail(xfer != NULL && xfer->data != NULL);
+	info = (ft_info *) xfer->data;
+	filename = purple_xfer_get_local_filename(xfer);
+	g_return_if_fail(filename != NULL);
+
+	cache_key = _file_md5_cache_key(filename);
+	if (cache_key != NULL && file_md5_cache != NULL
+			&& (md5 = g_hash_table_lookup(file_md5_cache, cache_key)) != NULL) {
+		purple_debug_info("QQ", "Use cached md5 of %s\n", filename);
+		g_free(cache_key);
+		_file_md5_ready(xfer, md5);
 		return;
 	}
 
-	qq_get_md5(md5, QQ_KEY_LENGTH, buffer, filelen);
+	job = g_new0(qq_file_md5_job, 1);
+	job->xfer = xfer;
+	purple_xfer_ref(xfer);
+	job->filename = g_strdup(filename);
+	job->len = MIN(purple_xfer_get_size(xfer), QQ_FILE_MD5_MAXLEN);
+	job->cache_key = cache_key;
+	job->context = purple_cipher_context_new(purple_ciphers_find_cipher("md5"), NULL);
+	info->md5_job = job;
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	thread = g_thread_try_new("qq-file-md5", _file_md5_thread, job, NULL);
+#else
+	if (!g_thread_supported()) g_thread_init(NULL);
+	thread = g_thread_create(_file_md5_thread, job, FALSE, NULL);
+#endif
+	if (thread == NULL) {
+		/* no thread, hash it here */
+		_file_md5_thread(job);
+		return;
+	}
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_thread_unref(thread);
+#endif
+}
+
+/* stop hashing and resending and close the file, called when the transfer
+ * ends or is cancelled. The hash thread stops at next chunk, the idle
+ * callback frees the job. A receive not completed leaves its journal */
+void qq_xfer_stop(PurpleXfer *xfer)
+{
+	ft_info *info;
+
+	g_return_if_fail(xfer != NULL);
+	info = (ft_info *) xfer->data;
+	if (info == NULL) return;
+
+	if (info->md5_job != NULL) {
+		g_atomic_int_set(&info->md5_job->cancelled, TRUE);
+		info->md5_job = NULL;
+	}
+	if (info->resend_timeout > 0) {
+		purple_timeout_remove(info->resend_timeout);
+		info->resend_timeout = 0;
+	}
+	if (info->fill_timeout > 0) {
+		purple_timeout_remove(info->fill_timeout);
+		info->fill_timeout = 0;
+	}
+	qq_xfer_close_file(xfer);
+	if (purple_xfer_get_type(xfer) == PURPLE_XFER_RECEIVE && info->file_opened) {
+		_qq_recv_journal_save(xfer);
+		info->file_opened = FALSE;
+	}
+}
+
+static qq_data *_qq_xfer_qd(PurpleXfer *xfer)
+{
+	PurpleConnection *gc = purple_account_get_connection(purple_xfer_get_account(xfer));
+	return (qq_data *) gc->proto_data;
 }
 
 static gint _qq_get_file_header(qq_file_header *fh, guint8 *buf)
@@ -148,79 +365,82 @@ static const gchar *qq_get_file_cmd_desc(gint type)
 	}
 }
 
-/* The memmap version has better performance for big files transfering
- * but it will spend plenty of memory, so do not use it in a low-memory host */
-#ifdef USE_MMAP
+/* A file to send is read through a mapped window, each fragment is sent
+ * straight from it. Without mmap on Windows a fragment is read into
+ * info->fragment_buf. Received files are written with stdio */
+#ifndef _WIN32
 #include <sys/mman.h>
 
+/* bytes mapped at a time, so big files need little address space */
+#define QQ_FILE_MAP_WINDOW	(4 * 1024 * 1024)
+#endif
+
 static int _qq_xfer_open_file(const gchar *filename, const gchar *method, PurpleXfer *xfer)
 {
 	ft_info *info = xfer->data;
-	int fd;
-	if (method[0] == 'r') {
-		fd = open(purple_xfer_get_local_filename(xfer), O_RDONLY);
-		info->buffer = mmap(0, purple_xfer_get_size(xfer), PROT_READ, MAP_PRIVATE, fd, 0);
+#ifndef _WIN32
+	if (strcmp(method, "rb") == 0) {
+		info->src_fd = g_open(filename, O_RDONLY, 0);
+		return (info->src_fd < 0) ? -1 : 0;
 	}
-	else
-	{
-		fd = open(purple_xfer_get_local_filename(xfer), O_RDWR|O_CREAT, 0644);
-		info->buffer = mmap(0, purple_xfer_get_size(xfer), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FILE, fd, 0);
-	}
-
-	if (info->buffer == NULL) {
-		return - 1;
+#endif
+	info->dest_fp = g_fopen(filename, method);
+	if (info->dest_fp == NULL) {
+		return -1;
 	}
 	return 0;
 }
 
-static gint _qq_xfer_read_file(guint8 *buffer, guint index, guint len, PurpleXfer *xfer)
+/* view of fragment index in the file, good until next call */
+static const guint8 *_qq_xfer_fragment_view(PurpleXfer *xfer, guint32 index, gint *len)
 {
 	ft_info *info = xfer->data;
-	gint readbytes;
-
-	buffer = info->buffer + len * index;
-	readbytes = purple_xfer_get_size(xfer) - (buffer - info->buffer);
-	if (readbytes > info->fragment_len) readbytes = info->fragment_len;
-	return readbytes;
-}
-
-static gint _qq_xfer_write_file(guint8 *buffer, guint index, guint len, PurpleXfer *xfer)
-{
-	ft_info *info = xfer->data;
-
-	memcpy(info->buffer + index * len, buffer, len);
-	return 0;
-}
+	gsize size = purple_xfer_get_size(xfer);
+	gsize offset = (gsize) index * info->fragment_len;
+#ifndef _WIN32
+	gsize start;
+	void *map;
+#endif
 
-void qq_xfer_close_file(PurpleXfer *xfer)
-{
-	ft_info *info = xfer->data;
+	if (offset >= size) return NULL;
+	*len = MIN(info->fragment_len, size - offset);
 
-	if (info->buffer) munmap(info->buffer, purple_xfer_get_size(xfer));
-}
-#else
-static int _qq_xfer_open_file(const gchar *filename, const gchar *method, PurpleXfer *xfer)
-{
-	ft_info *info = xfer->data;
-	info->dest_fp = g_fopen(purple_xfer_get_local_filename(xfer), method);
-	if (info->dest_fp == NULL) {
-		return -1;
+#ifndef _WIN32
+	if (info->map != NULL && offset >= info->map_offset
+			&& offset + *len <= info->map_offset + info->map_len) {
+		return info->map + (offset - info->map_offset);
 	}
-	return 0;
-}
 
-static gint _qq_xfer_read_file(guint8 *buffer, guint index, guint len, PurpleXfer *xfer)
-{
-	ft_info *info = xfer->data;
-
-	fseek(info->dest_fp, index * len, SEEK_SET);
-	return fread(buffer, 1, len, info->dest_fp);
+	/* map from the first fragment not acked, so resends hit the same window */
+	start = MIN(offset, (gsize) info->window.max_fragment_index * info->fragment_len);
+	if (offset + *len - start > QQ_FILE_MAP_WINDOW) start = offset;
+	start -= start % sysconf(_SC_PAGESIZE);
+
+	if (info->map != NULL) munmap(info->map, info->map_len);
+	info->map = NULL;
+	info->map_offset = start;
+	info->map_len = MIN(QQ_FILE_MAP_WINDOW, size - start);
+	map = mmap(NULL, info->map_len, PROT_READ, MAP_PRIVATE, info->src_fd, start);
+	if (map == MAP_FAILED) {
+		purple_debug_error("QQ", "Unable to map %" G_GSIZE_FORMAT " bytes at %" G_GSIZE_FORMAT ": %s\n",
+				info->map_len, start, g_strerror(errno));
+		return NULL;
+	}
+	info->map = map;
+	return info->map + (offset - info->map_offset);
+#else
+	if (info->fragment_buf == NULL) info->fragment_buf = g_malloc(info->fragment_len);
+	fseek(info->dest_fp, offset, SEEK_SET);
+	if (fread(info->fragment_buf, *len, 1, info->dest_fp) != 1) return NULL;
+	return info->fragment_buf;
+#endif
 }
 
 static gint _qq_xfer_write_file(guint8 *buffer, guint index, guint len, PurpleXfer *xfer)
 {
 	ft_info *info = xfer->data;
-	fseek(info->dest_fp, index * len, SEEK_SET);
+	/* the last fragment is shorter, its offset is not index * len */
+	fseek(info->dest_fp, (glong) index * info->fragment_len, SEEK_SET);
 	return fwrite(buffer, 1, len, info->dest_fp);
 }
 
@@ -228,20 +448,31 @@ void qq_xfer_close_file(PurpleXfer *xfer)
 {
 	ft_info *info = xfer->data;
 
+#ifndef _WIN32
+	if (info->map != NULL) munmap(info->map, info->map_len);
+	info->map = NULL;
+	if (info->src_fd > 0) close(info->src_fd);
+	info->src_fd = -1;
+#endif
 	if (info->dest_fp) fclose(info->dest_fp);
+	info->dest_fp = NULL;
+	g_free(info->fragment_buf);
+	info->fragment_buf = NULL;
 }
-#endif
 
-static gint _qq_send_file(PurpleConnection *gc, guint8 *data, gint len, guint16 packet_type, guint32 to_uid)
+/* head is copied behind the file header, body is sent from where it is */
+static gint _qq_send_file(PurpleXfer *xfer, guint8 *data, gint len,
+		const guint8 *body, gint body_len, guint16 packet_type, guint32 to_uid)
 {
 	guint8 *raw_data;
 	gint bytes = 0;
 	guint32 file_key;
 	qq_data *qd;
+	struct iovec iov[2];
 
-	qd = (qq_data *) gc->proto_data;
+	qd = _qq_xfer_qd(xfer);
 
-	raw_data = g_newa(guint8, MAX_PACKET_SIZE);
+	raw_data = g_newa(guint8, len + 12);
 	file_key = _gen_file_key();
 
 	bytes += qq_put8(raw_data + bytes, packet_type);
@@ -252,14 +483,18 @@ static gint _qq_send_file(PurpleConnection *gc, guint8 *data, gint len, guint16
 	bytes += qq_putdata(raw_data + bytes, data, len);
 
 	if (bytes == len + 12) {
-		_qq_xfer_write(raw_data, bytes, qd->xfer);
+		iov[0].iov_base = raw_data;
+		iov[0].iov_len = bytes;
+		iov[1].iov_base = (void *) body;
+		iov[1].iov_len = body_len;
+		_qq_xfer_writev(iov, (body_len > 0) ? 2 : 1, xfer);
 	} else
 		purple_debug_info("QQ", "send_file: want %d but got %d\n", len + 12, bytes);
-	return bytes;
+	return bytes + body_len;
 }
 
 /* send a file to udp channel with QQ_FILE_CONTROL_PACKET_TAG */
-void qq_send_file_ctl_packet(PurpleConnection *gc, guint16 packet_type, guint32 to_uid, guint8 hellobyte)
+void qq_send_file_ctl_packet(PurpleXfer *xfer, guint16 packet_type, guint32 to_uid, guint8 hellobyte)
 {
 	qq_data *qd;
 	gint bytes, bytes_expected, encrypted_len;
@@ -267,8 +502,8 @@ void qq_send_file_ctl_packet(PurpleConnection *gc, guint16 packet_type, guint32
 	time_t now;
 	ft_info *info;
 
-	qd = (qq_data *) gc->proto_data;
-	info = (ft_info *) qd->xfer->data;
+	qd = _qq_xfer_qd(xfer);
+	info = (ft_info *) xfer->data;
 
 	raw_data = g_newa (guint8, 61);
 	bytes = 0;
@@ -357,26 +592,25 @@ void qq_send_file_ctl_packet(PurpleConnection *gc, guint16 packet_type, guint32
 #endif
 
 	purple_debug_info("QQ", "<== send %s packet\n", qq_get_file_cmd_desc(packet_type));
-	_qq_send_file(gc, encrypted, encrypted_len, QQ_FILE_CONTROL_PACKET_TAG, info->to_uid);
+	_qq_send_file(xfer, encrypted, encrypted_len, NULL, 0, QQ_FILE_CONTROL_PACKET_TAG, info->to_uid);
 }
 
 /* send a file to udp channel with QQ_FILE_DATA_PACKET_TAG */
-static void _qq_send_file_data_packet(PurpleConnection *gc, guint16 packet_type, guint8 sub_type,
-		guint32 fragment_index, guint16 seq, guint8 *data, gint len)
+static void _qq_send_file_data_packet(PurpleXfer *xfer, guint16 packet_type, guint8 sub_type,
+		guint32 fragment_index, guint16 seq, const guint8 *data, gint len)
 {
-	guint8 *raw_data, filename_md5[QQ_KEY_LENGTH], file_md5[QQ_KEY_LENGTH];
-	gint bytes;
+	guint8 *raw_data, filename_md5[QQ_KEY_LENGTH];
+	const guint8 *body = NULL;
+	gint bytes, body_len = 0;
 	guint32 fragment_size = 1000;
 	const char *filename;
 	gint filename_len, filesize;
-	qq_data *qd;
 	ft_info *info;
 
-	qd = (qq_data *) gc->proto_data;
-	info = (ft_info *) qd->xfer->data;
+	info = (ft_info *) xfer->data;
 
-	filename = purple_xfer_get_filename(qd->xfer);
-	filesize = purple_xfer_get_size(qd->xfer);
+	filename = purple_xfer_get_filename(xfer);
+	filesize = purple_xfer_get_size(xfer);
 
 	raw_data = g_newa(guint8, MAX_PACKET_SIZE);
 	bytes = 0;
@@ -396,9 +630,6 @@ static void _qq_send_file_data_packet(PurpleConnection *gc, guint16 packet_type,
 				case QQ_FILE_BASIC_INFO:
 					filename_len = strlen(filename);
 					qq_get_md5(filename_md5, sizeof(filename_md5), (guint8 *)filename, filename_len);
-					_fill_file_md5(purple_xfer_get_local_filename(qd->xfer),
-							purple_xfer_get_size(qd->xfer),
-							file_md5);
 
 					info->fragment_num = (filesize - 1) / QQ_FILE_FRAGMENT_MAXLEN + 1;
 					info->fragment_len = QQ_FILE_FRAGMENT_MAXLEN;
@@ -416,7 +647,7 @@ static void _qq_send_file_data_packet(PurpleConnection *gc, guint16 packet_type,
 					bytes += qq_put32(raw_data + bytes, info->fragment_num);
 					/* Length of a single fragment */
 					bytes += qq_put32(raw_data + bytes, info->fragment_len);
-					bytes += qq_putdata(raw_data + bytes, file_md5, 16);
+					bytes += qq_putdata(raw_data + bytes, info->file_md5, 16);
 					bytes += qq_putdata(raw_data + bytes, filename_md5, 16);
 					/* Length of filename */
 					bytes += qq_put16(raw_data + bytes, filename_len);
@@ -438,14 +669,16 @@ static void _qq_send_file_data_packet(PurpleConnection *gc, guint16 packet_type,
 					bytes += qq_put32(raw_data + bytes, fragment_index - 1);
 					bytes += qq_put32(raw_data + bytes, (fragment_index - 1) * fragment_size);
 					bytes += qq_put16(raw_data + bytes, len);
-					bytes += qq_putdata(raw_data + bytes, data, len);
+					/* fragment goes out from the file view */
+					body = data;
+					body_len = len;
 					break;
 				case QQ_FILE_EOF:
 					purple_debug_info("QQ", "end of sending data\n");
 					/* bytes += qq_put16(raw_data + bytes, info->fragment_num + 1); */
 					bytes += qq_put16(raw_data + bytes, info->fragment_num);
 					bytes += qq_put8(raw_data + bytes, sub_type);
-					/* purple_xfer_set_completed(qd->xfer, TRUE); */
+					/* purple_xfer_set_completed(xfer, TRUE); */
 			}
 			break;
 		case QQ_FILE_CMD_FILE_OP_ACK:
@@ -454,7 +687,12 @@ static void _qq_send_file_data_packet(PurpleConnection *gc, guint16 packet_type,
 				case QQ_FILE_BASIC_INFO:
 					bytes += qq_put16(raw_data + bytes, 0x0000);
 					bytes += qq_put8(raw_data + bytes, sub_type);
-					bytes += qq_put32(raw_data + bytes, 0x00000000);
+					/* first fragment wanted, 0 for the whole file */
+					bytes += qq_put32(raw_data + bytes, fragment_index);
+					if (fragment_index > 0) {
+						bytes += qq_putdata(raw_data + bytes, (guint8 *) QQ_FILE_RESUME_MAGIC, 4);
+						bytes += qq_putdata(raw_data + bytes, info->file_md5, sizeof(info->file_md5));
+					}
 					break;
 				case QQ_FILE_DATA_INFO:
 					bytes += qq_put16(raw_data + bytes, seq);
@@ -468,7 +706,20 @@ static void _qq_send_file_data_packet(PurpleConnection *gc, guint16 packet_type,
 			}
 	}
 	purple_debug_info("QQ", "<== send %s packet\n", qq_get_file_cmd_desc(packet_type));
-	_qq_send_file(gc, raw_data, bytes, QQ_FILE_DATA_PACKET_TAG, info->to_uid);
+	_qq_send_file(xfer, raw_data, bytes, body, body_len, QQ_FILE_DATA_PACKET_TAG, info->to_uid);
+}
+
+/* the file md5 may be still in hashing, then it is sent by _file_md5_done */
+static void _qq_send_file_basic_info(PurpleXfer *xfer)
+{
+	ft_info *info = (ft_info *) xfer->data;
+
+	if (!info->md5_ready) {
+		purple_debug_info("QQ", "Wait for file md5 to send basic info\n");
+		info->basic_info_wait = TRUE;
+		return;
+	}
+	_qq_send_file_data_packet(xfer, QQ_FILE_CMD_FILE_OP, QQ_FILE_BASIC_INFO, 0, 0, NULL, 0);
 }
 
 /* A conversation starts like this:
@@ -490,18 +741,18 @@ static void _qq_send_file_data_packet(PurpleConnection *gc, guint16 packet_type,
  */
 
 
-static void _qq_process_recv_file_ctl_packet(PurpleConnection *gc, guint8 *data, gint data_len)
+static void _qq_process_recv_file_ctl_packet(PurpleXfer *xfer, guint8 *data, gint data_len)
 {
 	gint bytes ;
 	gint decryped_bytes;
 	qq_file_header fh;
 	guint8 *decrypted_data;
 	gint decrypted_len;
-	qq_data *qd = (qq_data *) gc->proto_data;
+	qq_data *qd = _qq_xfer_qd(xfer);
 	guint16 packet_type;
 	guint16 seq;
 	guint8 hellobyte;
-	ft_info *info = (ft_info *) qd->xfer->data;
+	ft_info *info = (ft_info *) xfer->data;
 
 	bytes = 0;
 	bytes += _qq_get_file_header(&fh, data + bytes);
@@ -528,15 +779,15 @@ static void _qq_process_recv_file_ctl_packet(PurpleConnection *gc, guint8 *data,
 		case QQ_FILE_CMD_NOTIFY_IP_ACK:
 			decryped_bytes = 0;
 			qq_get_conn_info(info, decrypted_data + decryped_bytes);
-			/* qq_send_file_ctl_packet(gc, QQ_FILE_CMD_PING, fh->sender_uid, 0); */
-			qq_send_file_ctl_packet(gc, QQ_FILE_CMD_SENDER_SAY_HELLO, fh.sender_uid, 0);
+			/* qq_send_file_ctl_packet(xfer, QQ_FILE_CMD_PING, fh->sender_uid, 0); */
+			qq_send_file_ctl_packet(xfer, QQ_FILE_CMD_SENDER_SAY_HELLO, fh.sender_uid, 0);
 			break;
 		case QQ_FILE_CMD_SENDER_SAY_HELLO:
 			/* I'm receiver, if we receive SAY_HELLO from sender, we send back the ACK */
 			decryped_bytes += 47;
 			decryped_bytes += qq_get8(&hellobyte, decrypted_data + decryped_bytes);
-			qq_send_file_ctl_packet(gc, QQ_FILE_CMD_SENDER_SAY_HELLO_ACK, fh.sender_uid, hellobyte);
-			qq_send_file_ctl_packet(gc, QQ_FILE_CMD_RECEIVER_SAY_HELLO, fh.sender_uid, 0);
+			qq_send_file_ctl_packet(xfer, QQ_FILE_CMD_SENDER_SAY_HELLO_ACK, fh.sender_uid, hellobyte);
+			qq_send_file_ctl_packet(xfer, QQ_FILE_CMD_RECEIVER_SAY_HELLO, fh.sender_uid, 0);
 			break;
 		case QQ_FILE_CMD_SENDER_SAY_HELLO_ACK:
 			/* I'm sender, do nothing */
@@ -545,156 +796,341 @@ static void _qq_process_recv_file_ctl_packet(PurpleConnection *gc, guint8 *data,
 			/* I'm sender, ack the hello packet and send the first data */
 			decryped_bytes += 47;
 			decryped_bytes += qq_get8(&hellobyte, decrypted_data + decryped_bytes);
-			qq_send_file_ctl_packet(gc, QQ_FILE_CMD_RECEIVER_SAY_HELLO_ACK, fh.sender_uid, hellobyte);
-			_qq_send_file_data_packet(gc, QQ_FILE_CMD_FILE_OP, QQ_FILE_BASIC_INFO, 0, 0, NULL, 0);
+			qq_send_file_ctl_packet(xfer, QQ_FILE_CMD_RECEIVER_SAY_HELLO_ACK, fh.sender_uid, hellobyte);
+			_qq_send_file_basic_info(xfer);
 			break;
 		case QQ_FILE_CMD_RECEIVER_SAY_HELLO_ACK:
 			/* I'm receiver, do nothing */
 			break;
 		case QQ_FILE_CMD_PING:
 			/* I'm receiver, ack the PING */
-			qq_send_file_ctl_packet(gc, QQ_FILE_CMD_PONG, fh.sender_uid, 0);
+			qq_send_file_ctl_packet(xfer, QQ_FILE_CMD_PONG, fh.sender_uid, 0);
 			break;
 		case QQ_FILE_CMD_PONG:
-			qq_send_file_ctl_packet(gc, QQ_FILE_CMD_SENDER_SAY_HELLO, fh.sender_uid, 0);
+			qq_send_file_ctl_packet(xfer, QQ_FILE_CMD_SENDER_SAY_HELLO, fh.sender_uid, 0);
 			break;
 		default:
 			purple_debug_info("QQ", "unprocess file command %d\n", packet_type);
 	}
 }
 
-static void _qq_recv_file_progess(PurpleConnection *gc, guint8 *buffer, guint16 len, guint32 index, guint32 offset)
+static void _qq_window_reset(ft_info *info, PurpleXfer *xfer)
+{
+	qq_file_window_reset(&info->window, info->fragment_num,
+			purple_account_get_int(purple_xfer_get_account(xfer), "file_window", QQ_FILE_WINDOW_DEFAULT));
+}
+
+static gint _qq_fragment_len(ft_info *info, guint32 index, PurpleXfer *xfer)
+{
+	if (index + 1 < info->fragment_num) return info->fragment_len;
+	return purple_xfer_get_size(xfer) - (gsize) index * info->fragment_len;
+}
+
+/* bytes of fragments below max_fragment_index and marked in the ring */
+static gsize _qq_window_bytes(ft_info *info, PurpleXfer *xfer)
+{
+	gsize bytes;
+	guint32 i;
+
+	bytes = MIN((gsize) info->window.max_fragment_index * info->fragment_len, purple_xfer_get_size(xfer));
+	for (i = info->window.max_fragment_index; i < info->window.max_fragment_index + QQ_FILE_WINDOW_MAX
+			&& i < info->fragment_num; i++) {
+		if (qq_file_window_test(&info->window, i)) bytes += _qq_fragment_len(info, i, xfer);
+	}
+	return bytes;
+}
+
+static gchar *_qq_recv_journal_name(PurpleXfer *xfer)
+{
+	return g_strconcat(purple_xfer_get_local_filename(xfer), QQ_FILE_JOURNAL_SUFFIX, NULL);
+}
+
+/* called with the file closed, so the mtime saved is the final one */
+static void _qq_recv_journal_save(PurpleXfer *xfer)
+{
+	ft_info *info = (ft_info *) xfer->data;
+	gchar *path;
+	guint8 *raw_data;
+	gint bytes, i;
+	struct stat st;
+
+	path = _qq_recv_journal_name(xfer);
+	if (purple_xfer_is_completed(xfer) || info->window.max_fragment_index == 0
+			|| g_stat(purple_xfer_get_local_filename(xfer), &st) != 0) {
+		g_unlink(path);
+		g_free(path);
+		return;
+	}
+
+	raw_data = g_newa(guint8, QQ_FILE_JOURNAL_LEN);
+	bytes = 0;
+	bytes += qq_putdata(raw_data + bytes, (guint8 *) QQ_FILE_JOURNAL_MAGIC, 4);
+	bytes += qq_put16(raw_data + bytes, QQ_FILE_JOURNAL_VERSION);
+	bytes += qq_putdata(raw_data + bytes, info->file_md5, sizeof(info->file_md5));
+	bytes += qq_put32(raw_data + bytes, purple_xfer_get_size(xfer));
+	bytes += qq_put32(raw_data + bytes, info->fragment_num);
+	bytes += qq_put32(raw_data + bytes, info->fragment_len);
+	bytes += qq_put32(raw_data + bytes, (guint32) st.st_mtime);
+	bytes += qq_put32(raw_data + bytes, info->window.max_fragment_index);
+	for (i = 0; i < QQ_FILE_WINDOW_MAX / 32; i++) {
+		bytes += qq_put32(raw_data + bytes, info->window.ring[i]);
+	}
+
+	/* mode 0600, it tells what is being received */
+	if (!purple_util_write_data_to_file_absolute(path, (gchar *) raw_data, bytes)) {
+		purple_debug_error("QQ", "Unable to write %s\n", path);
+	} else {
+		purple_debug_info("QQ", "Saved %d of %d fragments to %s\n",
+				info->window.max_fragment_index, info->fragment_num, path);
+	}
+	g_free(path);
+}
+
+/* load the journal into the window if it is for this very file,
+ * info->file_md5 is the one the sender just told */
+static gboolean _qq_recv_journal_load(PurpleXfer *xfer)
+{
+	ft_info *info = (ft_info *) xfer->data;
+	gchar *path, *contents;
+	gsize len;
+	guint8 *data, md5[QQ_KEY_LENGTH];
+	guint16 version;
+	guint32 size, fragment_num, fragment_len, mtime, done;
+	gint bytes, i;
+	struct stat st;
+	gboolean ok;
+
+	path = _qq_recv_journal_name(xfer);
+	ok = g_file_get_contents(path, &contents, &len, NULL);
+	g_free(path);
+	if (!ok) return FALSE;
+
+	data = (guint8 *) contents;
+	ok = FALSE;
+	if (len == QQ_FILE_JOURNAL_LEN && memcmp(data, QQ_FILE_JOURNAL_MAGIC, 4) == 0) {
+		bytes = 4;
+		bytes += qq_get16(&version, data + bytes);
+		bytes += qq_getdata(md5, sizeof(md5), data + bytes);
+		bytes += qq_get32(&size, data + bytes);
+		bytes += qq_get32(&fragment_num, data + bytes);
+		bytes += qq_get32(&fragment_len, data + bytes);
+		bytes += qq_get32(&mtime, data + bytes);
+		bytes += qq_get32(&done, data + bytes);
+
+		ok = version == QQ_FILE_JOURNAL_VERSION
+			&& memcmp(md5, info->file_md5, sizeof(md5)) == 0
+			&& size == purple_xfer_get_size(xfer)
+			&& fragment_num == info->fragment_num
+			&& fragment_len == info->fragment_len
+			&& done < fragment_num
+			&& (gsize) done * fragment_len >= MIN(size, QQ_FILE_MD5_MAXLEN)
+			&& g_stat(purple_xfer_get_local_filename(xfer), &st) == 0
+			&& (guint32) st.st_mtime == mtime;
+		if (ok) {
+			info->window.max_fragment_index = done;
+			for (i = 0; i < QQ_FILE_WINDOW_MAX / 32; i++) {
+				bytes += qq_get32(&info->window.ring[i], data + bytes);
+			}
+			for (i = 0; i < QQ_FILE_WINDOW_MAX; i++) {
+				if (qq_file_window_test(&info->window, done + i)) info->window.ring_count++;
+			}
+		}
+	}
+	g_free(contents);
+	return ok;
+}
+
+/* the head of the file on disk is hashed, resume if it is what the
+ * sender has, or start over. Then ack the basic info */
+static void _qq_recv_resume(PurpleXfer *xfer, const guint8 *head_md5)
+{
+	ft_info *info = (ft_info *) xfer->data;
+	gchar *path;
+
+	info->resume_wait = FALSE;
+	if (head_md5 != NULL && memcmp(head_md5, info->file_md5, sizeof(info->file_md5)) == 0
+			&& _qq_xfer_open_file(purple_xfer_get_local_filename(xfer), "r+b", xfer) == 0) {
+		info->file_opened = TRUE;
+		info->resume_fragment = info->window.max_fragment_index;
+		xfer->bytes_sent = _qq_window_bytes(info, xfer);
+		xfer->bytes_remaining = purple_xfer_get_size(xfer) - xfer->bytes_sent;
+		purple_xfer_update_progress(xfer);
+		purple_debug_info("QQ", "resume receiving from %dth fragment\n", info->resume_fragment);
+	} else {
+		purple_debug_info("QQ", "file on disk changed, receive it all again\n");
+		path = _qq_recv_journal_name(xfer);
+		g_unlink(path);
+		g_free(path);
+		_qq_window_reset(info, xfer);
+		info->resume_fragment = 0;
+	}
+	_qq_send_file_data_packet(xfer, QQ_FILE_CMD_FILE_OP_ACK, QQ_FILE_BASIC_INFO,
+			info->resume_fragment, 0, NULL, 0);
+}
+
+static void _qq_recv_file_progess(PurpleXfer *xfer, guint8 *buffer, guint16 len, guint32 index, guint32 offset)
 {
-	qq_data *qd = (qq_data *) gc->proto_data;
-	PurpleXfer *xfer = qd->xfer;
 	ft_info *info = (ft_info *) xfer->data;
-	guint32 mask;
 
 	purple_debug_info("QQ",
-			"receiving %dth fragment with length %d, slide window status %o, max_fragment_index %d\n",
-			index, len, info->window, info->max_fragment_index);
-	if (info->window == 0 && info->max_fragment_index == 0) {
+			"receiving %dth fragment with length %d, max_fragment_index %d\n",
+			index, len, info->window.max_fragment_index);
+	if (info->resume_wait) {
+		purple_debug_info("QQ", "still checking the file to resume, drop %dth fragment\n", index);
+		return;
+	}
+	if (!info->file_opened) {
 		if (_qq_xfer_open_file(purple_xfer_get_local_filename(xfer), "wb", xfer) == -1) {
 			purple_xfer_cancel_local(xfer);
 			return;
 		}
+		info->file_opened = TRUE;
 		purple_debug_info("QQ", "object file opened for writing\n");
 	}
-	mask = 0x1 << (index % sizeof(info->window));
-	if (index < info->max_fragment_index || (info->window & mask)) {
+	if (!qq_file_window_mark(&info->window, index)) {
 		purple_debug_info("QQ", "duplicate %dth fragment, drop it!\n", index+1);
 		return;
 	}
 
-	info->window |= mask;
-
 	_qq_xfer_write_file(buffer, index, len, xfer);
 
 	xfer->bytes_sent += len;
 	xfer->bytes_remaining -= len;
 	purple_xfer_update_progress(xfer);
+}
 
-	mask = 0x1 << (info->max_fragment_index % sizeof(info->window));
-	while (info->window & mask)
-	{
-		info->window &= ~mask;
-		info->max_fragment_index ++;
-		if (mask & 0x8000) mask = 0x0001;
-		else mask = mask << 1;
+static void _qq_send_fragment(PurpleXfer *xfer, guint32 index)
+{
+	const guint8 *data;
+	gint len;
+
+	data = _qq_xfer_fragment_view(xfer, index, &len);
+	if (data == NULL) {
+		purple_debug_error("QQ", "Unable to read %dth fragment\n", index);
+		return;
 	}
-	purple_debug_info("QQ", "procceed %dth fragment, slide window status %o, max_fragment_index %d\n",
-			index, info->window, info->max_fragment_index);
+	_qq_send_file_data_packet(xfer, QQ_FILE_CMD_FILE_OP, QQ_FILE_DATA_INFO,
+			index + 1, 0, data, len);
 }
 
-static void _qq_send_file_progess(PurpleConnection *gc)
+static gint64 _qq_xfer_now(void)
+{
+	return g_get_monotonic_time() / 1000;
+}
+
+static gboolean _qq_send_window_fill_timeout(gpointer data);
+
+/* send new fragments until cwnd of them are in flight, at most
+ * QQ_FILE_SEND_BURST now and the rest in next turns of the main loop */
+static void _qq_send_window_fill(PurpleXfer *xfer)
+{
+	ft_info *info = (ft_info *) xfer->data;
+	guint32 index;
+	gint64 now = _qq_xfer_now();
+	gint burst;
+
+	for (burst = 0; burst < QQ_FILE_SEND_BURST; burst++) {
+		if (!qq_file_window_next(&info->window, &index, now)) return;
+		_qq_send_fragment(xfer, index);
+	}
+	if (info->fill_timeout == 0) {
+		info->fill_timeout = purple_timeout_add(0, _qq_send_window_fill_timeout, xfer);
+	}
+}
+
+static gboolean _qq_send_window_fill_timeout(gpointer data)
+{
+	PurpleXfer *xfer = (PurpleXfer *) data;
+	ft_info *info = (ft_info *) xfer->data;
+
+	info->fill_timeout = 0;
+	_qq_send_window_fill(xfer);
+	return FALSE;
+}
+
+/* no ack moved the window for rto, resend only the holes */
+static gboolean _qq_send_resend_timeout(gpointer data)
+{
+	PurpleXfer *xfer = (PurpleXfer *) data;
+	ft_info *info = (ft_info *) xfer->data;
+	guint32 i;
+
+	if (!qq_file_window_stalled(&info->window, _qq_xfer_now())) return TRUE;
+
+	purple_debug_info("QQ", "resend fragments %d to %d not acked, window %d, rto %d\n",
+			info->window.max_fragment_index, info->window.next_fragment - 1,
+			info->window.cwnd, info->window.rto);
+	for (i = info->window.max_fragment_index; i < info->window.next_fragment; i++) {
+		if (!qq_file_window_test(&info->window, i)) _qq_send_fragment(xfer, i);
+	}
+	return TRUE;
+}
+
+static void _qq_send_file_progess(PurpleXfer *xfer)
 {
-	qq_data *qd = (qq_data *) gc->proto_data;
-	PurpleXfer *xfer = qd->xfer;
 	ft_info *info = (ft_info *) xfer->data;
-	guint32 mask;
-	guint8 *buffer;
-	guint i;
-	gint readbytes;
 
 	if (purple_xfer_get_bytes_remaining(xfer) <= 0) return;
-	if (info->window == 0 && info->max_fragment_index == 0)
+	if (!info->file_opened)
 	{
 		if (_qq_xfer_open_file(purple_xfer_get_local_filename(xfer), "rb", xfer) == -1) {
 			purple_xfer_cancel_local(xfer);
 			return;
 		}
+		info->file_opened = TRUE;
 	}
-	buffer = g_newa(guint8, info->fragment_len);
-	mask = 0x1 << (info->max_fragment_index % sizeof(info->window));
-	for (i = 0; i < sizeof(info->window); i++) {
-		if ((info->window & mask) == 0) {
-			readbytes = _qq_xfer_read_file(buffer, info->max_fragment_index + i, info->fragment_len, xfer);
-			if (readbytes > 0)
-				_qq_send_file_data_packet(gc, QQ_FILE_CMD_FILE_OP, QQ_FILE_DATA_INFO,
-						info->max_fragment_index + i + 1, 0, buffer, readbytes);
-		}
-		if (mask & 0x8000) mask = 0x0001;
-		else mask = mask << 1;
+	_qq_send_window_fill(xfer);
+	if (info->resend_timeout == 0) {
+		info->resend_timeout = purple_timeout_add(QQ_FILE_RESEND_CHECK, _qq_send_resend_timeout, xfer);
 	}
 }
 
-static void _qq_update_send_progess(PurpleConnection *gc, guint32 fragment_index)
+/* acks come one per fragment, so each is a selective ack */
+static void _qq_update_send_progess(PurpleXfer *xfer, guint32 fragment_index)
 {
-	guint32 mask;
-	guint8 *buffer;
-	gint readbytes;
-	qq_data *qd = (qq_data *) gc->proto_data;
-	PurpleXfer *xfer = qd->xfer;
 	ft_info *info = (ft_info *) xfer->data;
+	guint32 index;
 
 	purple_debug_info("QQ",
-			"receiving %dth fragment ack, slide window status %o, max_fragment_index %d\n",
-			fragment_index, info->window, info->max_fragment_index);
-	if (fragment_index < info->max_fragment_index ||
-			fragment_index >= info->max_fragment_index + sizeof(info->window)) {
+			"receiving %dth fragment ack, max_fragment_index %d, window %d\n",
+			fragment_index, info->window.max_fragment_index, info->window.cwnd);
+	if (!qq_file_window_ack(&info->window, fragment_index, _qq_xfer_now())) {
 		purple_debug_info("QQ", "duplicate %dth fragment, drop it!\n", fragment_index+1);
 		return;
 	}
-	mask = 0x1 << (fragment_index % sizeof(info->window));
-	if ((info->window & mask) == 0)
-	{
-		info->window |= mask;
-		if (fragment_index + 1 != info->fragment_num) {
-			xfer->bytes_sent += info->fragment_len;
-		} else {
-			xfer->bytes_sent += purple_xfer_get_size(xfer) % info->fragment_len;
-		}
-		xfer->bytes_remaining = purple_xfer_get_size(xfer) - purple_xfer_get_bytes_sent(xfer);
-		purple_xfer_update_progress(xfer);
-		if (purple_xfer_get_bytes_remaining(xfer) <= 0) {
-			/* We have finished sending the file */
-			purple_xfer_set_completed(xfer, TRUE);
-			return;
-		}
-		mask = 0x1 << (info->max_fragment_index % sizeof(info->window));
-		while (info->window & mask)
-		{
-			/* move the slide window */
-			info->window &= ~mask;
-
-			buffer = g_newa(guint8, info->fragment_len);
-			readbytes = _qq_xfer_read_file(buffer, info->max_fragment_index + sizeof(info->window),
-					info->fragment_len, xfer);
-			if (readbytes > 0)
-				_qq_send_file_data_packet(gc, QQ_FILE_CMD_FILE_OP, QQ_FILE_DATA_INFO,
-						info->max_fragment_index + sizeof(info->window) + 1, 0, buffer, readbytes);
-
-			info->max_fragment_index ++;
-			if (mask & 0x8000) mask = 0x0001;
-			else mask = mask << 1;
-		}
+	xfer->bytes_sent += _qq_fragment_len(info, fragment_index, xfer);
+	xfer->bytes_remaining = purple_xfer_get_size(xfer) - purple_xfer_get_bytes_sent(xfer);
+	purple_xfer_update_progress(xfer);
+	if (purple_xfer_get_bytes_remaining(xfer) <= 0) {
+		/* We have finished sending the file */
+		qq_xfer_stop(xfer);
+		purple_xfer_set_completed(xfer, TRUE);
+		return;
 	}
-	purple_debug_info("QQ",
-			"procceed %dth fragment ack, slide window status %o, max_fragment_index %d\n",
-			fragment_index, info->window, info->max_fragment_index);
+
+	while (qq_file_window_lost(&info->window, &index)) {
+		purple_debug_info("QQ", "fragment %d lost, window down to %d\n",
+				index, info->window.cwnd);
+		_qq_send_fragment(xfer, index);
+	}
+	_qq_send_window_fill(xfer);
 }
 
-static void _qq_process_recv_file_data(PurpleConnection *gc, guint8 *data, gint len)
+/* the receiver has all fragments below start from an earlier try */
+static void _qq_send_window_skip(PurpleXfer *xfer, guint32 start)
+{
+	ft_info *info = (ft_info *) xfer->data;
+
+	if (start == 0 || start >= info->fragment_num) return;
+
+	purple_debug_info("QQ", "receiver resumes from %dth fragment\n", start);
+	qq_file_window_skip(&info->window, start);
+	xfer->bytes_sent = (gsize) start * info->fragment_len;
+	xfer->bytes_remaining = purple_xfer_get_size(xfer) - xfer->bytes_sent;
+	purple_xfer_update_progress(xfer);
+}
+
+static void _qq_process_recv_file_data(PurpleXfer *xfer, guint8 *data, gint len)
 {
 	gint bytes ;
 	qq_file_header fh;
@@ -704,8 +1140,7 @@ static void _qq_process_recv_file_data(PurpleConnection *gc, guint8 *data, gint
 	guint32 fragment_index;
 	guint16 fragment_len;
 	guint32 fragment_offset;
-	qq_data *qd = (qq_data *) gc->proto_data;
-	ft_info *info = (ft_info *) qd->xfer->data;
+	ft_info *info = (ft_info *) xfer->data;
 
 	bytes = 0;
 	bytes += _qq_get_file_header(&fh, data + bytes);
@@ -720,20 +1155,31 @@ static void _qq_process_recv_file_data(PurpleConnection *gc, guint8 *data, gint
 			switch (sub_type)
 			{
 				case QQ_FILE_BASIC_INFO:
+					/* a resent one only needs the ack again */
+					if (info->resume_wait) break;
+					if (info->file_opened) {
+						_qq_send_file_data_packet(xfer, QQ_FILE_CMD_FILE_OP_ACK, sub_type,
+								info->resume_fragment, 0, NULL, 0);
+						break;
+					}
+
 					bytes += 4;	/* file length, we have already known it from xfer */
 					bytes += qq_get32(&info->fragment_num, data + bytes);
 					bytes += qq_get32(&info->fragment_len, data + bytes);
+					bytes += qq_getdata(info->file_md5, sizeof(info->file_md5), data + bytes);
 
-					/* FIXME: We must check the md5 here,
-					 * if md5 doesn't match we will ignore
-					 * the packet or send sth as error number */
-
-					info->max_fragment_index = 0;
-					info->window = 0;
+					_qq_window_reset(info, xfer);
 					purple_debug_info("QQ",
 							"start receiving data, %d fragments with %d length each\n",
 							info->fragment_num, info->fragment_len);
-					_qq_send_file_data_packet(gc, QQ_FILE_CMD_FILE_OP_ACK, sub_type,
+					if (_qq_recv_journal_load(xfer)) {
+						/* ack after the head on disk is checked */
+						info->resume_wait = TRUE;
+						qq_xfer_md5_start(xfer);
+						break;
+					}
+					info->resume_fragment = 0;
+					_qq_send_file_data_packet(xfer, QQ_FILE_CMD_FILE_OP_ACK, sub_type,
 							0, 0, NULL, 0);
 					break;
 				case QQ_FILE_DATA_INFO:
@@ -744,13 +1190,13 @@ static void _qq_process_recv_file_data(PurpleConnection *gc, guint8 *data, gint
 							"received %dth fragment with length %d, offset %d\n",
 							fragment_index, fragment_len, fragment_offset);
 
-					_qq_send_file_data_packet(gc, QQ_FILE_CMD_FILE_OP_ACK, sub_type,
+					_qq_send_file_data_packet(xfer, QQ_FILE_CMD_FILE_OP_ACK, sub_type,
 							fragment_index, packet_seq, NULL, 0);
-					_qq_recv_file_progess(gc, data + bytes, fragment_len, fragment_index, fragment_offset);
+					_qq_recv_file_progess(xfer, data + bytes, fragment_len, fragment_index, fragment_offset);
 					break;
 				case QQ_FILE_EOF:
 					purple_debug_info("QQ", "end of receiving\n");
-					_qq_send_file_data_packet(gc, QQ_FILE_CMD_FILE_OP_ACK, sub_type,
+					_qq_send_file_data_packet(xfer, QQ_FILE_CMD_FILE_OP_ACK, sub_type,
 							0, 0, NULL, 0);
 					break;
 			}
@@ -761,35 +1207,45 @@ static void _qq_process_recv_file_data(PurpleConnection *gc, guint8 *data, gint
 			switch (sub_type)
 			{
 				case QQ_FILE_BASIC_INFO:
-					info->max_fragment_index = 0;
-					info->window = 0;
+					if (info->file_opened) break;
+					_qq_window_reset(info, xfer);
+					/* resume only if the receiver is this client and has this file */
+					if (len - bytes >= 4 + 4 + QQ_KEY_LENGTH) {
+						bytes += qq_get32(&fragment_index, data + bytes);
+						if (memcmp(data + bytes, QQ_FILE_RESUME_MAGIC, 4) == 0
+								&& memcmp(data + bytes + 4, info->file_md5, sizeof(info->file_md5)) == 0) {
+							_qq_send_window_skip(xfer, fragment_index);
+						}
+					}
 					/* It is ready to send file data */
-					_qq_send_file_progess(gc);
+					_qq_send_file_progess(xfer);
 					break;
 				case QQ_FILE_DATA_INFO:
 					bytes += qq_get32(&fragment_index, data + bytes);
-					_qq_update_send_progess(gc, fragment_index);
-					if (purple_xfer_is_completed(qd->xfer))
-						_qq_send_file_data_packet(gc, QQ_FILE_CMD_FILE_OP, QQ_FILE_EOF, 0, 0, NULL, 0);
+					_qq_update_send_progess(xfer, fragment_index);
+					if (purple_xfer_is_completed(xfer))
+						_qq_send_file_data_packet(xfer, QQ_FILE_CMD_FILE_OP, QQ_FILE_EOF, 0, 0, NULL, 0);
 					/*	else
-						_qq_send_file_progess(gc); */
+						_qq_send_file_progess(xfer); */
 					break;
 				case QQ_FILE_EOF:
 					/* FIXME: OK, we can end the connection successfully */
-
-					_qq_send_file_data_packet(gc, QQ_FILE_EOF, 0, 0, 0, NULL, 0);
-					purple_xfer_set_completed(qd->xfer, TRUE);
+					qq_xfer_stop(xfer);
+					_qq_send_file_data_packet(xfer, QQ_FILE_EOF, 0, 0, 0, NULL, 0);
+					purple_xfer_set_completed(xfer, TRUE);
+					/* frees info and the slot for the buddy */
+					purple_xfer_end(xfer);
 					break;
 			}
 			break;
 		case QQ_FILE_EOF:
-			_qq_send_file_data_packet(gc, QQ_FILE_EOF, 0, 0, 0, NULL, 0);
-			purple_xfer_set_completed(qd->xfer, TRUE);
-			purple_xfer_end(qd->xfer);
+			_qq_send_file_data_packet(xfer, QQ_FILE_EOF, 0, 0, 0, NULL, 0);
+			purple_xfer_set_completed(xfer, TRUE);
+			purple_xfer_end(xfer);
 			break;
 		case QQ_FILE_BASIC_INFO:
 			purple_debug_info("QQ", "here\n");
-			_qq_send_file_data_packet(gc, QQ_FILE_DATA_INFO, 0, 0, 0, NULL, 0);
+			_qq_send_file_data_packet(xfer, QQ_FILE_DATA_INFO, 0, 0, 0, NULL, 0);
 			break;
 		default:
 			purple_debug_info("QQ", "_qq_process_recv_file_data: unknown packet type [%d]\n",
@@ -798,7 +1254,7 @@ static void _qq_process_recv_file_data(PurpleConnection *gc, guint8 *data, gint
 	}
 }
 
-void qq_process_recv_file(PurpleConnection *gc, guint8 *data, gint len)
+void qq_process_recv_file(PurpleXfer *xfer, guint8 *data, gint len)
 {
 	gint bytes;
 	guint8 tag;
@@ -808,10 +1264,10 @@ void qq_process_recv_file(PurpleConnection *gc, guint8 *data, gint len)
 
 	switch (tag) {
 		case QQ_FILE_CONTROL_PACKET_TAG:
-			_qq_process_recv_file_ctl_packet(gc, data + bytes, len - bytes);
+			_qq_process_recv_file_ctl_packet(xfer, data + bytes, len - bytes);
 			break;
 		case QQ_FILE_DATA_PACKET_TAG:
-			_qq_process_recv_file_data(gc, data + bytes, len - bytes);
+			_qq_process_recv_file_data(xfer, data + bytes, len - bytes);
 			break;
 		default:
 			purple_debug_info("QQ", "unknown packet tag\n");
@@ -59,8 +59,10 @@ enum {
 #define QQ_FILE_AGENT_PACKET_TAG 0x04
 /* #define QQ_PACKET_TAIL          0x03 */   /* all QQ text packets end with it */
 
-void qq_send_file_ctl_packet(PurpleConnection *gc, guint16 packet_type, guint32 to_uid, guint8 hellobyte);
-void qq_process_recv_file(PurpleConnection *gc, guint8 *data, gint len);
+void qq_send_file_ctl_packet(PurpleXfer *xfer, guint16 packet_type, guint32 to_uid, guint8 hellobyte);
+void qq_process_recv_file(PurpleXfer *xfer, guint8 *data, gint len);
 /* void qq_send_file_data_packet(PurpleConnection *gc, guint16 packet_type, guint8 sub_type, guint32 fragment_index, guint16 seq, guint8 *data, gint len); */
 void qq_xfer_close_file(PurpleXfer *xfer);
+void qq_xfer_md5_start(PurpleXfer *xfer);
+void qq_xfer_stop(PurpleXfer *xfer);
 #endif
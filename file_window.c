@@ -0,0 +1,191 @@
+/**
+ * @file file_window.c
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,  USA
+ *
+ *
+ * Selective ack window of file transfer, AIMD on the fragments in flight
+ */
+
+#include <string.h>
+
+#include "file_window.h"
+
+#define WINDOW_WORD(i)	(((i) % QQ_FILE_WINDOW_MAX) >> 5)
+#define WINDOW_MASK(i)	(1U << ((i) & 31))
+
+void qq_file_window_reset(qq_file_window *win, guint32 fragment_num, gint cwnd_max)
+{
+	memset(win, 0, sizeof(*win));
+	win->fragment_num = fragment_num;
+	win->cwnd_max = CLAMP(cwnd_max, 1, QQ_FILE_WINDOW_MAX);
+	win->cwnd = MIN(QQ_FILE_WINDOW_INIT, win->cwnd_max);
+	win->ssthresh = win->cwnd_max;
+	win->rto = QQ_FILE_RTO_INIT;
+}
+
+/* fragments below max_fragment_index are all set */
+gboolean qq_file_window_test(const qq_file_window *win, guint32 index)
+{
+	if (index < win->max_fragment_index) return TRUE;
+	if (index >= win->max_fragment_index + QQ_FILE_WINDOW_MAX) return FALSE;
+	return (win->ring[WINDOW_WORD(index)] & WINDOW_MASK(index)) != 0;
+}
+
+/* mark fragment i, then slide max_fragment_index over the marked run.
+ * Returns FALSE if it was marked before or is out of the ring */
+gboolean qq_file_window_mark(qq_file_window *win, guint32 index)
+{
+	if (index >= win->fragment_num || qq_file_window_test(win, index)
+			|| index >= win->max_fragment_index + QQ_FILE_WINDOW_MAX) {
+		return FALSE;
+	}
+
+	win->ring[WINDOW_WORD(index)] |= WINDOW_MASK(index);
+	win->ring_count++;
+	while (win->ring[WINDOW_WORD(win->max_fragment_index)] & WINDOW_MASK(win->max_fragment_index)) {
+		win->ring[WINDOW_WORD(win->max_fragment_index)] &= ~WINDOW_MASK(win->max_fragment_index);
+		win->ring_count--;
+		win->max_fragment_index++;
+	}
+	return TRUE;
+}
+
+/* next new fragment to send, if less than cwnd are sent and not acked.
+ * Acks above a hole let new ones out, so the hole gets the acks above
+ * it that qq_file_window_lost needs, up to the end of the ring */
+gboolean qq_file_window_next(qq_file_window *win, guint32 *index, gint64 now)
+{
+	if (win->next_fragment >= win->fragment_num
+			|| win->next_fragment >= win->max_fragment_index + QQ_FILE_WINDOW_MAX
+			|| win->next_fragment - win->max_fragment_index - win->ring_count >= win->cwnd) {
+		return FALSE;
+	}
+
+	if (win->next_fragment == win->max_fragment_index) win->move_time = now;
+	if (!win->rtt_timing) {
+		win->rtt_timing = TRUE;
+		win->rtt_fragment = win->next_fragment;
+		win->rtt_start = now;
+	}
+	*index = win->next_fragment++;
+	return TRUE;
+}
+
+/* rto = srtt + 4 * rttvar as RFC 6298, this also ends a backoff */
+static void _window_rtt(qq_file_window *win, gint rtt)
+{
+	if (win->srtt <= 0) {
+		win->srtt = rtt;
+		win->rttvar = rtt / 2;
+	} else {
+		win->rttvar = (3 * win->rttvar + ABS(win->srtt - rtt)) / 4;
+		win->srtt = (7 * win->srtt + rtt) / 8;
+	}
+	win->rto = CLAMP(win->srtt + 4 * win->rttvar, QQ_FILE_RTO_MIN, QQ_FILE_RTO_MAX);
+}
+
+/* acks come one per fragment, so each is a selective ack.
+ * Returns FALSE for a duplicate or one out of the window */
+gboolean qq_file_window_ack(qq_file_window *win, guint32 index, gint64 now)
+{
+	guint32 base = win->max_fragment_index;
+
+	if (index >= win->next_fragment || !qq_file_window_mark(win, index)) return FALSE;
+
+	if (win->rtt_timing && index == win->rtt_fragment) {
+		win->rtt_timing = FALSE;
+		_window_rtt(win, MAX(now - win->rtt_start, 1));
+	}
+	if (win->max_fragment_index != base) win->move_time = now;
+	win->high_ack = MAX(win->high_ack, index + 1);
+
+	/* no growth while the window of a loss drains */
+	if (win->max_fragment_index < win->recover_fragment || win->cwnd >= win->cwnd_max) return TRUE;
+
+	if (win->cwnd < win->ssthresh) {
+		win->cwnd++;
+	} else if (++win->cwnd_acks >= win->cwnd) {
+		/* additive increase, one more fragment per window of acks */
+		win->cwnd_acks = 0;
+		win->cwnd++;
+	}
+	return TRUE;
+}
+
+/* next hole with QQ_FILE_DUP_ACKS fragments acked above it, each is
+ * given once until the resend timeout. The first one of a window
+ * halves cwnd */
+gboolean qq_file_window_lost(qq_file_window *win, guint32 *index)
+{
+	win->resend_next = MAX(win->resend_next, win->max_fragment_index);
+	while (win->resend_next + QQ_FILE_DUP_ACKS < win->high_ack) {
+		*index = win->resend_next++;
+		if (!qq_file_window_test(win, *index)) {
+			if (win->rtt_timing && *index == win->rtt_fragment) win->rtt_timing = FALSE;
+			qq_file_window_loss(win);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* multiplicative decrease, once for the fragments in flight at a loss.
+ * Returns FALSE if still recovering from the last one */
+gboolean qq_file_window_loss(qq_file_window *win)
+{
+	if (win->max_fragment_index < win->recover_fragment) return FALSE;
+
+	win->cwnd = MAX(win->cwnd / 2, 1);
+	win->ssthresh = win->cwnd;
+	win->cwnd_acks = 0;
+	win->recover_fragment = win->next_fragment;
+	return TRUE;
+}
+
+/* called each QQ_FILE_RESEND_CHECK. TRUE if the window did not move for
+ * rto, then the holes below next_fragment are to be resent, a resent
+ * one may be lost again */
+gboolean qq_file_window_stalled(qq_file_window *win, gint64 now)
+{
+	if (win->next_fragment == win->max_fragment_index || now - win->move_time < win->rto) {
+		return FALSE;
+	}
+
+	qq_file_window_loss(win);
+	win->rto = MIN(win->rto * 2, QQ_FILE_RTO_MAX);
+	win->rtt_timing = FALSE;
+	win->move_time = now;
+	win->resend_next = win->next_fragment;
+	return TRUE;
+}
+
+/* the receiver has all fragments below start from an earlier try */
+void qq_file_window_skip(qq_file_window *win, guint32 start)
+{
+	memset(win->ring, 0, sizeof(win->ring));
+	win->ring_count = 0;
+	win->max_fragment_index = start;
+	win->next_fragment = start;
+	win->high_ack = start;
+	win->resend_next = start;
+	win->recover_fragment = start;
+}
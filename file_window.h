@@ -0,0 +1,92 @@
+/**
+ * @file file_window.h
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,  USA
+ */
+
+#ifndef _QQ_FILE_WINDOW_H_
+#define _QQ_FILE_WINDOW_H_
+
+#include <glib.h>
+
+/* slots in the fragment ring, no window can be larger */
+#define QQ_FILE_WINDOW_MAX 1024
+/* fragments in flight at start, the account option "file_window" caps the growth */
+#define QQ_FILE_WINDOW_INIT	8
+#define QQ_FILE_WINDOW_DEFAULT	256
+/* fragments acked above a hole before it is taken as lost and resent */
+#define QQ_FILE_DUP_ACKS	3
+/* ms without the window moving before holes are resent, until an rtt
+ * is measured. Then srtt + 4 * rttvar as qq_trans.c, doubled on each resend */
+#define QQ_FILE_RTO_INIT	1000
+#define QQ_FILE_RTO_MIN	200
+#define QQ_FILE_RTO_MAX	8000
+/* ms between checks of the resend timeout */
+#define QQ_FILE_RESEND_CHECK	100
+/* fragments sent in one main loop turn, so other transfers and im get a turn.
+ * qq_window throughput is the same from 8 to 128, the time a turn takes
+ * is not measured, 32 is a guess */
+#define QQ_FILE_SEND_BURST	32
+
+/* Fragments seen by one side of a transfer, and for the sender how many
+ * may be in flight. No io in here, file_trans.c sends and passes the
+ * time in ms */
+typedef struct _qq_file_window qq_file_window;
+struct _qq_file_window {
+	guint32 fragment_num;
+	/* for sender, fragments below are acked
+	 * for receiver, fragments below are written */
+	guint32 max_fragment_index;
+	/* fragments acked or written at or above max_fragment_index,
+	 * bit of fragment i is i % QQ_FILE_WINDOW_MAX */
+	guint32 ring[QQ_FILE_WINDOW_MAX / 32];
+	guint ring_count;	/* bits set in ring */
+	/* sender only */
+	guint32 next_fragment;	/* first fragment never sent */
+	guint cwnd;		/* fragments sent and not acked allowed, grows on acks */
+	guint cwnd_max;
+	guint ssthresh;		/* cwnd doubles each rtt below this, then grows by one */
+	guint cwnd_acks;	/* acks since cwnd grew */
+	guint32 high_ack;	/* above the highest fragment acked */
+	guint32 resend_next;	/* holes below were resent in this recovery */
+	guint32 recover_fragment;	/* no more decrease until this is acked */
+	/* one fragment never resent is timed at a time */
+	gboolean rtt_timing;
+	guint32 rtt_fragment;
+	gint64 rtt_start;
+	gint srtt;
+	gint rttvar;
+	gint rto;
+	gint64 move_time;	/* max_fragment_index moved or holes were resent */
+};
+
+void qq_file_window_reset(qq_file_window *win, guint32 fragment_num, gint cwnd_max);
+gboolean qq_file_window_test(const qq_file_window *win, guint32 index);
+gboolean qq_file_window_mark(qq_file_window *win, guint32 index);
+
+gboolean qq_file_window_next(qq_file_window *win, guint32 *index, gint64 now);
+gboolean qq_file_window_ack(qq_file_window *win, guint32 index, gint64 now);
+gboolean qq_file_window_lost(qq_file_window *win, guint32 *index);
+gboolean qq_file_window_loss(qq_file_window *win);
+gboolean qq_file_window_stalled(qq_file_window *win, gint64 now);
+void qq_file_window_skip(qq_file_window *win, guint32 start);
+
+#endif
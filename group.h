@@ -58,7 +58,17 @@ struct _qq_room_data {
 
 	gboolean is_show_chat;
 	gboolean has_got_members_info;
-	GList *members;
+	GArray *info_queue;		/* uids of members with stale info, drained into get_members_info */
+	guint info_pos;			/* next in info_queue to send */
+	gint info_pending;		/* get_members_info requests in flight */
+	guint32 info_class;		/* update class of the current get_members_info run */
+	guint info_gen;			/* current run, shipped with its requests */
+	time_t info_start;		/* when the current run was started */
+	GPtrArray *members;		/* qq_buddy_data, a member keeps its slot until removed */
+	GHashTable *member_index;	/* uid -> slot + 1 in members */
+	GArray *online;			/* guint32 words, a bit per slot set if member is online */
+	GArray *online_next;		/* online being built from a get_onlines reply */
+	GHashTable *member_dirty;	/* uid -> QQ_ROOM_MEMBER_DIRTY_* since last pushed to conversation */
 };
 
 GList *qq_chat_info(PurpleConnection *gc);
@@ -81,15 +81,72 @@ PurpleConversation *qq_room_conv_open(PurpleConnection *gc, qq_room_data *rmd)
 	return NULL;
 }
 
-/* refresh online member in group conversation window */
+/* we need unique identifiers for everyone in the chat or else we'll
+ * run into problems with functions like get_cb_real_name from qq.c */
+static gchar *room_member_conv_name(qq_buddy_data *bd)
+{
+	return (bd->nickname != NULL && *(bd->nickname) != '\0') ?
+			g_strdup_printf("%s (%u)", bd->nickname, bd->uid) :
+			g_strdup_printf("(%u)", bd->uid);
+}
+
+typedef struct {
+	qq_room_data *rmd;
+	PurpleConvChat *chat;
+	GList *names;		/* members new to the conversation, names owned by member */
+	GList *flags;
+} room_conv_sync;
+
+static void room_conv_sync_member(gpointer key, gpointer value, gpointer user_data)
+{
+	room_conv_sync *sync = (room_conv_sync *) user_data;
+	guint changed = GPOINTER_TO_UINT(value);
+	qq_buddy_data *bd;
+	gchar *name;
+	gint flag;
+
+	bd = qq_room_buddy_find(sync->rmd, GPOINTER_TO_UINT(key));
+	if (bd == NULL) return;
+
+	flag = 0;
+	/* TYPING to put online above OP and FOUNDER */
+	if (is_online(bd->status)) flag |= (PURPLE_CBFLAGS_TYPING | PURPLE_CBFLAGS_VOICE);
+	if(1 == (bd->role & 1)) flag |= PURPLE_CBFLAGS_OP;
+	if(bd->uid == sync->rmd->creator_uid) flag |= PURPLE_CBFLAGS_FOUNDER;
+
+	if (bd->conv_name == NULL) {
+		/* always put it even offline */
+		bd->conv_name = room_member_conv_name(bd);
+		bd->conv_flag = flag;
+		sync->names = g_list_prepend(sync->names, bd->conv_name);
+		sync->flags = g_list_prepend(sync->flags, GINT_TO_POINTER(flag));
+		return;
+	}
+
+	if (changed & QQ_ROOM_MEMBER_DIRTY_NAME) {
+		name = room_member_conv_name(bd);
+		if (strcmp(name, bd->conv_name) != 0) {
+			purple_conv_chat_rename_user(sync->chat, bd->conv_name, name);
+			g_free(bd->conv_name);
+			bd->conv_name = name;
+		} else {
+			g_free(name);
+		}
+	}
+	if (flag != bd->conv_flag) {
+		purple_conv_chat_user_set_flags(sync->chat, bd->conv_name, flag);
+		bd->conv_flag = flag;
+	}
+}
+
+/* refresh online member in group conversation window,
+ * only members marked by qq_room_buddy_changed are pushed */
 void qq_room_conv_set_onlines(PurpleConnection *gc, qq_room_data *rmd)
 {
-	GList *names, *list, *flags;
+	room_conv_sync sync;
 	qq_buddy_data *bd;
-	gchar *member_name, *member_uid;
 	PurpleConversation *conv;
-	gint flag;
-	gboolean is_find;
+	guint i;
 
 	g_return_if_fail(rmd != NULL);
 
@@ -99,65 +156,31 @@ void qq_room_conv_set_onlines(PurpleConnection *gc, qq_room_data *rmd)
 		purple_debug_warning("QQ", "Conversation \"%s\" is not opened\n", rmd->name);
 		return;
 	}
-	g_return_if_fail(rmd->members != NULL);
-
-	names = NULL;
-	flags = NULL;
-
-	list = rmd->members;
-	while (list != NULL) {
-		bd = (qq_buddy_data *) list->data;
-
-		/* we need unique identifiers for everyone in the chat or else we'll
-		 * run into problems with functions like get_cb_real_name from qq.c */
-		member_name =   (bd->nickname != NULL && *(bd->nickname) != '\0') ?
-				g_strdup_printf("%s (%u)", bd->nickname, bd->uid) :
-				g_strdup_printf("(%u)", bd->uid);
-		member_uid = g_strdup_printf("(%u)", bd->uid);
-
-		flag = 0;
-		/* TYPING to put online above OP and FOUNDER */
-		if (is_online(bd->status)) flag |= (PURPLE_CBFLAGS_TYPING | PURPLE_CBFLAGS_VOICE);
-		if(1 == (bd->role & 1)) flag |= PURPLE_CBFLAGS_OP;
-		if(bd->uid == rmd->creator_uid) flag |= PURPLE_CBFLAGS_FOUNDER;
-
-		is_find = TRUE;
-		if (purple_conv_chat_find_user(PURPLE_CONV_CHAT(conv), member_name))
-		{
-			purple_conv_chat_user_set_flags(PURPLE_CONV_CHAT(conv),
-					member_name,
-					flag);
-		} else if (purple_conv_chat_find_user(PURPLE_CONV_CHAT(conv), member_uid))
-		{
-			purple_conv_chat_user_set_flags(PURPLE_CONV_CHAT(conv),
-					member_uid,
-					flag);
-			purple_conv_chat_rename_user(PURPLE_CONV_CHAT(conv), member_uid, member_name);
-		} else {
-			is_find = FALSE;
+	g_return_if_fail(rmd->members->len > 0);
+
+	sync.rmd = rmd;
+	sync.chat = PURPLE_CONV_CHAT(conv);
+	sync.names = NULL;
+	sync.flags = NULL;
+
+	/* conversation is new or reopened, push everyone */
+	if (purple_conv_chat_get_users(sync.chat) == NULL) {
+		for (i = 0; i < rmd->members->len; i++) {
+			bd = (qq_buddy_data *) g_ptr_array_index(rmd->members, i);
+			g_free(bd->conv_name);
+			bd->conv_name = NULL;
+			qq_room_buddy_changed(rmd, bd->uid, QQ_ROOM_MEMBER_DIRTY_FLAG);
 		}
-		if (!is_find) {
-			/* always put it even offline */
-			names = g_list_append(names, member_name);
-			flags = g_list_append(flags, GINT_TO_POINTER(flag));
-		} else {
-			g_free(member_name);
-		}
-		g_free(member_uid);
-		list = list->next;
 	}
 
-	if (names != NULL && flags != NULL) {
-		purple_conv_chat_add_users(PURPLE_CONV_CHAT(conv), names, NULL, flags, FALSE);
-	}
+	g_hash_table_foreach(rmd->member_dirty, room_conv_sync_member, &sync);
+	g_hash_table_remove_all(rmd->member_dirty);
 
-	/* clean up names */
-	while (names != NULL) {
-		member_name = (gchar *) names->data;
-		names = g_list_remove(names, member_name);
-		g_free(member_name);
+	if (sync.names != NULL && sync.flags != NULL) {
+		purple_conv_chat_add_users(sync.chat, sync.names, NULL, sync.flags, FALSE);
 	}
-	g_list_free(flags);
+	g_list_free(sync.names);
+	g_list_free(sync.flags);
 }
 
 void qq_room_got_chat_in(PurpleConnection *gc,
@@ -32,9 +32,11 @@
 #include "group_internal.h"
 #include "group_info.h"
 #include "buddy_list.h"
+#include "buddy_opt.h"
 #include "qq_define.h"
 #include "packet_parse.h"
 #include "qq_network.h"
+#include "qq_process.h"
 #include "utils.h"
 
 /* we check who needs to update member info every minutes
@@ -48,72 +50,92 @@ static gboolean check_update_interval(qq_buddy_data *member)
 		(time(NULL) - member->last_update) > QQ_GROUP_CHAT_REFRESH_NICKNAME_INTERNAL;
 }
 
-/* this is done when we receive the reply to get_online_members sub_cmd
- * all member are set offline, and then only those in reply packets are online */
-static void set_all_offline(qq_room_data *rmd)
+/* reply of get_members_info is uid, face, age, gender, a byte string nick,
+ * 2 unknown bytes and 2 flags for each member, ask as many as the reply
+ * can hold in one packet, and keep a few of them in flight */
+#define QQ_ROOM_INFO_BATCH ((MAX_PACKET_SIZE - 128) / (4 + 2 + 1 + 1 + 1 + 0xff + 2 + 1 + 1))
+#define QQ_ROOM_INFO_WINDOW 3
+/* a run with requests still in flight after this long lost a reply,
+ * both values are unmeasured guesses */
+#define QQ_ROOM_INFO_TIMEOUT 60
+
+static void room_info_send_next(PurpleConnection *gc, qq_room_data *rmd)
 {
-	GList *list;
-	qq_buddy_data *bd;
-	g_return_if_fail(rmd != NULL);
+	guint8 *raw_data;
+	gint bytes;
+	guint count, i;
 
-	list = rmd->members;
-	while (list != NULL) {
-		bd = (qq_buddy_data *) list->data;
-		bd->status = QQ_BUDDY_CHANGE_TO_OFFLINE;
-		list = list->next;
+	count = MIN(rmd->info_queue->len - rmd->info_pos, QQ_ROOM_INFO_BATCH);
+	raw_data = g_newa(guint8, 4 * count);
+
+	bytes = 0;
+	for (i = 0; i < count; i++) {
+		bytes += qq_put32(raw_data + bytes,
+				g_array_index(rmd->info_queue, guint32, rmd->info_pos + i));
 	}
+	rmd->info_pos += count;
+	rmd->info_pending++;
+
+	qq_send_room_cmd_mess(gc, QQ_ROOM_CMD_GET_MEMBERS_INFO, rmd->id, raw_data, bytes,
+			rmd->info_class, rmd->info_gen);
 }
 
-/* send packet to get info for each group member */
-gint qq_request_room_get_members_info( PurpleConnection *gc, guint32 room_id, guint32 update_class, guint32 index )
+/* queue members whose info is outdated and send the first requests,
+ * return the number of members queued */
+gint qq_request_room_get_members_info( PurpleConnection *gc, guint32 room_id, guint32 update_class )
 {
-	guint8 *raw_data;
-	gint bytes, num;
-	GList *list;
 	qq_room_data *rmd;
 	qq_buddy_data *bd;
-	guint32 i = 0;
+	gboolean takeover;
+	guint i;
 
 	g_return_val_if_fail(room_id > 0, 0);
 
 	rmd  = qq_room_data_find(gc, room_id);
 	g_return_val_if_fail(rmd != NULL, 0);
 
-	for (num = 0, list = rmd->members; list != NULL; list = list->next) {
-		bd = (qq_buddy_data *) list->data;
-		if (check_update_interval(bd))
-			num++;
-	}
-
-	if (num <= 0) {
-		purple_debug_info("QQ", "No group member info needs to be updated now.\n");
+	/* replies of a run in flight would be taken for the new run's,
+	 * let it finish, unless it is stuck on a lost reply */
+	if (rmd->info_pending > 0 && time(NULL) - rmd->info_start < QQ_ROOM_INFO_TIMEOUT) {
+		purple_debug_info("QQ", "Group \"%s\" member info is being updated, %d in flight\n",
+				rmd->name, rmd->info_pending);
 		return 0;
 	}
 
-	raw_data = g_newa(guint8, 4 * num);
+	/* the update of all rooms waits on the run being dropped,
+	 * the new run carries it on */
+	takeover = rmd->info_pending > 0 && rmd->info_class == QQ_CMD_CLASS_UPDATE_ALL
+		&& update_class != QQ_CMD_CLASS_UPDATE_ALL;
+	if (takeover) {
+		purple_debug_info("QQ", "Group \"%s\" member info timed out, taking over update of all rooms\n",
+				rmd->name);
+		update_class = QQ_CMD_CLASS_UPDATE_ALL;
+	}
 
-	bytes = 0;
+	g_array_set_size(rmd->info_queue, 0);
+	for (i = 0; i < rmd->members->len; i++) {
+		bd = (qq_buddy_data *) g_ptr_array_index(rmd->members, i);
+		if (check_update_interval(bd))
+			g_array_append_val(rmd->info_queue, bd->uid);
+	}
+	rmd->info_pos = 0;
+	rmd->info_pending = 0;
+	rmd->info_class = update_class;
+	rmd->info_gen++;
+	rmd->info_start = time(NULL);
 
-	list = rmd->members;
-	/* index shipped from last request 
-		send 30 uids one time	*/
-	while (list != NULL) {
-		if (i>=index)
-		{
-			bd = (qq_buddy_data *) list->data;
-			if (check_update_interval(bd))
-				bytes += qq_put32(raw_data + bytes, bd->uid);
+	if (rmd->info_queue->len == 0) {
+		purple_debug_info("QQ", "No group member info needs to be updated now.\n");
+		if (takeover) {
+			qq_update_all_rooms(gc, QQ_ROOM_CMD_GET_MEMBERS_INFO, room_id);
 		}
-		i++;
-		if (i==index+30) break;
-		list = list->next;
+		return 0;
 	}
-	/* if reach the end */
-	if (list == NULL)	i=0;
 
-	qq_send_room_cmd_mess(gc, QQ_ROOM_CMD_GET_MEMBERS_INFO, rmd->id, raw_data, bytes,
-			update_class, i);
-	return num;
+	while (rmd->info_pending < QQ_ROOM_INFO_WINDOW && rmd->info_pos < rmd->info_queue->len) {
+		room_info_send_next(gc, rmd);
+	}
+	return rmd->info_queue->len;
 }
 
 static gchar *get_role_desc(qq_room_role role)
@@ -218,7 +240,7 @@ void qq_process_room_cmd_get_info(guint8 *data, gint data_len, guint32 action, P
 	PurpleConversation *conv;
 	guint8 organization, role;
 	guint16 max_members;
-	guint32 resend_flag, member_uid, id, qun_id, last_uid;
+	guint32 resend_flag, member_uid, id, qun_id, last_uid, creator_uid;
 	gint bytes; 
 	guint num=0;
 	guint8 has_more=0;
@@ -247,7 +269,15 @@ void qq_process_room_cmd_get_info(guint8 *data, gint data_len, guint32 action, P
 	{
 		bytes += qq_get8(&(rmd->type8), data + bytes);
 		bytes += 4;	//maybe vip sign
-		bytes += qq_get32(&(rmd->creator_uid), data + bytes);
+		bytes += qq_get32(&creator_uid, data + bytes);
+		if (creator_uid != rmd->creator_uid) {
+			/* founder flag moves */
+			if (qq_room_buddy_find(rmd, rmd->creator_uid) != NULL)
+				qq_room_buddy_changed(rmd, rmd->creator_uid, QQ_ROOM_MEMBER_DIRTY_FLAG);
+			if (qq_room_buddy_find(rmd, creator_uid) != NULL)
+				qq_room_buddy_changed(rmd, creator_uid, QQ_ROOM_MEMBER_DIRTY_FLAG);
+			rmd->creator_uid = creator_uid;
+		}
 		if (rmd->creator_uid == qd->uid)
 			rmd->my_role = QQ_ROOM_ROLE_ADMIN;
 		bytes += qq_get8(&(rmd->auth_type), data + bytes);
@@ -293,8 +323,10 @@ void qq_process_room_cmd_get_info(guint8 *data, gint data_len, guint32 action, P
 #endif
 		
 		bd = qq_room_buddy_find_or_new(gc, rmd, member_uid);
-		if (bd != NULL)
+		if (bd != NULL && bd->role != role) {
 			bd->role = role;
+			qq_room_buddy_changed(rmd, member_uid, QQ_ROOM_MEMBER_DIRTY_FLAG);
+		}
 	}
 
 	purple_debug_info("QQ", "Qun \"%s\" has received %d members\n", rmd->name, num);
@@ -327,9 +359,8 @@ void qq_process_room_cmd_get_onlines(guint8 *data, gint len, PurpleConnection *g
 {
 	guint32 room_id, member_uid;
 	guint8 unknown;
-	gint bytes, num;
+	gint bytes, num, changed;
 	qq_room_data *rmd;
-	qq_buddy_data *bd;
 
 	g_return_if_fail(data != NULL && len > 0);
 
@@ -349,27 +380,28 @@ void qq_process_room_cmd_get_onlines(guint8 *data, gint len, PurpleConnection *g
 		return;
 	}
 
-	/* set all offline first, then update those online */
-	set_all_offline(rmd);
+	/* only those in reply packets are online, the rest go offline */
+	qq_room_onlines_begin(rmd);
 	num = 0;
 	while (bytes < len) {
 		bytes += qq_get32(&member_uid, data + bytes);
 		num++;
-		bd = qq_room_buddy_find_or_new(gc, rmd, member_uid);
-		if (bd != NULL)
-			bd->status = QQ_BUDDY_ONLINE_NORMAL;
+		qq_room_onlines_add(gc, rmd, member_uid);
 	}
 	if(bytes > len) {
 		purple_debug_error("QQ",
 			"group_cmd_get_online_members: Dangerous error! maybe protocol changed, notify developers!");
 	}
 
-	purple_debug_info("QQ", "Group \"%s\" has %d online members\n", rmd->name, num);
+	changed = qq_room_onlines_commit(rmd);
+	purple_debug_info("QQ", "Group \"%s\" has %d online members, %d changed\n",
+			rmd->name, num, changed);
 	qq_room_conv_set_onlines(gc, rmd);
 }
 
-/* process the reply to get_members_info packet */
-void qq_process_room_cmd_get_members_info( guint8 *data, gint len, guint32 index, PurpleConnection *gc )
+/* process the reply to get_members_info packet, ship_value is the run
+ * it was sent in. return TRUE when it is the last reply of current run */
+gboolean qq_process_room_cmd_get_members_info( guint8 *data, gint len, guintptr ship_value, PurpleConnection *gc )
 {
 	gint bytes;
 	gint num;
@@ -379,24 +411,24 @@ void qq_process_room_cmd_get_members_info( guint8 *data, gint len, guint32 index
 	qq_buddy_data *bd;
 	gchar *nick;
 
-	g_return_if_fail(data != NULL && len > 0);
+	g_return_val_if_fail(data != NULL && len > 0, TRUE);
 
 	/* qq_show_packet("qq_process_room_cmd_get_members_info", data, len); */
 
 	bytes = 0;
 	bytes += qq_get32(&id, data + bytes);
-	g_return_if_fail(id > 0);
+	g_return_val_if_fail(id > 0, TRUE);
 
 	rmd = qq_room_data_find(gc, id);
-	g_return_if_fail(rmd != NULL);
+	g_return_val_if_fail(rmd != NULL, TRUE);
 
 	num = 0;
 
 	while (bytes < len) {
 		bytes += qq_get32(&member_uid, data + bytes);
-		g_return_if_fail(member_uid > 0);
+		if (member_uid == 0) break;
 		bd = qq_room_buddy_find_or_new(gc, rmd, member_uid);
-		g_return_if_fail(bd != NULL);
+		if (bd == NULL) break;
 
 		num++;
 		bytes += qq_get16(&(bd->face), data + bytes);
@@ -409,7 +441,11 @@ void qq_process_room_cmd_get_members_info( guint8 *data, gint len, guint32 index
 		bytes += qq_get8(&(bd->comm_flag), data + bytes);
 
 		qq_filter_str(nick);
-		bd->nickname = g_strdup(nick);
+		if (bd->nickname == NULL || strcmp(bd->nickname, nick) != 0) {
+			qq_nick_release(bd->nickname);
+			bd->nickname = qq_nick_intern(nick);
+			qq_room_buddy_changed(rmd, member_uid, QQ_ROOM_MEMBER_DIRTY_NAME);
+		}
 		g_free(nick);
 
 #if 0
@@ -424,14 +460,24 @@ void qq_process_room_cmd_get_members_info( guint8 *data, gint len, guint32 index
 		purple_debug_error("QQ",
 				"group_cmd_get_members_info: Dangerous error! maybe protocol changed, notify developers!");
 	}
-	purple_debug_info("QQ", "Group \"%s\" got %d member info\n", rmd->name, num);
+	if (ship_value != rmd->info_gen) {
+		/* late reply of a run given up, the members are updated anyway */
+		purple_debug_info("QQ", "Group \"%s\" got %d member info of an old run\n",
+				rmd->name, num);
+		return FALSE;
+	}
+	if (rmd->info_pending > 0) rmd->info_pending--;
+	purple_debug_info("QQ", "Group \"%s\" got %d member info, %u of %u sent, %d in flight\n",
+			rmd->name, num, rmd->info_pos, rmd->info_queue->len, rmd->info_pending);
 
-	if (index)
-	{
-		qq_request_room_get_members_info(gc, id, 0, index);
-		return;
+	if (rmd->info_pos < rmd->info_queue->len) {
+		room_info_send_next(gc, rmd);
+	}
+	if (rmd->info_pending > 0) {
+		return FALSE;
 	}
 	rmd->has_got_members_info = TRUE;
 	qq_room_conv_set_onlines(gc, rmd);
+	return TRUE;
 }
 
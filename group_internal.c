@@ -48,8 +48,13 @@ qq_room_data *room_data_new(guint32 id, guint32 qun_id, const gchar *title)
 	rmd->name = g_strdup(title == NULL ? "" : title);
 	rmd->intro = g_strdup("");
 	rmd->bulletin = g_strdup("");
-	rmd->members = NULL;
+	rmd->members = g_ptr_array_new();
+	rmd->member_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+	rmd->member_dirty = g_hash_table_new(g_direct_hash, g_direct_equal);
+	rmd->online = g_array_new(FALSE, TRUE, sizeof(guint32));
+	rmd->online_next = g_array_new(FALSE, TRUE, sizeof(guint32));
 	rmd->has_got_members_info = FALSE;
+	rmd->info_queue = g_array_new(FALSE, FALSE, sizeof(guint32));
 	rmd->is_show_chat = TRUE;
 	return rmd;
 }
@@ -78,20 +83,23 @@ static qq_room_data *room_data_new_by_hashtable(PurpleConnection *gc, GHashTable
 /* gracefully free all members in a room */
 static void room_buddies_free(qq_room_data *rmd)
 {
-	gint i;
-	GList *list;
-	qq_buddy_data *bd;
+	guint i;
 
 	g_return_if_fail(rmd != NULL);
-	i = 0;
-	while (NULL != (list = rmd->members)) {
-		bd = (qq_buddy_data *) list->data;
-		i++;
-		rmd->members = g_list_remove(rmd->members, bd);
-		qq_buddy_data_free(bd);
+	for (i = 0; i < rmd->members->len; i++) {
+		qq_buddy_data_free(g_ptr_array_index(rmd->members, i));
 	}
 
+	g_ptr_array_free(rmd->members, TRUE);
+	g_hash_table_destroy(rmd->member_index);
+	g_hash_table_destroy(rmd->member_dirty);
+	g_array_free(rmd->online, TRUE);
+	g_array_free(rmd->online_next, TRUE);
 	rmd->members = NULL;
+	rmd->member_index = NULL;
+	rmd->member_dirty = NULL;
+	rmd->online = NULL;
+	rmd->online_next = NULL;
 }
 
 /* gracefully free the memory for one qq_room_data */
@@ -99,6 +107,7 @@ static void room_data_free(qq_room_data *rmd)
 {
 	g_return_if_fail(rmd != NULL);
 	room_buddies_free(rmd);
+	g_array_free(rmd->info_queue, TRUE);
 	g_free(rmd->name);
 	g_free(rmd->intro);
 	g_free(rmd->bulletin);
@@ -171,7 +180,7 @@ PurpleChat *qq_room_find_or_new(PurpleConnection *gc, guint32 id, guint32 qun_id
 		rmd = room_data_new(id, qun_id, NULL);
 		g_return_val_if_fail(rmd != NULL, NULL);
 		rmd->my_role = QQ_ROOM_ROLE_YES;
-		qd->rooms = g_slist_append(qd->rooms, rmd);
+		qq_room_data_add(gc, rmd);
 	}
 
 	num_str = g_strdup_printf("%u", qun_id);
@@ -200,7 +209,11 @@ void qq_room_remove(PurpleConnection *gc, guint32 id)
 	g_return_if_fail (rmd != NULL);
 
 	qun_id = rmd->qun_id;
+	g_hash_table_remove(qd->room_index, GUINT_TO_POINTER(id));
 	qd->rooms = g_slist_remove(qd->rooms, rmd);
+	if (qd->rooms_tail != NULL && qd->rooms_tail->data == rmd) {
+		qd->rooms_tail = g_slist_last(qd->rooms);
+	}
 	room_data_free(rmd);
 
 	purple_debug_info("QQ", "Find and remove chat, qun_id %u\n", qun_id);
@@ -213,94 +226,207 @@ void qq_room_remove(PurpleConnection *gc, guint32 id)
 	purple_blist_remove_chat(chat);
 }
 
+#define ONLINE_WORD(bits, slot)	g_array_index((bits), guint32, (slot) / 32)
+#define ONLINE_MASK(slot)	(1u << ((slot) % 32))
+
+/* slot of uid in members, -1 if not a member */
+static gint room_buddy_slot(qq_room_data *rmd, guint32 uid)
+{
+	return GPOINTER_TO_INT(g_hash_table_lookup(rmd->member_index, GUINT_TO_POINTER(uid))) - 1;
+}
+
+static void online_bits_fit(GArray *bits, guint slots)
+{
+	if (bits->len < (slots + 31) / 32) {
+		g_array_set_size(bits, (slots + 31) / 32);
+	}
+}
+
+/* exactly the words for slots, bits above the last slot cleared */
+static void online_bits_size(GArray *bits, guint slots)
+{
+	g_array_set_size(bits, (slots + 31) / 32);
+	if (slots % 32 != 0) {
+		ONLINE_WORD(bits, slots - 1) &= ONLINE_MASK(slots) - 1;
+	}
+}
+
 /* find a qq_buddy_data by uid, called by im.c */
 qq_buddy_data *qq_room_buddy_find(qq_room_data *rmd, guint32 uid)
 {
-	GList *list;
-	qq_buddy_data *bd;
+	gint slot;
 	g_return_val_if_fail(rmd != NULL && uid > 0, NULL);
 
-	list = rmd->members;
-	while (list != NULL) {
-		bd = (qq_buddy_data *) list->data;
-		if (bd->uid == uid)
-			return bd;
-		else
-			list = list->next;
-	}
-
-	return NULL;
+	slot = room_buddy_slot(rmd, uid);
+	return (slot < 0) ? NULL : g_ptr_array_index(rmd->members, slot);
 }
 
-/* remove a qq_buddy_data by uid, called by qq_group_opt.c */
+/* remove a qq_buddy_data by uid, called by qq_group_opt.c
+ * the last member moves into the freed slot, with its online bit */
 void qq_room_buddy_remove(qq_room_data *rmd, guint32 uid)
 {
-	GList *list;
 	qq_buddy_data *bd;
+	gint slot, last;
 	g_return_if_fail(rmd != NULL && uid > 0);
 
-	list = rmd->members;
-	while (list != NULL) {
-		bd = (qq_buddy_data *) list->data;
-		if (bd->uid == uid) {
-			rmd->members = g_list_remove(rmd->members, bd);
-			return;
-		} else {
-			list = list->next;
+	slot = room_buddy_slot(rmd, uid);
+	if (slot < 0) return;
+	bd = g_ptr_array_index(rmd->members, slot);
+	last = rmd->members->len - 1;
+
+	g_hash_table_remove(rmd->member_index, GUINT_TO_POINTER(uid));
+	g_hash_table_remove(rmd->member_dirty, GUINT_TO_POINTER(uid));
+
+	ONLINE_WORD(rmd->online, slot) &= ~ONLINE_MASK(slot);
+	if (slot != last) {
+		qq_buddy_data *moved = g_ptr_array_index(rmd->members, last);
+
+		g_hash_table_insert(rmd->member_index, GUINT_TO_POINTER(moved->uid), GINT_TO_POINTER(slot + 1));
+		if (ONLINE_WORD(rmd->online, last) & ONLINE_MASK(last)) {
+			ONLINE_WORD(rmd->online, slot) |= ONLINE_MASK(slot);
+			ONLINE_WORD(rmd->online, last) &= ~ONLINE_MASK(last);
+		}
+	}
+	g_ptr_array_remove_index_fast(rmd->members, slot);
+	online_bits_size(rmd->online, rmd->members->len);
+	qq_buddy_data_free(bd);
+}
+
+/* get_onlines reply: begin, add each uid, then commit.
+ * Only members whose bit flips get a new status */
+void qq_room_onlines_begin(qq_room_data *rmd)
+{
+	g_return_if_fail(rmd != NULL);
+
+	g_array_set_size(rmd->online_next, 0);
+	online_bits_fit(rmd->online_next, rmd->members->len);
+}
+
+void qq_room_onlines_add(PurpleConnection *gc, qq_room_data *rmd, guint32 uid)
+{
+	gint slot;
+	g_return_if_fail(rmd != NULL && uid > 0);
+
+	if (qq_room_buddy_find_or_new(gc, rmd, uid) == NULL) return;
+	slot = room_buddy_slot(rmd, uid);
+	online_bits_fit(rmd->online_next, slot + 1);
+	ONLINE_WORD(rmd->online_next, slot) |= ONLINE_MASK(slot);
+}
+
+/* return the number of members changed */
+gint qq_room_onlines_commit(qq_room_data *rmd)
+{
+	GArray *swap;
+	qq_buddy_data *bd;
+	guint32 diff;
+	guint w, slot;
+	gint count = 0;
+
+	g_return_val_if_fail(rmd != NULL, 0);
+
+	/* both may be longer after members were removed */
+	online_bits_size(rmd->online, rmd->members->len);
+	online_bits_size(rmd->online_next, rmd->members->len);
+
+	for (w = 0; w < rmd->online->len; w++) {
+		diff = g_array_index(rmd->online, guint32, w) ^ g_array_index(rmd->online_next, guint32, w);
+		for (; diff != 0; diff &= diff - 1) {
+			slot = w * 32 + g_bit_nth_lsf(diff, -1);
+			bd = g_ptr_array_index(rmd->members, slot);
+			bd->status = (ONLINE_WORD(rmd->online_next, slot) & ONLINE_MASK(slot))
+				? QQ_BUDDY_ONLINE_NORMAL : QQ_BUDDY_CHANGE_TO_OFFLINE;
+			qq_room_buddy_changed(rmd, bd->uid, QQ_ROOM_MEMBER_DIRTY_FLAG);
+			count++;
 		}
 	}
+
+	swap = rmd->online;
+	rmd->online = rmd->online_next;
+	rmd->online_next = swap;
+	return count;
+}
+
+/* mark a member to be pushed by next qq_room_conv_set_onlines */
+void qq_room_buddy_changed(qq_room_data *rmd, guint32 uid, guint changed)
+{
+	guint old;
+	g_return_if_fail(rmd != NULL && uid > 0);
+
+	old = GPOINTER_TO_UINT(g_hash_table_lookup(rmd->member_dirty, GUINT_TO_POINTER(uid)));
+	g_hash_table_insert(rmd->member_dirty, GUINT_TO_POINTER(uid), GUINT_TO_POINTER(old | changed));
 }
 
 qq_buddy_data *qq_room_buddy_find_or_new(PurpleConnection *gc, qq_room_data *rmd, guint32 member_uid)
 {
 	qq_buddy_data *member, *bd;
 	PurpleBuddy *buddy;
-	gchar * member_name;
 	g_return_val_if_fail(rmd != NULL && member_uid > 0, NULL);
 
 	member = qq_room_buddy_find(rmd, member_uid);
 	if (member == NULL) {	/* first appear during my session */
 		member = g_new0(qq_buddy_data, 1);
 		member->uid = member_uid;
-		member_name = uid_to_purple_name(member_uid);
-		buddy = purple_find_buddy(purple_connection_get_account(gc), member_name);
-		g_free(member_name);
+		buddy = qq_buddy_find(gc, member_uid);
 		if (buddy != NULL) {
 			const gchar *alias = NULL;
 
 			bd = purple_buddy_get_protocol_data(buddy);
 			if (bd != NULL && bd->nickname != NULL)
-				member->nickname = g_strdup(bd->nickname);
+				member->nickname = qq_nick_intern(bd->nickname);
 			else if ((alias = purple_buddy_get_alias(buddy)) != NULL)
-				member->nickname = g_strdup(alias);
+				member->nickname = qq_nick_intern(alias);
 		}
-		rmd->members = g_list_append(rmd->members, member);
+		g_ptr_array_add(rmd->members, member);
+		g_hash_table_insert(rmd->member_index, GUINT_TO_POINTER(member_uid),
+				GINT_TO_POINTER(rmd->members->len));
+		online_bits_fit(rmd->online, rmd->members->len);
+		qq_room_buddy_changed(rmd, member_uid,
+				QQ_ROOM_MEMBER_DIRTY_FLAG | QQ_ROOM_MEMBER_DIRTY_NAME);
 	}
 
 	return member;
 }
 
-qq_room_data *qq_room_data_find(PurpleConnection *gc, guint32 room_id)
+/* rooms keeps the order to walk, room_index points into it */
+void qq_room_data_add(PurpleConnection *gc, qq_room_data *rmd)
 {
-	GSList *list;
-	qq_room_data *rmd;
 	qq_data *qd;
+	GSList *link;
 
+	g_return_if_fail (gc != NULL && gc->proto_data != NULL && rmd != NULL);
 	qd = (qq_data *) gc->proto_data;
 
-	if (qd->rooms == NULL || room_id <= 0)
-		return 0;
+	if (qd->room_index == NULL) {
+		qd->room_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
 
-	list = qd->rooms;
-	while (list != NULL) {
-		rmd = (qq_room_data *) list->data;
-		if (rmd->id == room_id) {
-			return rmd;
-		}
-		list = list->next;
+	link = g_slist_alloc();
+	link->data = rmd;
+	if (qd->rooms_tail == NULL) {
+		qd->rooms = link;
+	} else {
+		qd->rooms_tail->next = link;
+	}
+	qd->rooms_tail = link;
+	/* same id twice, find the first one as before */
+	if (g_hash_table_lookup(qd->room_index, GUINT_TO_POINTER(rmd->id)) == NULL) {
+		g_hash_table_insert(qd->room_index, GUINT_TO_POINTER(rmd->id), link);
 	}
+}
+
+static GSList *room_link_find(qq_data *qd, guint32 room_id)
+{
+	if (qd->room_index == NULL || room_id <= 0)
+		return NULL;
+	return g_hash_table_lookup(qd->room_index, GUINT_TO_POINTER(room_id));
+}
+
+qq_room_data *qq_room_data_find(PurpleConnection *gc, guint32 room_id)
+{
+	GSList *link;
 
-	return NULL;
+	link = room_link_find((qq_data *) gc->proto_data, room_id);
+	return (link == NULL) ? NULL : (qq_room_data *) link->data;
 }
 
 guint32 qq_room_get_next(PurpleConnection *gc, guint32 room_id)
@@ -308,7 +434,6 @@ guint32 qq_room_get_next(PurpleConnection *gc, guint32 room_id)
 	GSList *list;
 	qq_room_data *rmd;
 	qq_data *qd;
-	gboolean is_find = FALSE;
 
 	qd = (qq_data *) gc->proto_data;
 
@@ -321,17 +446,9 @@ guint32 qq_room_get_next(PurpleConnection *gc, guint32 room_id)
 		return rmd->id;
 	}
 
-	list = qd->rooms;
-	while (list != NULL) {
-		rmd = (qq_room_data *) list->data;
-		list = list->next;
-		if (rmd->id == room_id) {
-			is_find = TRUE;
-			break;
-		}
-	}
-
-	g_return_val_if_fail(is_find, 0);
+	list = room_link_find(qd, room_id);
+	g_return_val_if_fail(list != NULL, 0);
+	list = list->next;
 	if (list == NULL) return 0;	/* be the end */
  	rmd = (qq_room_data *) list->data;
 	g_return_val_if_fail(rmd != NULL, 0);
@@ -343,23 +460,15 @@ guint32 qq_room_get_next_conv(PurpleConnection *gc, guint32 room_id)
 	GSList *list;
 	qq_room_data *rmd;
 	qq_data *qd;
-	gboolean is_find;
 
 	qd = (qq_data *) gc->proto_data;
 
  	list = qd->rooms;
 	if (room_id > 0) {
 		/* search next room */
-		is_find = FALSE;
-		while (list != NULL) {
-			rmd = (qq_room_data *) list->data;
-			list = list->next;
-			if (rmd->id == room_id) {
-				is_find = TRUE;
-				break;
-			}
-		}
-		g_return_val_if_fail(is_find, 0);
+		list = room_link_find(qd, room_id);
+		g_return_val_if_fail(list != NULL, 0);
+		list = list->next;
 	}
 
 	while (list != NULL) {
@@ -388,6 +497,7 @@ void qq_room_data_initial(PurpleConnection *gc)
 	PurpleBlistNode *node;
 	qq_data *qd;
 	qq_room_data *rmd;
+	gchar *value;
 	gint count;
 
 	account = purple_connection_get_account(gc);
@@ -413,9 +523,15 @@ void qq_room_data_initial(PurpleConnection *gc)
 		if (account != purple_chat_get_account(chat))	/* not qq account*/
 			continue;
 
+		/* called again on each login, keep the rooms we already have */
+		value = g_hash_table_lookup(purple_chat_get_components(chat), QQ_ROOM_KEY_INTERNAL_ID);
+		if (value != NULL && room_link_find(qd, strtoul(value, NULL, 10)) != NULL) {
+			continue;
+		}
+
 		rmd = room_data_new_by_hashtable(gc, purple_chat_get_components(chat));
 		rmd->my_role = QQ_ROOM_ROLE_NO;		//now set all old qun data detached 'cause we don't know if we are still in
-		qd->rooms = g_slist_append(qd->rooms, rmd);
+		qq_room_data_add(gc, rmd);
 		count++;
 	}
 
@@ -438,6 +554,12 @@ void qq_room_data_free_all(PurpleConnection *gc)
 		room_data_free(rmd);
 		count++;
 	}
+	qd->rooms_tail = NULL;
+
+	if (qd->room_index != NULL) {
+		g_hash_table_destroy(qd->room_index);
+		qd->room_index = NULL;
+	}
 
 	if (count > 0) {
 		purple_debug_info("QQ", "%d rooms are freed\n", count);
@@ -33,15 +33,24 @@
 #define QQ_ROOM_KEY_NAME					"name"
 #define QQ_ROOM_KEY_ISSHOW				"is_show_chat"
 
+/* what to push to the room conversation for a member */
+#define QQ_ROOM_MEMBER_DIRTY_FLAG		0x01	/* status, role or founder */
+#define QQ_ROOM_MEMBER_DIRTY_NAME		0x02
+
 PurpleChat *qq_room_find_or_new(PurpleConnection *gc, guint32 id, guint32 qun_id);
 void qq_room_remove(PurpleConnection *gc, guint32 id);
 void qq_room_update_chat_info(PurpleChat *chat, qq_room_data *rmd);
 
 qq_buddy_data *qq_room_buddy_find(qq_room_data *rmd, guint32 uid);
 void qq_room_buddy_remove(qq_room_data *rmd, guint32 uid);
+void qq_room_buddy_changed(qq_room_data *rmd, guint32 uid, guint changed);
+void qq_room_onlines_begin(qq_room_data *rmd);
+void qq_room_onlines_add(PurpleConnection *gc, qq_room_data *rmd, guint32 uid);
+gint qq_room_onlines_commit(qq_room_data *rmd);
 qq_buddy_data *qq_room_buddy_find_or_new(PurpleConnection *gc, qq_room_data *rmd, guint32 member_uid);
 
 void qq_room_data_initial(PurpleConnection *gc);
+void qq_room_data_add(PurpleConnection *gc, qq_room_data *rmd);
 void qq_room_data_free_all(PurpleConnection *gc);
 qq_room_data *qq_room_data_find(PurpleConnection *gc, guint32 room_id);
 
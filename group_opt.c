@@ -135,7 +135,7 @@ void qq_group_modify_members(PurpleConnection *gc, qq_room_data *rmd, guint32 *n
 	guint32 *old_members, *del_members, *add_members;
 	qq_buddy_data *bd;
 	gint i = 0, old = 0, new = 0, del = 0, add = 0;
-	GList *list;
+	guint n;
 
 	g_return_if_fail(rmd != NULL);
 	if (new_members[0] == 0xffffffff)
@@ -146,12 +146,10 @@ void qq_group_modify_members(PurpleConnection *gc, qq_room_data *rmd, guint32 *n
 	add_members = g_newa(guint32, QQ_ROOM_MEMBER_MAX);
 
 	/* construct the old member list */
-	list = rmd->members;
-	while (list != NULL) {
-		bd = (qq_buddy_data *) list->data;
+	for (n = 0; n < rmd->members->len; n++) {
+		bd = (qq_buddy_data *) g_ptr_array_index(rmd->members, n);
 		if (bd != NULL)
 			old_members[i++] = bd->uid;
-		list = list->next;
 	}
 	old_members[i] = 0xffffffff;	/* this is the end */
 
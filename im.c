@@ -451,6 +451,7 @@ gchar *qq_emoticon_to_purple(gchar *text)
 	gchar *ret;
 	GString *converted;
 	gchar **segments;
+	gchar **seg;
 	gchar *purple_smiley;
 	gchar *cur;
 	guint8 symbol;
@@ -472,8 +473,9 @@ gchar *qq_emoticon_to_purple(gchar *text)
 	} else {
 		purple_debug_info("QQ", "segments[0] is NULL\n");
 	}
-	while ((*(++segments)) != NULL) {
-		cur = *segments;
+	seg = segments;
+	while ((*(++seg)) != NULL) {
+		cur = *seg;
 		if (cur == NULL) {
 			purple_debug_info("QQ", "current segment is NULL\n");
 			break;
@@ -497,6 +499,8 @@ gchar *qq_emoticon_to_purple(gchar *text)
 	}
 
 	/* purple_debug_info("QQ", "end of convert\n"); */
+	g_strfreev(segments);
+
 	ret = converted->str;
 	g_string_free(converted, FALSE);
 	return ret;
@@ -637,7 +641,7 @@ static qq_image *image_find(gchar *pos)
 	guint8 *md5;
 	GData *attr;
 	PurpleStoredImage *image;
-	qq_image *img = g_new0(qq_image, 1);
+	qq_image *img;
 
 	
 	if (g_ascii_strcasecmp(pos, "/IMG") && (end = g_utf8_strchr(pos, 14, '$')))
@@ -648,6 +652,8 @@ static qq_image *image_find(gchar *pos)
 		
 		if (purple_markup_find_tag("IMG", str, &start, &end, &attr))
 		{
+			g_free(str);
+			img = g_new0(qq_image, 1);
 			id = g_datalist_get_data(&attr, "id");
 			img->id = atoi(id);
 			if (id && (image = purple_imgstore_find_by_id(img->id))) 
@@ -663,6 +669,7 @@ static qq_image *image_find(gchar *pos)
 			g_datalist_clear(&attr);
 			return img;
 		}
+		g_free(str);
 	}
 	return NULL;
 }
@@ -759,7 +766,7 @@ static void process_im_vibrate(PurpleConnection *gc, guint8 *data, gint len, qq_
 	purple_debug_info("QQ", "Vibrate from uid: %d\n", im_text.uid);
 
 	who = uid_to_purple_name(im_text.uid);
-	buddy = purple_find_buddy(gc->account, who);
+	buddy = qq_buddy_find(gc, im_text.uid);
 	bd = (buddy == NULL) ? NULL : purple_buddy_get_protocol_data(buddy);
 	if (bd != NULL) {
 		bd->face = im_text.sender_icon;
@@ -831,7 +838,7 @@ static void process_im_text(PurpleConnection *gc, guint8 *data, gint len, qq_im_
 			im_text.has_font_attr ? "font attr exists" : "");
 
 	who = uid_to_purple_name(im_header->uid_from);
-	buddy = purple_find_buddy(gc->account, who);
+	buddy = qq_buddy_find(gc, im_header->uid_from);
 	bd = (buddy == NULL) ? NULL : purple_buddy_get_protocol_data(buddy);
 	if (bd != NULL) {
 		bd->client_tag = im_header->version_from;
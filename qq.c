@@ -52,6 +52,7 @@
 #include "qq_base.h"
 #include "packet_parse.h"
 #include "qq.h"
+#include "qq_cache.h"
 #include "qq_network.h"
 #include "send_file.h"
 #include "utils.h"
@@ -148,6 +149,10 @@ static void qq_login(PurpleAccount *account)
 	memset(qd, 0, sizeof(qq_data));
 	qd->gc = gc;
 	gc->proto_data = qd;
+	qq_buddy_index_init(gc);
+	/* show cached nicknames and room members before the server answers */
+	qq_room_data_initial(gc);
+	qq_cache_load(gc);
 
 	presence = purple_account_get_presence(account);
 	if(purple_presence_is_status_primitive_active(presence, PURPLE_STATUS_INVISIBLE)) {
@@ -235,7 +240,12 @@ static void qq_close(PurpleConnection *gc)
 	/* This is cancelled by _purple_connection_destroy */
 	qd->conn_data = NULL;
 
+	if (qd->is_login) {
+		qq_cache_save(gc);
+	}
+	qq_xfer_remove_all(gc);
 	qq_disconnect(gc);
+	qq_buddy_index_free(gc);
 
 	if (qd->redirect) g_free(qd->redirect);
 	if (qd->ld.token_touch) g_free(qd->ld.token_touch);
@@ -627,6 +637,7 @@ static void action_show_account_info(PurplePluginAction *action)
 	g_string_append_printf(info, _("<b>Lost</b>: %lu<br>\n"), qd->net_stat.lost);
 	g_string_append_printf(info, _("<b>Received</b>: %lu<br>\n"), qd->net_stat.rcved);
 	g_string_append_printf(info, _("<b>Received Duplicate</b>: %lu<br>\n"), qd->net_stat.rcved_dup);
+	g_string_append_printf(info, _("<b>Receive Calls</b>: %lu<br>\n"), qd->net_stat.rcved_calls);
 
 	g_string_append(info, "<hr>");
 	g_string_append(info, "<i>Last Login Information</i><br>\n");
@@ -1246,6 +1257,9 @@ static void init_plugin(PurplePlugin *plugin)
 	option = purple_account_option_int_new(_("Update interval (seconds)"), "update_interval", 300);
 	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
 
+	option = purple_account_option_int_new(_("File transfer window (fragments)"), "file_window", 256);
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
 	purple_prefs_add_none("/plugins/prpl/qq");
 	purple_prefs_add_bool("/plugins/prpl/qq/show_status_by_icon", TRUE);
 	purple_prefs_add_bool("/plugins/prpl/qq/show_fake_video", FALSE);
@@ -33,6 +33,9 @@
 #include "proxy.h"
 #include "roomlist.h"
 
+#include "qq_crypt.h"
+#include "trans_timer.h"
+
 #define QQ_KEY_LENGTH       16
 
 /* steal from kazehakase :) */
@@ -41,6 +44,7 @@
 
 typedef struct _qq_data qq_data;
 typedef struct _qq_buddy_data qq_buddy_data;
+typedef struct _qq_buddy_slot qq_buddy_slot;
 typedef struct _qq_interval qq_interval;
 typedef struct _qq_net_stat qq_net_stat;
 typedef struct _qq_login_data qq_login_data;
@@ -56,6 +60,7 @@ struct _qq_captcha_data {
 
 struct _qq_login_data {
 	guint8 random_key[QQ_KEY_LENGTH];			/* first encrypt key generated by client */
+	qq_crypt_ctx random_ctx;	/* random_key expanded */
 	guint8 *token_touch;				/* get from server */
 	guint16 token_touch_len;
 	guint8 *token_captcha;			/* get from server */
@@ -74,6 +79,7 @@ struct _qq_login_data {
 																		2,Key to Login Response;
 																		3,Key to VerifyE3 Response
 																		4,Key to Auth Success Response */
+	qq_crypt_ctx keys_ctx[5];	/* keys[] expanded, set with keys[] */
 	guint8 *token_verify_de;
 	guint16 token_verify_de_len;
 
@@ -98,27 +104,44 @@ struct _qq_net_stat {
 	glong lost;
 	glong rcved;
 	glong rcved_dup;
+	glong rcved_calls;	/* read syscalls, compare with rcved */
+};
+
+/* status of a buddy in the uid index, the slots are dense so that
+ * status scans do not chase each buddy's protocol data */
+struct _qq_buddy_slot {
+	guint32 uid;
+	guint8 status;
+	time_t last_update;
+	PurpleBuddy *buddy;
 };
 
+/* a buddy's status and last_update are in its qq_buddy_slot,
+ * only room members use the ones here */
 struct _qq_buddy_data {
 	guint32 uid;
-	guint16 face;		/* index: 0 - 299 */
-	guint8 age;
-	guint8 gender;
-	gchar *nickname;
-	struct in_addr ip;
-	guint16 port;
 	guint8 status;
 	guint8 ext_flag;
 	guint8 comm_flag;	/* details in qq_buddy_list.c */
-	guint16 client_tag;
+	gint8  role;		/* role in group, used only in group->members list */
+	time_t last_update;
+
+	const gchar *nickname;	/* interned, see qq_nick_intern */
+	guint16 face;		/* index: 0 - 299 */
+	guint8 age;
+	guint8 gender;
 	guint8 onlineTime;
 	guint16 level;
+	guint16 client_tag;
+	guint16 port;
 	guint16 timeRemainder;
+	struct in_addr ip;
+	time_t level_update;	/* when level was got, kept in qq_cache */
+	time_t sign_update;	/* when signature was got, kept in qq_cache */
 	time_t signon;
 	time_t idle;
-	time_t last_update;
-	gint8  role;		/* role in group, used only in group->members list */
+	gchar *conv_name;	/* name shown in room conversation, used only in group->members list */
+	gint conv_flag;		/* flags last set in room conversation */
 };
 
 typedef struct _qq_connection qq_connection;
@@ -129,8 +152,14 @@ struct _qq_connection {
 	/* tcp related */
 	int can_write_handler; 	/* use in tcp_send_out */
 	PurpleCircBuffer *tcp_txbuf;
-	guint8 *tcp_rxqueue;
-	int tcp_rxlen;
+	guint8 *tcp_rxbuf;		/* fixed size, packets parsed in place */
+	int tcp_rxhead;			/* start of unparsed data */
+	int tcp_rxtail;			/* end of received data */
+	gboolean tcp_rxsync;	/* skipping junk, up to and over next tail tag */
+
+	/* udp related */
+	guint8 *udp_rxpool;		/* QQ_UDP_BATCH datagrams for recvmmsg */
+	gboolean udp_no_batch;	/* recvmmsg failed, read one by one */
 };
 
 struct _qq_data {
@@ -169,7 +198,16 @@ struct _qq_data {
 	guint time2resend;
 	gint resend_times;
 
-	GList *transactions;	/* check ack packet and resend */
+	GHashTable *trans_table;	/* (cmd, seq) -> transaction, check ack packet */
+	GPtrArray *trans_heap;		/* transactions in min-heap of deadline */
+	GList *trans_remained;		/* server cmds received before login */
+	guint trans_watcher;		/* fires at first deadline of trans_heap */
+	gint64 trans_watcher_due;
+	qq_trans_rtt trans_rtt;
+
+	guint32 update_issued;		/* QQ_UPDATE_* stages requested in this update cycle */
+	guint32 update_done;		/* QQ_UPDATE_* stages all pages received */
+	gint64 update_start;		/* ms, when qq_update_all started the cycle */
 
 	guint32 uid;			/* QQ number */
 	gchar * nickname;	/* QQ nickname */
@@ -179,12 +217,13 @@ struct _qq_data {
 
 	guint8 session_key[QQ_KEY_LENGTH];		/* later use this as key in this session */
 	guint8 session_md5[QQ_KEY_LENGTH];		/* concatenate my uid with session_key and md5 it */
+	qq_crypt_ctx session_ctx;		/* session_key expanded, use this to encrypt and decrypt */
 
 	guint16 send_seq;		/* send sequence number */
 	guint8 login_mode;		/* online of invisible */
 	gboolean is_login;		/* used by qq_add_buddy */
 
-	PurpleXfer *xfer;			/* file transfer handler */
+	GHashTable *xfers;		/* buddy uid -> PurpleXfer, one transfer per buddy */
 
 	/* get from login reply packet */
 	struct in_addr my_local_ip;			/* my local ip address detected by server */
@@ -204,9 +243,16 @@ struct _qq_data {
 
 	GSList * buddy_list;
 	GSList * group_list;
+	GHashTable *buddies;		/* uid -> slot + 1 in buddy_slots, kept in sync with blist */
+	GArray *buddy_slots;		/* qq_buddy_slot of each buddy of this account */
+	GArray *level_uids;		/* buddy uids snapshot for paging levels, ship_value indexes it */
+	GArray *sign_uids;		/* same for paging signatures */
+	time_t memo_update;		/* when all memo aliases were got, kept in qq_cache */
 
 	PurpleRoomlist *roomlist;
 	GSList *rooms;
+	GSList *rooms_tail;		/* last link of rooms, append in O(1) */
+	GHashTable *room_index;		/* room id -> link in rooms, find and next in O(1) */
 
 	gboolean is_show_notice;
 	gboolean is_show_news;
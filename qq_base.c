@@ -503,43 +503,6 @@ guint8 qq_process_captcha(PurpleConnection *gc, guint8 *data, gint data_len)
 	return QQ_LOGIN_REPLY_CAPTCHA_DLG;
 }
 
-/* source copy from gg's common.c */
-static guint32 crc32_table[256];
-static int crc32_initialized = 0;
-
-static void crc32_make_table()
-{
-	guint32 h = 1;
-	unsigned int i, j;
-
-	memset(crc32_table, 0, sizeof(crc32_table));
-
-	for (i = 128; i; i >>= 1) {
-		h = (h >> 1) ^ ((h & 1) ? 0xedb88320L : 0);
-
-		for (j = 0; j < 256; j += 2 * i)
-			crc32_table[i + j] = crc32_table[j] ^ h;
-	}
-
-	crc32_initialized = 1;
-}
-
-static guint32 crc32(guint32 crc, const guint8 *buf, int len)
-{
-	if (!crc32_initialized)
-		crc32_make_table();
-
-	if (!buf || len < 0)
-		return crc;
-
-	crc ^= 0xffffffffL;
-
-	while (len--)
-		crc = (crc >> 8) ^ crc32_table[(crc ^ *buf++) & 0xff];
-
-	return crc ^ 0xffffffffL;
-}
-
 void qq_request_auth(PurpleConnection *gc)
 {
 	qq_data *qd;
@@ -593,6 +556,7 @@ void qq_request_auth(PurpleConnection *gc)
 	for (i = 0; i < sizeof(qd->ld.keys[4][i]); ++i)
 		qd->ld.keys[4][i] = (guint8) (rand() & 0xff);
 	bytes += qq_putdata(raw_data +bytes, qd->ld.keys[4], sizeof(qd->ld.keys[4]));
+	qq_crypt_ctx_init(&qd->ld.keys_ctx[4], qd->ld.keys[4]);
 
 //	encrypted_len = qq_encrypt(encrypted, raw_data, bytes, qd->ld.pwd_twice_md5);
 	encrypted_len = qq_encrypt(encrypted, raw_data, bytes, qd->ld.pwd_qq_md5);
@@ -610,7 +574,7 @@ void qq_request_auth(PurpleConnection *gc)
 	/* len of random + len of CRC32, wrong */
 	bytes += qq_put16(raw_data + bytes, sizeof(qd->ld.random_key) + 4);
 	bytes += qq_putdata(raw_data + bytes, qd->ld.random_key, sizeof(qd->ld.random_key));
-	bytes += qq_put32(raw_data + bytes, crc32(0xFFFFFFFF, qd->ld.random_key, sizeof(qd->ld.random_key)));
+	bytes += qq_put32(raw_data + bytes, qq_crc32(0xFFFFFFFF, qd->ld.random_key, sizeof(qd->ld.random_key)));
 
 	bytes += qq_put32(raw_data + bytes, 0x01772E01);
 	bytes += qq_put32(raw_data + bytes, (rand() & 0x7fff) | ((rand() & 0x7fff) << 15));
@@ -690,6 +654,7 @@ guint8 qq_process_auth( PurpleConnection *gc, guint8 *data, gint data_len)
 
 		/* Key Used in verify_E5 or verify_DE Request Packet */
 		bytes += qq_getdata(qd->ld.keys[0], sizeof(qd->ld.keys[0]), data+bytes);
+		qq_crypt_ctx_init(&qd->ld.keys_ctx[0], qd->ld.keys[0]);
 
 		/* token_DE used in verify_DE Packet */
 		if (qd->ld.token_auth[3] != NULL) g_free(qd->ld.token_auth[3]);
@@ -704,6 +669,7 @@ guint8 qq_process_auth( PurpleConnection *gc, guint8 *data, gint data_len)
 
 		/* Key to Decode verify_E5 Response Packet */
 		qq_getdata(qd->ld.keys[1], sizeof(qd->ld.keys[1]), data+bytes);
+		qq_crypt_ctx_init(&qd->ld.keys_ctx[1], qd->ld.keys[1]);
 		/* qq_show_packet("Get login token", qd->ld.login_token, qd->ld.login_token_len); */
 
 		if (qd->ld.token_auth_len[3])		//if have this token, we have to request verify_DE
@@ -793,7 +759,7 @@ void qq_request_verify_DE(PurpleConnection *gc)
 	*(raw_data+bytes+4) = 0x01;
 	bytes += 22;
 
-	encrypted_len = qq_encrypt(encrypted, raw_data, bytes, qd->ld.keys[0]);
+	encrypted_len = qq_crypt_ctx_encrypt(&qd->ld.keys_ctx[0], encrypted, raw_data, bytes);
 
 	buf = g_newa(guint8, 1024);
 	memset(buf, 0, 1024);
@@ -881,7 +847,7 @@ void qq_request_verify_E5(PurpleConnection *gc)
 	*(raw_data+bytes+0) = 0x01;
 	bytes += 5;
 
-	encrypted_len = qq_encrypt(encrypted, raw_data, bytes, qd->ld.keys[0]);
+	encrypted_len = qq_crypt_ctx_encrypt(&qd->ld.keys_ctx[0], encrypted, raw_data, bytes);
 
 	buf = g_newa(guint8, 1024);
 	memset(buf, 0, 1024);
@@ -908,6 +874,7 @@ guint8 qq_process_verify_E5( PurpleConnection *gc, guint8 *data, gint data_len )
 
 	bytes = 4;
 	bytes += qq_getdata(qd->ld.keys[2], QQ_KEY_LENGTH, data+bytes);
+	qq_crypt_ctx_init(&qd->ld.keys_ctx[2], qd->ld.keys[2]);
 	bytes += 8;
 	bytes += qq_get32(&qd->ld.login_fill, data+bytes);
 	bytes += qq_gettime(&qd->login_time, data+bytes);
@@ -922,6 +889,7 @@ guint8 qq_process_verify_E5( PurpleConnection *gc, guint8 *data, gint data_len )
 	bytes += qq_getdata(qd->ld.token_verify[0], qd->ld.token_verify_len[0], data+bytes);
 
 	bytes += qq_getdata(qd->ld.keys[3], QQ_KEY_LENGTH, data+bytes);
+	qq_crypt_ctx_init(&qd->ld.keys_ctx[3], qd->ld.keys[3]);
 
 	bytes += qq_get16(&qd->ld.token_verify_len[1], data+bytes);
 	if (qd->ld.token_verify[1] != NULL) g_free(qd->ld.token_verify[1]);
@@ -971,7 +939,7 @@ void qq_request_verify_E3( PurpleConnection *gc )
 	memset(raw_data+bytes, 0x00, 32);
 	bytes += 32;
 
-	encrypted_len = qq_encrypt(encrypted, raw_data, bytes, qd->ld.keys[0]);
+	encrypted_len = qq_crypt_ctx_encrypt(&qd->ld.keys_ctx[0], encrypted, raw_data, bytes);
 
 	buf = g_newa(guint8, 1024);
 	memset(buf, 0, 1024);
@@ -1093,7 +1061,7 @@ void qq_request_login(PurpleConnection *gc)
 	bytes += 249;
 
 	/* qq_show_packet("Login request", raw_data, bytes); */
-	encrypted_len = qq_encrypt(encrypted, raw_data, bytes, qd->ld.keys[0]);
+	encrypted_len = qq_crypt_ctx_encrypt(&qd->ld.keys_ctx[0], encrypted, raw_data, bytes);
 
 	buf = g_newa(guint8, 1024);
 	memset(buf, 0, 1024);
@@ -1126,6 +1094,7 @@ guint8 qq_process_login( PurpleConnection *gc, guint8 *data, gint data_len)
 			bytes += qq_getdata(qd->session_key, sizeof(qd->session_key), data + bytes);
 			purple_debug_info("QQ", "Got session_key\n");
 			get_session_md5(qd->session_md5, qd->uid, qd->session_key);
+			qq_crypt_ctx_init(&qd->session_ctx, qd->session_key);
 
 			bytes += qq_get32(&uid, data + bytes);
 			if (uid != qd->uid) {
@@ -1271,7 +1240,7 @@ guint8 qq_process_login_getlist( PurpleConnection *gc, guint8 *data, gint data_l
 				rmd = room_data_new(uid, 0, NULL);
 				g_return_val_if_fail(rmd != NULL, QQ_LOGIN_REPLY_ERR);
 				rmd->my_role = QQ_ROOM_ROLE_YES;
-				qd->rooms = g_slist_append(qd->rooms, rmd);
+				qq_room_data_add(gc, rmd);
 			} else {
 				rmd->my_role = QQ_ROOM_ROLE_YES;
 			}
@@ -0,0 +1,360 @@
+/**
+ * @file qq_cache.c
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#include "internal.h"
+#include "debug.h"
+#include "server.h"
+#include "util.h"
+
+#include "buddy_opt.h"
+#include "group_internal.h"
+#include "packet_parse.h"
+#include "qq_cache.h"
+#include "qq_define.h"
+
+/* The cache file keeps what qq_update_all fetched, so the buddy list and
+ * rooms show at once on the next login. All numbers are big endian:
+ *
+ *   magic "QQCA", version 16, buddy count 32, room count 32, memo_update 32
+ *   buddy: uid 32, face 16, age 8, gender 8, ext_flag 8, comm_flag 8,
+ *          level 16, level_update 32, sign_update 32,
+ *          nickname (length 16, utf8), signature (length 16, utf8)
+ *   room:  id 32, member count 32, then for each member
+ *          uid 32, face 16, age 8, gender 8, role 8, ext_flag 8, comm_flag 8,
+ *          last_update 32, nickname (length 16, utf8)
+ *
+ * Memo aliases are kept by blist, only when they were got is here.
+ * Bump QQ_CACHE_VERSION when the layout changes, old files are ignored. */
+#define QQ_CACHE_MAGIC		"QQCA"
+#define QQ_CACHE_VERSION	2
+
+#define QQ_CACHE_HEADER_LEN	(4 + 2 + 4 + 4 + 4)
+#define QQ_CACHE_BUDDY_LEN	(4 + 2 + 1 + 1 + 1 + 1 + 2 + 4 + 4)
+#define QQ_CACHE_ROOM_LEN	(4 + 4)
+#define QQ_CACHE_MEMBER_LEN	(4 + 2 + 1 + 1 + 1 + 1 + 1 + 4)
+
+static gchar *cache_file_name(PurpleConnection *gc)
+{
+	const gchar *username = purple_account_get_username(purple_connection_get_account(gc));
+	gchar *name, *path;
+
+	name = g_strdup_printf("%s.cache", purple_escape_filename(username));
+	path = g_build_filename(purple_user_dir(), "qq", name, NULL);
+	g_free(name);
+	return path;
+}
+
+/* reader over the mapped file, every get checks the bytes left */
+typedef struct {
+	guint8 *data;
+	gsize len;
+	gsize pos;
+} cache_reader;
+
+static gboolean cache_has(cache_reader *r, gsize n)
+{
+	return r->len - r->pos >= n;
+}
+
+static gchar *cache_get_str(cache_reader *r)
+{
+	guint16 len;
+	gchar *str;
+
+	if (!cache_has(r, 2)) return NULL;
+	r->pos += qq_get16(&len, r->data + r->pos);
+	if (!cache_has(r, len)) return NULL;
+	str = g_strndup((gchar *) r->data + r->pos, len);
+	r->pos += len;
+	return str;
+}
+
+static void cache_put_str(GByteArray *out, const gchar *str)
+{
+	guint8 len_buf[2];
+	gsize len = (str == NULL) ? 0 : MIN(strlen(str), 0xffff);
+
+	qq_put16(len_buf, len);
+	g_byte_array_append(out, len_buf, 2);
+	if (len > 0) g_byte_array_append(out, (const guint8 *) str, len);
+}
+
+static gboolean load_buddy(PurpleConnection *gc, cache_reader *r)
+{
+	qq_buddy_data rec, *bd;
+	PurpleBuddy *buddy;
+	guint32 level_update, sign_update;
+	gchar *nickname, *sign;
+
+	if (!cache_has(r, QQ_CACHE_BUDDY_LEN)) return FALSE;
+	memset(&rec, 0, sizeof(rec));
+	r->pos += qq_get32(&rec.uid, r->data + r->pos);
+	r->pos += qq_get16(&rec.face, r->data + r->pos);
+	r->pos += qq_get8(&rec.age, r->data + r->pos);
+	r->pos += qq_get8(&rec.gender, r->data + r->pos);
+	r->pos += qq_get8(&rec.ext_flag, r->data + r->pos);
+	r->pos += qq_get8(&rec.comm_flag, r->data + r->pos);
+	r->pos += qq_get16(&rec.level, r->data + r->pos);
+	r->pos += qq_get32(&level_update, r->data + r->pos);
+	r->pos += qq_get32(&sign_update, r->data + r->pos);
+	if ((nickname = cache_get_str(r)) == NULL) return FALSE;
+	if ((sign = cache_get_str(r)) == NULL) {
+		g_free(nickname);
+		return FALSE;
+	}
+
+	/* only buddies still in blist, data from server wins */
+	buddy = (rec.uid != 0) ? qq_buddy_find(gc, rec.uid) : NULL;
+	if (buddy == NULL || purple_buddy_get_protocol_data(buddy) != NULL) {
+		g_free(nickname);
+		g_free(sign);
+		return TRUE;
+	}
+
+	rec.nickname = qq_nick_intern(nickname);
+	g_free(nickname);
+	bd = g_memdup(&rec, sizeof(rec));
+	bd->level_update = level_update;
+	bd->sign_update = sign_update;
+	purple_buddy_set_protocol_data(buddy, bd);
+	if (*bd->nickname != '\0') {
+		serv_got_alias(gc, purple_buddy_get_name(buddy), bd->nickname);
+	}
+	/* kept escaped, as qq_process_get_buddies_sign sets it */
+	if (sign_update > 0 && *sign != '\0') {
+		purple_prpl_got_user_status(gc->account, purple_buddy_get_name(buddy),
+				PURPLE_MOOD_NAME, PURPLE_MOOD_COMMENT, sign, NULL);
+	}
+	g_free(sign);
+	return TRUE;
+}
+
+static gboolean load_room(PurpleConnection *gc, cache_reader *r)
+{
+	qq_room_data *rmd;
+	qq_buddy_data *bd;
+	guint32 id, count, i, uid, last_update;
+	guint16 face;
+	guint8 age, gender, role, ext_flag, comm_flag;
+	gchar *nickname;
+
+	if (!cache_has(r, QQ_CACHE_ROOM_LEN)) return FALSE;
+	r->pos += qq_get32(&id, r->data + r->pos);
+	r->pos += qq_get32(&count, r->data + r->pos);
+	rmd = qq_room_data_find(gc, id);
+
+	for (i = 0; i < count; i++) {
+		if (!cache_has(r, QQ_CACHE_MEMBER_LEN)) return FALSE;
+		r->pos += qq_get32(&uid, r->data + r->pos);
+		r->pos += qq_get16(&face, r->data + r->pos);
+		r->pos += qq_get8(&age, r->data + r->pos);
+		r->pos += qq_get8(&gender, r->data + r->pos);
+		r->pos += qq_get8(&role, r->data + r->pos);
+		r->pos += qq_get8(&ext_flag, r->data + r->pos);
+		r->pos += qq_get8(&comm_flag, r->data + r->pos);
+		r->pos += qq_get32(&last_update, r->data + r->pos);
+		if ((nickname = cache_get_str(r)) == NULL) return FALSE;
+
+		/* room is gone from blist, skip its members */
+		if (rmd == NULL || uid == 0 || (bd = qq_room_buddy_find_or_new(gc, rmd, uid)) == NULL) {
+			g_free(nickname);
+			continue;
+		}
+		bd->face = face;
+		bd->age = age;
+		bd->gender = gender;
+		bd->role = role;
+		bd->ext_flag = ext_flag;
+		bd->comm_flag = comm_flag;
+		bd->last_update = last_update;
+		qq_nick_release(bd->nickname);
+		bd->nickname = qq_nick_intern(nickname);
+		g_free(nickname);
+	}
+	return TRUE;
+}
+
+/* called by qq_login before connecting, blist buddies and rooms must be indexed */
+void qq_cache_load(PurpleConnection *gc)
+{
+	GMappedFile *file;
+	GError *error = NULL;
+	cache_reader r;
+	gchar *path;
+	guint16 version;
+	guint32 buddies, rooms, memo_update, i;
+
+	g_return_if_fail(gc != NULL && gc->proto_data != NULL);
+
+	path = cache_file_name(gc);
+	file = g_mapped_file_new(path, FALSE, &error);
+	if (file == NULL) {
+		purple_debug_info("QQ", "No cache %s: %s\n", path, error->message);
+		g_error_free(error);
+		g_free(path);
+		return;
+	}
+
+	r.data = (guint8 *) g_mapped_file_get_contents(file);
+	r.len = g_mapped_file_get_length(file);
+	r.pos = 0;
+
+	if (!cache_has(&r, QQ_CACHE_HEADER_LEN) || memcmp(r.data, QQ_CACHE_MAGIC, 4) != 0) {
+		purple_debug_warning("QQ", "Invalid cache %s, ignored\n", path);
+		goto out;
+	}
+	r.pos += 4;
+	r.pos += qq_get16(&version, r.data + r.pos);
+	if (version != QQ_CACHE_VERSION) {
+		purple_debug_info("QQ", "Cache %s is version %u, ignored\n", path, version);
+		goto out;
+	}
+	r.pos += qq_get32(&buddies, r.data + r.pos);
+	r.pos += qq_get32(&rooms, r.data + r.pos);
+	r.pos += qq_get32(&memo_update, r.data + r.pos);
+	((qq_data *) gc->proto_data)->memo_update = memo_update;
+
+	for (i = 0; i < buddies; i++) {
+		if (!load_buddy(gc, &r)) break;
+	}
+	for (i = 0; i < rooms && r.pos < r.len; i++) {
+		if (!load_room(gc, &r)) break;
+	}
+	if (r.pos != r.len) {
+		purple_debug_warning("QQ", "Cache %s is truncated at %" G_GSIZE_FORMAT "\n", path, r.pos);
+	}
+	purple_debug_info("QQ", "Loaded cache %s, %u buddies, %u rooms\n", path, buddies, rooms);
+
+out:
+	g_mapped_file_unref(file);
+	g_free(path);
+}
+
+typedef struct {
+	GByteArray *out;
+	guint32 count;
+} cache_writer;
+
+static void save_buddy(cache_writer *w, PurpleBuddy *buddy)
+{
+	qq_buddy_data *bd = purple_buddy_get_protocol_data(buddy);
+	PurpleStatus *mood;
+	guint8 buf[QQ_CACHE_BUDDY_LEN];
+	gint bytes = 0;
+
+	if (bd == NULL) return;
+	mood = purple_presence_get_status(purple_buddy_get_presence(buddy), PURPLE_MOOD_NAME);
+
+	bytes += qq_put32(buf + bytes, bd->uid);
+	bytes += qq_put16(buf + bytes, bd->face);
+	bytes += qq_put8(buf + bytes, bd->age);
+	bytes += qq_put8(buf + bytes, bd->gender);
+	bytes += qq_put8(buf + bytes, bd->ext_flag);
+	bytes += qq_put8(buf + bytes, bd->comm_flag);
+	bytes += qq_put16(buf + bytes, bd->level);
+	bytes += qq_put32(buf + bytes, bd->level_update);
+	bytes += qq_put32(buf + bytes, bd->sign_update);
+	g_byte_array_append(w->out, buf, bytes);
+	cache_put_str(w->out, bd->nickname);
+	cache_put_str(w->out, (mood == NULL || bd->sign_update == 0) ? NULL
+			: purple_status_get_attr_string(mood, PURPLE_MOOD_COMMENT));
+	w->count++;
+}
+
+static void save_room(cache_writer *w, qq_room_data *rmd)
+{
+	qq_buddy_data *bd;
+	guint8 buf[QQ_CACHE_MEMBER_LEN];
+	gint bytes;
+	guint i;
+
+	bytes = 0;
+	bytes += qq_put32(buf + bytes, rmd->id);
+	bytes += qq_put32(buf + bytes, rmd->members->len);
+	g_byte_array_append(w->out, buf, bytes);
+
+	for (i = 0; i < rmd->members->len; i++) {
+		bd = (qq_buddy_data *) g_ptr_array_index(rmd->members, i);
+		bytes = 0;
+		bytes += qq_put32(buf + bytes, bd->uid);
+		bytes += qq_put16(buf + bytes, bd->face);
+		bytes += qq_put8(buf + bytes, bd->age);
+		bytes += qq_put8(buf + bytes, bd->gender);
+		bytes += qq_put8(buf + bytes, bd->role);
+		bytes += qq_put8(buf + bytes, bd->ext_flag);
+		bytes += qq_put8(buf + bytes, bd->comm_flag);
+		bytes += qq_put32(buf + bytes, bd->last_update);
+		g_byte_array_append(w->out, buf, bytes);
+		cache_put_str(w->out, bd->nickname);
+	}
+	w->count++;
+}
+
+/* write the whole cache, the file is replaced atomically and only the
+ * user can read it */
+void qq_cache_save(PurpleConnection *gc)
+{
+	qq_data *qd;
+	cache_writer w;
+	GSList *it;
+	gchar *path, *dir;
+	guint32 buddies, i;
+
+	g_return_if_fail(gc != NULL && gc->proto_data != NULL);
+	qd = (qq_data *) gc->proto_data;
+
+	w.out = g_byte_array_new();
+	g_byte_array_set_size(w.out, QQ_CACHE_HEADER_LEN);
+
+	w.count = 0;
+	for (i = 0; qd->buddy_slots != NULL && i < qd->buddy_slots->len; i++) {
+		save_buddy(&w, g_array_index(qd->buddy_slots, qq_buddy_slot, i).buddy);
+	}
+	buddies = w.count;
+
+	w.count = 0;
+	for (it = qd->rooms; it != NULL; it = it->next) {
+		save_room(&w, (qq_room_data *) it->data);
+	}
+
+	memcpy(w.out->data, QQ_CACHE_MAGIC, 4);
+	qq_put16(w.out->data + 4, QQ_CACHE_VERSION);
+	qq_put32(w.out->data + 6, buddies);
+	qq_put32(w.out->data + 10, w.count);
+	qq_put32(w.out->data + 14, qd->memo_update);
+
+	path = cache_file_name(gc);
+	dir = g_path_get_dirname(path);
+	purple_build_dir(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+	if (!purple_util_write_data_to_file_absolute(path, (gchar *) w.out->data, w.out->len)) {
+		purple_debug_error("QQ", "Failed to save cache %s\n", path);
+	} else {
+		purple_debug_info("QQ", "Saved cache %s, %u buddies, %u rooms, %u bytes\n",
+				path, buddies, w.count, w.out->len);
+	}
+	g_free(dir);
+	g_free(path);
+	g_byte_array_free(w.out, TRUE);
+}
@@ -0,0 +1,40 @@
+/**
+ * @file qq_cache.h
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#ifndef _QQ_CACHE_H_
+#define _QQ_CACHE_H_
+
+#include <glib.h>
+#include "connection.h"
+
+/* seconds a cached value is not asked again: a buddy's level since its
+ * level_update, its signature since sign_update, memo aliases since
+ * qd->memo_update */
+#define QQ_CACHE_FRESH (24 * 60 * 60)
+
+void qq_cache_load(PurpleConnection *gc);
+void qq_cache_save(PurpleConnection *gc);
+
+#endif
@@ -86,32 +86,58 @@ void show_binary(char *psztitle, const guint8 *const buffer, gint bytes)
 
 #endif
 
+#define TEA_DELTA		0x9E3779B9	/*  0x9E3779B9 - 0x100000000 = -0x61C88647 */
+#define TEA_ROUNDS		16
+
+/* blocks are big endian, key words are kept in host order */
+static inline guint32 load32(const guint8 *p)
+{
+	return ((guint32) p[0] << 24) | ((guint32) p[1] << 16) | ((guint32) p[2] << 8) | p[3];
+}
+
+static inline void store32(guint8 *p, guint32 v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+void qq_crypt_ctx_init(qq_crypt_ctx *ctx, const guint8 *const key)
+{
+	g_return_if_fail(ctx != NULL && key != NULL);
+
+	ctx->key[0] = load32(key);
+	ctx->key[1] = load32(key + 4);
+	ctx->key[2] = load32(key + 8);
+	ctx->key[3] = load32(key + 12);
+}
+
 /********************************************************************
  * encryption 
  *******************************************************************/
 
 /* Tiny Encryption Algorithm (TEA) */
-static inline void qq_encipher(guint32 *const v, const guint32 *const k, guint32 *const w)
+static inline void qq_encipher(guint32 *const v, const guint32 *const k)
 {
 	register guint32
-		y = g_ntohl(v[0]), 
-		 z = g_ntohl(v[1]), 
-		 a = g_ntohl(k[0]), 
-		 b = g_ntohl(k[1]), 
-		 c = g_ntohl(k[2]), 
-		 d = g_ntohl(k[3]), 
-		 n = 0x10, 
-		 sum = 0, 
-		 delta = 0x9E3779B9;	/*  0x9E3779B9 - 0x100000000 = -0x61C88647 */
+		y = v[0],
+		z = v[1],
+		a = k[0],
+		b = k[1],
+		c = k[2],
+		d = k[3],
+		n = TEA_ROUNDS,
+		sum = 0;
 
 	while (n-- > 0) {
-		sum += delta;
+		sum += TEA_DELTA;
 		y += ((z << 4) + a) ^ (z + sum) ^ ((z >> 5) + b);
 		z += ((y << 4) + c) ^ (y + sum) ^ ((y >> 5) + d);
 	}
 
-	w[0] = g_htonl(y);
-	w[1] = g_htonl(z);
+	v[0] = y;
+	v[1] = z;
 }
 
 /* it can be the real random seed function */
@@ -125,59 +151,32 @@ static gint crypt_rand(void) {
 #define crypt_rand() rand()
 #endif
 
-/* 64-bit blocks and some kind of feedback mode of operation */
-static inline void encrypt_out(guint8 *crypted, const gint crypted_len, const guint8 *key) 
+/* 64-bit blocks and some kind of feedback mode of operation
+ *   x[i] = plain[i] ^ crypted[i - 1]
+ *   crypted[i] = tea(x[i]) ^ x[i - 1] */
+static inline void encrypt_out(guint8 *crypted, const gint crypted_len, const guint32 *const k) 
 {
-	/* ships in encipher */
-	guint32 plain32[2];
-	guint32 p32_prev[2];
-	guint32 key32[4];
-	guint32 crypted32[2];
-	guint32 c32_prev[2];
-	
-	guint8 *crypted_ptr;
+	guint32 y, z, e[2];
+	guint32 x_prev[2] = {0, 0};
+	guint32 c_prev[2] = {0, 0};
 	gint count64;
-	
-	/* prepare at first */
-	crypted_ptr = crypted;
-	
-	memcpy(crypted32, crypted_ptr, sizeof(crypted32));
-	c32_prev[0] = crypted32[0]; c32_prev[1] = crypted32[1];
-	
-	p32_prev[0] = 0; p32_prev[1] = 0;
-	plain32[0] = crypted32[0] ^ p32_prev[0]; plain32[1] = crypted32[1] ^ p32_prev[1];
-	
-	g_memmove(key32, key, 16);
-	count64 = crypted_len / 8;
-	while (count64-- > 0){
-		/* encrypt it */
-		qq_encipher(plain32, key32, crypted32);
-		
-		crypted32[0] ^= p32_prev[0]; crypted32[1] ^= p32_prev[1];
-		
-		/* store curr 64 bits crypted */
-		g_memmove(crypted_ptr, crypted32, sizeof(crypted32));
-		
-		/* set prev */
-		p32_prev[0] = plain32[0]; p32_prev[1] = plain32[1];
-		c32_prev[0] = crypted32[0]; c32_prev[1] = crypted32[1];
-		
-		/* set next 64 bits want to crypt*/
-		if (count64 > 0) {
-			crypted_ptr += 8;
-			memcpy(crypted32, crypted_ptr, sizeof(crypted32));
-			plain32[0] = crypted32[0] ^ c32_prev[0]; plain32[1] = crypted32[1] ^ c32_prev[1];
-		}
+
+	for (count64 = crypted_len / 8; count64 > 0; count64--, crypted += 8) {
+		y = load32(crypted) ^ c_prev[0];
+		z = load32(crypted + 4) ^ c_prev[1];
+
+		e[0] = y; e[1] = z;
+		qq_encipher(e, k);
+		c_prev[0] = e[0] ^ x_prev[0]; c_prev[1] = e[1] ^ x_prev[1];
+		x_prev[0] = y; x_prev[1] = z;
+
+		store32(crypted, c_prev[0]);
+		store32(crypted + 4, c_prev[1]);
 	}
 }
 
-/* length of crypted buffer must be plain_len + 17*/
-/*
- * The above comment used to say "plain_len + 16", but based on the
- * behavior of the function that is wrong.  If you give this function
- * a plain string with len%8 = 7 then the returned length is len+17
- */
-gint qq_encrypt(guint8* crypted, const guint8* const plain, const gint plain_len, const guint8* const key)
+/* fill header padding, plain and tail padding, return length to encrypt */
+static gint encrypt_pad(guint8 *crypted, const guint8 *const plain, const gint plain_len)
 {
 	guint8 *crypted_ptr = crypted;		/* current position of dest */
 	gint pos, padding;
@@ -216,122 +215,379 @@ gint qq_encrypt(guint8* crypted, const guint8* const plain, const gint plain_len
 	pos += 7;
 
 	show_binary("After padding", crypted, pos);
+	return pos;
+}
 
-	encrypt_out(crypted, pos, key);
+/* length of crypted buffer must be plain_len + 17*/
+/*
+ * The above comment used to say "plain_len + 16", but based on the
+ * behavior of the function that is wrong.  If you give this function
+ * a plain string with len%8 = 7 then the returned length is len+17
+ */
+gint qq_crypt_ctx_encrypt(const qq_crypt_ctx *ctx, guint8 *crypted, const guint8 *const plain, const gint plain_len)
+{
+	gint pos;
+
+	pos = encrypt_pad(crypted, plain, plain_len);
+	encrypt_out(crypted, pos, ctx->key);
 
 	show_binary("Encrypted", crypted, pos);
 	return pos;
 }
 
+gint qq_encrypt(guint8* crypted, const guint8* const plain, const gint plain_len, const guint8* const key)
+{
+	qq_crypt_ctx ctx;
+
+	qq_crypt_ctx_init(&ctx, key);
+	return qq_crypt_ctx_encrypt(&ctx, crypted, plain, plain_len);
+}
+
 /******************************************************************** 
  * decryption 
  ********************************************************************/
 
-static inline void qq_decipher(guint32 *const v, const guint32 *const k, guint32 *const w)
+static inline void qq_decipher(guint32 *const v, const guint32 *const k)
 {
 	register guint32
-		y = g_ntohl(v[0]), 
-		z = g_ntohl(v[1]), 
-		a = g_ntohl(k[0]), 
-		b = g_ntohl(k[1]), 
-		c = g_ntohl(k[2]), 
-		d = g_ntohl(k[3]), 
-		n = 0x10, 
-		sum = 0xE3779B90,	/* why this ? must be related with n value */
-		delta = 0x9E3779B9;
-
-	/* sum = delta<<5, in general sum = delta * n */
+		y = v[0],
+		z = v[1],
+		a = k[0],
+		b = k[1],
+		c = k[2],
+		d = k[3],
+		n = TEA_ROUNDS,
+		sum = TEA_DELTA * TEA_ROUNDS;	/* sum = delta<<4, in general sum = delta * n */
+
 	while (n-- > 0) {
 		z -= ((y << 4) + c) ^ (y + sum) ^ ((y >> 5) + d);
 		y -= ((z << 4) + a) ^ (z + sum) ^ ((z >> 5) + b);
-		sum -= delta;
+		sum -= TEA_DELTA;
 	}
 
-	w[0] = g_htonl(y);
-	w[1] = g_htonl(z);
+	v[0] = y;
+	v[1] = z;
 }
 
-static inline gint decrypt_out(guint8 *dest, gint crypted_len, const guint8* const key) 
+/* length of plain text, from padding len in the 1st decrypted byte */
+static inline gint decrypt_plain_len(const guint8 *plain, gint crypted_len)
 {
-	gint plain_len;
-	guint32 key32[4];
-	guint32 crypted32[2];
-	guint32 c32_prev[2];
-	guint32 plain32[2];
-	guint32 p32_prev[2];
+	gint padding = 2 + (plain[0] & 0x7);
+	return crypted_len - 1 - padding - 7;
+}
+
+/* reverse of encrypt_out, in place
+ *   x[i] = untea(crypted[i] ^ x[i - 1])
+ *   plain[i] = x[i] ^ crypted[i - 1] */
+static inline gint decrypt_out(guint8 *dest, gint crypted_len, const guint32 *const k) 
+{
+	gint plain_len = 0;
+	guint32 x[2] = {0, 0};
+	guint32 c[2];
+	guint32 c_prev[2] = {0, 0};
 	gint count64;
-	gint padding;
-	guint8 *crypted_ptr = dest;
 
-	/* decrypt first 64 bit */
-	memcpy(key32, key, sizeof(key32));
-	memcpy(crypted32, crypted_ptr, sizeof(crypted32));
-	c32_prev[0] = crypted32[0]; c32_prev[1] = crypted32[1];
+	for (count64 = crypted_len / 8; count64 > 0; count64--, dest += 8) {
+		c[0] = load32(dest);
+		c[1] = load32(dest + 4);
+		x[0] ^= c[0]; x[1] ^= c[1];
+		qq_decipher(x, k);
+
+		store32(dest, x[0] ^ c_prev[0]);
+		store32(dest + 4, x[1] ^ c_prev[1]);
+		c_prev[0] = c[0]; c_prev[1] = c[1];
+
+		/* check padding len after first 64 bit */
+		if (count64 == crypted_len / 8) {
+			plain_len = decrypt_plain_len(dest, crypted_len);
+			if( plain_len < 0 )	{
+				return -2;
+			}
+		}
+	}
 
-	qq_decipher(crypted32, key32, p32_prev);
-	memcpy(crypted_ptr, p32_prev, sizeof(p32_prev));
+	return plain_len;
+}
 
-	/* check padding len */
-	padding = 2 + (crypted_ptr[0] & 0x7);
-	if (padding < 2) {
-		padding += 8;
-	}
-	plain_len = crypted_len - 1 - padding - 7;
-	if( plain_len < 0 )	{
-		return -2;
+/* check tail padding of decrypted text, return plain_len or -3 */
+static gint decrypt_check(guint8 *plain, gint crypted_len, gint plain_len)
+{
+	gint pos;
+
+	show_binary("Decrypted with padding", plain, crypted_len);
+
+	/* check last 7 bytes is zero or not? */
+	for (pos = crypted_len - 1; pos > crypted_len - 8; pos--) {
+		if (plain[pos] != 0) {
+			return -3;
+		}
 	}
-	
-	count64 = crypted_len / 8;
-	while (--count64 > 0){
-		c32_prev[0] = crypted32[0]; c32_prev[1] = crypted32[1];
-		crypted_ptr += 8;
+	return plain_len;
+}
 
-		memcpy(crypted32, crypted_ptr, sizeof(crypted32));
-		p32_prev[0] ^= crypted32[0]; p32_prev[1] ^= crypted32[1];
+/* decrypt buf in place, *plain points to the text inside buf */
+gint qq_crypt_ctx_decrypt(const qq_crypt_ctx *ctx, guint8 *buf, const gint crypted_len, guint8 **plain)
+{
+	gint plain_len;
 
-		qq_decipher(p32_prev, key32, p32_prev);
-		
-		plain32[0] = p32_prev[0] ^ c32_prev[0]; plain32[1] = p32_prev[1] ^ c32_prev[1];
-		memcpy(crypted_ptr, plain32, sizeof(plain32));
+	/* at least 16 bytes and %8 == 0 */
+	if ((crypted_len % 8) || (crypted_len < 16)) { 
+		return -1;
+	}
+
+	plain_len = decrypt_out(buf, crypted_len, ctx->key);
+	if (plain_len < 0) {
+		return plain_len;	/* invalid first 64 bits */
 	}
 
+	plain_len = decrypt_check(buf, crypted_len, plain_len);
+	if (plain_len >= 0 && plain != NULL) {
+		*plain = buf + (crypted_len - plain_len - 7);
+	}
 	return plain_len;
 }
 
 /* length of plain buffer must be equal to crypted_len */
 gint qq_decrypt(guint8 *plain, const guint8* const crypted, const gint crypted_len, const guint8* const key)
 {
-	gint plain_len = 0;
-	gint hdr_padding;
-	gint pos;
+	qq_crypt_ctx ctx;
+	guint8 *text;
+	gint plain_len;
 
-	/* at least 16 bytes and %8 == 0 */
-	if ((crypted_len % 8) || (crypted_len < 16)) { 
+	if (crypted_len < 0) {
 		return -1;
 	}
 
+	qq_crypt_ctx_init(&ctx, key);
 	memcpy(plain, crypted, crypted_len);
 
-	plain_len = decrypt_out(plain, crypted_len, key);
-	if (plain_len < 0) {
-		return plain_len;	/* invalid first 64 bits */
+	plain_len = qq_crypt_ctx_decrypt(&ctx, plain, crypted_len, &text);
+	if (plain_len > 0) {
+		g_memmove(plain, text, plain_len);
 	}
+	return plain_len;
+}
 
-	show_binary("Decrypted with padding", plain, crypted_len);
+/******************************************************************** 
+ * batch of independent buffers, one buffer in each lane
+ * only tools/ build it, with QQ_CRYPT_BATCH. The plugin decrypts each
+ * reply in its handler, by a key that depends on the cmd, so it never
+ * holds several packets of one key at a time
+ ********************************************************************/
 
-	/* check last 7 bytes is zero or not? */
-	for (pos = crypted_len - 1; pos > crypted_len - 8; pos--) {
-		if (plain[pos] != 0) {
-			return -3;
+#ifdef QQ_CRYPT_BATCH
+
+#if defined(__GNUC__)
+
+#define QQ_CRYPT_LANES	8
+
+/* the vector is lowered to SSE2 / NEON, or plain registers if neither */
+typedef guint32 tea_vec __attribute__ ((vector_size (QQ_CRYPT_LANES * sizeof(guint32))));
+
+/* AVX2 does all lanes in one register, picked up at load time */
+#if defined(__x86_64__) && defined(__linux__) && (__GNUC__ >= 6)
+#define QQ_CRYPT_CLONES	__attribute__ ((target_clones ("avx2", "default")))
+#else
+#define QQ_CRYPT_CLONES
+#endif
+
+static inline void tea_encipher_vec(tea_vec *const v, const guint32 *const k)
+{
+	tea_vec y = v[0], z = v[1];
+	guint32 sum = 0;
+	gint n;
+
+	for (n = 0; n < TEA_ROUNDS; n++) {
+		sum += TEA_DELTA;
+		y += ((z << 4) + k[0]) ^ (z + sum) ^ ((z >> 5) + k[1]);
+		z += ((y << 4) + k[2]) ^ (y + sum) ^ ((y >> 5) + k[3]);
+	}
+
+	v[0] = y;
+	v[1] = z;
+}
+
+static inline void tea_decipher_vec(tea_vec *const v, const guint32 *const k)
+{
+	tea_vec y = v[0], z = v[1];
+	guint32 sum = TEA_DELTA * TEA_ROUNDS;
+	gint n;
+
+	for (n = 0; n < TEA_ROUNDS; n++) {
+		z -= ((y << 4) + k[2]) ^ (y + sum) ^ ((y >> 5) + k[3]);
+		y -= ((z << 4) + k[0]) ^ (z + sum) ^ ((z >> 5) + k[1]);
+		sum -= TEA_DELTA;
+	}
+
+	v[0] = y;
+	v[1] = z;
+}
+
+/* same as encrypt_out, bufs[i].out holds bufs[i].out_len padded bytes */
+static QQ_CRYPT_CLONES void encrypt_lanes(const guint32 *const k, qq_crypt_buf *bufs, gint lanes)
+{
+	tea_vec y, z, e[2];
+	tea_vec x_prev[2] = {{0}, {0}};
+	tea_vec c_prev[2] = {{0}, {0}};
+	gint blocks[QQ_CRYPT_LANES];
+	gint max_blocks = 0;
+	gint i, l;
+	guint8 *p;
+
+	for (l = 0; l < QQ_CRYPT_LANES; l++) {
+		blocks[l] = (l < lanes) ? bufs[l].out_len / 8 : 0;
+		max_blocks = MAX(max_blocks, blocks[l]);
+	}
+
+	for (i = 0; i < max_blocks; i++) {
+		for (l = 0; l < QQ_CRYPT_LANES; l++) {
+			if (i < blocks[l]) {
+				p = bufs[l].out + i * 8;
+				y[l] = load32(p);
+				z[l] = load32(p + 4);
+			} else {
+				y[l] = z[l] = 0;
+			}
+		}
+		y ^= c_prev[0]; z ^= c_prev[1];
+
+		e[0] = y; e[1] = z;
+		tea_encipher_vec(e, k);
+		c_prev[0] = e[0] ^ x_prev[0]; c_prev[1] = e[1] ^ x_prev[1];
+		x_prev[0] = y; x_prev[1] = z;
+
+		for (l = 0; l < lanes; l++) {
+			if (i < blocks[l]) {
+				p = bufs[l].out + i * 8;
+				store32(p, c_prev[0][l]);
+				store32(p + 4, c_prev[1][l]);
+			}
 		}
 	}
-	if (plain_len == 0) {
-		return plain_len;
+}
+
+/* same as decrypt_out, out_len of valid buffers is set to plain len */
+static QQ_CRYPT_CLONES void decrypt_lanes(const guint32 *const k, qq_crypt_buf *bufs, gint lanes)
+{
+	tea_vec x[2] = {{0}, {0}};
+	tea_vec c[2];
+	tea_vec c_prev[2] = {{0}, {0}};
+	gint blocks[QQ_CRYPT_LANES];
+	gint max_blocks = 0;
+	gint i, l;
+	guint8 *p;
+
+	for (l = 0; l < QQ_CRYPT_LANES; l++) {
+		blocks[l] = (l < lanes && bufs[l].out_len >= 0) ? bufs[l].in_len / 8 : 0;
+		max_blocks = MAX(max_blocks, blocks[l]);
 	}
 
-	hdr_padding = crypted_len - plain_len - 7;
-	g_memmove(plain, plain + hdr_padding, plain_len);
+	for (i = 0; i < max_blocks; i++) {
+		for (l = 0; l < QQ_CRYPT_LANES; l++) {
+			if (i < blocks[l]) {
+				p = bufs[l].out + i * 8;
+				c[0][l] = load32(p);
+				c[1][l] = load32(p + 4);
+			} else {
+				c[0][l] = c[1][l] = 0;
+			}
+		}
+		x[0] ^= c[0]; x[1] ^= c[1];
+		tea_decipher_vec(x, k);
 
-	return plain_len;
+		for (l = 0; l < lanes; l++) {
+			if (i >= blocks[l]) {
+				continue;
+			}
+			p = bufs[l].out + i * 8;
+			store32(p, x[0][l] ^ c_prev[0][l]);
+			store32(p + 4, x[1][l] ^ c_prev[1][l]);
+			if (i == 0) {
+				bufs[l].out_len = decrypt_plain_len(p, bufs[l].in_len);
+				if (bufs[l].out_len < 0) {
+					bufs[l].out_len = -2;
+					blocks[l] = 0;	/* invalid first 64 bits, stop this lane */
+				}
+			}
+		}
+		c_prev[0] = c[0]; c_prev[1] = c[1];
+	}
+}
+
+#else
+
+#define QQ_CRYPT_LANES	1
+
+static void encrypt_lanes(const guint32 *const k, qq_crypt_buf *bufs, gint lanes)
+{
+	encrypt_out(bufs[0].out, bufs[0].out_len, k);
+}
+
+static void decrypt_lanes(const guint32 *const k, qq_crypt_buf *bufs, gint lanes)
+{
+	if (bufs[0].out_len >= 0) {
+		bufs[0].out_len = decrypt_out(bufs[0].out, bufs[0].in_len, k);
+	}
+}
+
+#endif
+
+void qq_encrypt_batch(const qq_crypt_ctx *ctx, qq_crypt_buf *bufs, gint count)
+{
+	gint i;
+
+	g_return_if_fail(ctx != NULL && (bufs != NULL || count == 0));
+
+	for (i = 0; i < count; i++) {
+		bufs[i].out_len = encrypt_pad(bufs[i].out, bufs[i].in, bufs[i].in_len);
+	}
+
+	/* a single buffer gains nothing from the lanes */
+	if (count == 1) {
+		encrypt_out(bufs[0].out, bufs[0].out_len, ctx->key);
+		return;
+	}
+	for (i = 0; i < count; i += QQ_CRYPT_LANES) {
+		encrypt_lanes(ctx->key, bufs + i, MIN(QQ_CRYPT_LANES, count - i));
+	}
 }
 
+void qq_decrypt_batch(const qq_crypt_ctx *ctx, qq_crypt_buf *bufs, gint count)
+{
+	gint i;
+
+	g_return_if_fail(ctx != NULL && (bufs != NULL || count == 0));
+
+	for (i = 0; i < count; i++) {
+		/* at least 16 bytes and %8 == 0 */
+		if ((bufs[i].in_len % 8) || (bufs[i].in_len < 16)) {
+			bufs[i].out_len = -1;
+			continue;
+		}
+		bufs[i].out_len = 0;
+		if (bufs[i].out != bufs[i].in) {
+			memcpy(bufs[i].out, bufs[i].in, bufs[i].in_len);
+		}
+	}
+
+	if (count == 1) {
+		if (bufs[0].out_len == 0) {
+			bufs[0].out_len = decrypt_out(bufs[0].out, bufs[0].in_len, ctx->key);
+		}
+	} else {
+		for (i = 0; i < count; i += QQ_CRYPT_LANES) {
+			decrypt_lanes(ctx->key, bufs + i, MIN(QQ_CRYPT_LANES, count - i));
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (bufs[i].out_len >= 0) {
+			bufs[i].out_len = decrypt_check(bufs[i].out, bufs[i].in_len, bufs[i].out_len);
+		}
+		if (bufs[i].out_len > 0) {
+			g_memmove(bufs[i].out, bufs[i].out + bufs[i].in_len - bufs[i].out_len - 7, bufs[i].out_len);
+		}
+	}
+}
+
+#endif
@@ -27,7 +27,42 @@
 
 #include <glib.h>
 
+/* key words in host order, expand once and reuse for every packet */
+typedef struct _qq_crypt_ctx qq_crypt_ctx;
+struct _qq_crypt_ctx {
+	guint32 key[4];
+};
+
+void qq_crypt_ctx_init(qq_crypt_ctx *ctx, const guint8 *const key);
+
+/* crypted must hold plain_len + 17 bytes, return crypted length */
+gint qq_crypt_ctx_encrypt(const qq_crypt_ctx *ctx, guint8 *crypted, const guint8 *const plain, const gint plain_len);
+
+/* decrypt in place without copy, *plain is set to the text inside buf.
+ * return plain length, or negative if buf is not valid */
+gint qq_crypt_ctx_decrypt(const qq_crypt_ctx *ctx, guint8 *buf, const gint crypted_len, guint8 **plain);
+
+/* expand key and call the ctx functions, for keys used only once */
 gint qq_encrypt(guint8* crypted, const guint8* const plain, const gint plain_len, const guint8* const key);
 		
 gint qq_decrypt(guint8 *plain, const guint8* const crypted, const gint crypted_len, const guint8* const key);
+
+#ifdef QQ_CRYPT_BATCH
+/* one independent message of a batch
+ * encrypt: out must hold in_len + 17 bytes
+ * decrypt: out must hold in_len bytes, and may be same as in */
+typedef struct _qq_crypt_buf qq_crypt_buf;
+struct _qq_crypt_buf {
+	const guint8 *in;
+	gint in_len;
+	guint8 *out;
+	gint out_len;		/* set by batch, negative as qq_decrypt if failed */
+};
+
+/* same output as qq_encrypt/qq_decrypt on each buffer, several buffers run
+ * side by side in SIMD lanes */
+void qq_encrypt_batch(const qq_crypt_ctx *ctx, qq_crypt_buf *bufs, gint count);
+void qq_decrypt_batch(const qq_crypt_ctx *ctx, qq_crypt_buf *bufs, gint count);
+#endif
+
 #endif
@@ -22,6 +22,10 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
  */
 
+#ifdef HAVE_RECVMMSG
+#define _GNU_SOURCE		/* recvmmsg */
+#endif
+
 #include "internal.h"
 #include "cipher.h"
 #include "debug.h"
@@ -39,6 +43,16 @@
 #include "utils.h"
 #include "qq_process.h"
 
+#ifdef _WIN32
+/* no scatter/gather io, iov_send copies into one buffer */
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
 #define QQ_DEFAULT_PORT					8000
 
 /* set QQ_CONNECT_MAX to 1, when test reconnecting */
@@ -47,9 +61,43 @@
 #define QQ_CONNECT_CHECK					5
 #define QQ_KEEP_ALIVE_INTERVAL		60
 #define QQ_TRANS_INTERVAL				10
+/* room for one partial packet and one whole packet */
+#define QQ_TCP_RXBUF_SIZE				(2 * (MAX_PACKET_SIZE + 1))
+/* datagrams read by one recvmmsg, an unmeasured guess */
+#define QQ_UDP_BATCH						16
+/* tcp length, tag, client tag, cmd, seq, uid and header_fill */
+#define QQ_PACKET_HEADER_MAX			32
 
 gboolean connect_to_server(PurpleConnection *gc, gchar *server, gint port);
 
+static gint iov_total(struct iovec *iov, gint iov_cnt)
+{
+	gint total = 0;
+	while (iov_cnt-- > 0) {
+		total += (iov++)->iov_len;
+	}
+	return total;
+}
+
+/* send iov in one call, header, body and tail of a packet need no copy */
+static gint iov_send(gint fd, struct iovec *iov, gint iov_cnt)
+{
+#ifndef _WIN32
+	return writev(fd, iov, iov_cnt);
+#else
+	guint8 *buf;
+	gint bytes = 0;
+	gint i;
+
+	buf = g_newa(guint8, iov_total(iov, iov_cnt));
+	for (i = 0; i < iov_cnt; i++) {
+		memcpy(buf + bytes, iov[i].iov_base, iov[i].iov_len);
+		bytes += iov[i].iov_len;
+	}
+	return write(fd, buf, bytes);
+#endif
+}
+
 static qq_connection *connection_find(qq_data *qd, int fd) {
 	qq_connection *ret = NULL;
 	GSList *entry = qd->openconns;
@@ -80,7 +128,8 @@ static void connection_remove(qq_data *qd, int fd) {
 
 	if (conn->fd >= 0)	close(conn->fd);
 	if(conn->tcp_txbuf != NULL) 	purple_circ_buffer_destroy(conn->tcp_txbuf);
-	if (conn->tcp_rxqueue != NULL)	g_free(conn->tcp_rxqueue);
+	if (conn->tcp_rxbuf != NULL)	g_free(conn->tcp_rxbuf);
+	if (conn->udp_rxpool != NULL)	g_free(conn->udp_rxpool);
 
 	g_free(conn);
 }
@@ -257,7 +306,9 @@ static void redirect_server(PurpleConnection *gc)
 	qd->connect_watcher = purple_timeout_add_seconds(QQ_CONNECT_INTERVAL, qq_connect_later, gc);
 }
 
-/* process the incoming packet from qq_pending */
+/* process the incoming packet from qq_pending
+ * buf is the receive buffer of the connection, the qq_proc_* functions
+ * decrypt it in place, so it must not be used again after dispatch */
 static gboolean packet_process(PurpleConnection *gc, guint8 *buf, gint buf_len)
 {
 	qq_data *qd;
@@ -302,7 +353,8 @@ static gboolean packet_process(PurpleConnection *gc, guint8 *buf, gint buf_len)
 		if ( !qd->is_login ) {
 			qq_trans_add_remain(gc, cmd, seq, buf + bytes, bytes_not_read);
 		} else {
-			qq_trans_add_server_cmd(gc, cmd, seq, buf + bytes, bytes_not_read);
+			/* only our reply is kept for resending, no need to copy rcved */
+			qq_trans_add_server_cmd(gc, cmd, seq, NULL, 0);
 			qq_proc_server_cmd(gc, cmd, seq, buf + bytes, bytes_not_read);
 		}
 		return TRUE;
@@ -354,21 +406,133 @@ static gboolean packet_process(PurpleConnection *gc, guint8 *buf, gint buf_len)
 	return TRUE;
 }
 
+/* process one packet without TCP length, for feeding packets offline */
+gboolean qq_packet_process(PurpleConnection *gc, guint8 *buf, gint buf_len)
+{
+	return packet_process(gc, buf, buf_len);
+}
+
+/* Check the packet at the head of TCP stream data buf.
+ * return packet length if whole packet is in buf, 0 if more data is needed,
+ * or -jump if it is not a QQ packet and jump bytes must be skipped */
+gint qq_tcp_frame(const guint8 *buf, gint len)
+{
+	guint16 pkt_len;
+	const guint8 *jump;
+
+	if (len < QQ_TCP_HEADER_LENGTH) {
+		return 0;
+	}
+
+	qq_get16(&pkt_len, (guint8 *) buf);
+	if (len < pkt_len) {
+		return 0;
+	}
+
+	if ( pkt_len < QQ_TCP_HEADER_LENGTH
+	    || *(buf + 2) != QQ_PACKET_TAG
+		|| *(buf + pkt_len - 1) != QQ_PACKET_TAIL) {
+		/* HEY! This isn't even a QQ. What are you trying to pull? */
+		jump = memchr(buf + 1, QQ_PACKET_TAIL, len - 1);
+		if ( !jump ) {
+			return -len;
+		}
+		/* jump and over QQ_PACKET_TAIL */
+		return -((jump - buf) + 1);
+	}
+	return pkt_len;
+}
+
+/* Move the unparsed tail of the receive buffer to the front, so that
+ * there is always room for at least one whole packet behind it */
+static void tcp_rx_compact(qq_connection *conn)
+{
+	gint len = conn->tcp_rxtail - conn->tcp_rxhead;
+
+	if (conn->tcp_rxhead == 0)	return;
+	if (len > 0)	g_memmove(conn->tcp_rxbuf, conn->tcp_rxbuf + conn->tcp_rxhead, len);
+	conn->tcp_rxhead = 0;
+	conn->tcp_rxtail = len;
+}
+
+/* Free space at the tail of the receive buffer, to read into.
+ * Add the bytes read to conn->tcp_rxtail */
+guint8 *qq_tcp_rx_space(qq_connection *conn, gint *len)
+{
+	if (conn->tcp_rxbuf == NULL) {
+		conn->tcp_rxbuf = g_new(guint8, QQ_TCP_RXBUF_SIZE);
+		conn->tcp_rxhead = conn->tcp_rxtail = 0;
+	} else if (conn->tcp_rxhead == conn->tcp_rxtail) {
+		conn->tcp_rxhead = conn->tcp_rxtail = 0;
+	} else if (QQ_TCP_RXBUF_SIZE - conn->tcp_rxtail <= MAX_PACKET_SIZE) {
+		tcp_rx_compact(conn);
+	}
+	*len = QQ_TCP_RXBUF_SIZE - conn->tcp_rxtail;
+	return conn->tcp_rxbuf + conn->tcp_rxtail;
+}
+
+/* Take the next whole packet from the receive buffer, junk before it is
+ * skipped. return its length with the 2 length bytes, pkt points to
+ * those, or 0 if more data is needed. Packets come out the same however
+ * the stream is split into reads */
+gint qq_tcp_rx_next(qq_connection *conn, guint8 **pkt)
+{
+	guint8 *buf, *tail;
+	gint len, pkt_len;
+
+	while (conn->tcp_rxhead < conn->tcp_rxtail) {
+		buf = conn->tcp_rxbuf + conn->tcp_rxhead;
+		len = conn->tcp_rxtail - conn->tcp_rxhead;
+
+		if (conn->tcp_rxsync) {
+			/* the junk went on past last read, no byte here is checked yet */
+			tail = memchr(buf, QQ_PACKET_TAIL, len);
+			if (tail == NULL) {
+				conn->tcp_rxhead = conn->tcp_rxtail;
+				return 0;
+			}
+			conn->tcp_rxhead += (tail - buf) + 1;
+			conn->tcp_rxsync = FALSE;
+			continue;
+		}
+
+		pkt_len = qq_tcp_frame(buf, len);
+		if (pkt_len == 0) {
+			return 0;
+		}
+		if (pkt_len < 0) {
+			purple_debug_warning("TCP_PENDING", "Packet error, no header or tail tag\n");
+			if (-pkt_len == len && buf[len - 1] != QQ_PACKET_TAIL) {
+				purple_debug_warning("TCP_PENDING", "Failed to find next tail, clear receive buffer\n");
+				conn->tcp_rxsync = TRUE;
+			} else {
+				purple_debug_warning("TCP_PENDING", "Find next tail, jump %d\n", -pkt_len);
+			}
+			conn->tcp_rxhead += -pkt_len;
+			continue;
+		}
+
+		/* the data stays in place until next read */
+		*pkt = buf;
+		conn->tcp_rxhead += pkt_len;
+		return pkt_len;
+	}
+	return 0;
+}
+
 static void tcp_pending(gpointer data, gint source, PurpleInputCondition cond)
 {
 	PurpleConnection *gc = (PurpleConnection *) data;
 	qq_data *qd;
 	qq_connection *conn;
-	guint8 buf[1024];		/* set to 16 when test  tcp_rxqueue */
+	guint8 *buf;
 	gint buf_len;
 	gint bytes;
 
 	guint8 *pkt;
-	guint16 pkt_len;
+	gint pkt_len;
 
 	gchar *error_msg;
-	guint8 *jump;
-	gint jump_len;
 
 	g_return_if_fail(gc != NULL && gc->proto_data != NULL);
 	qd = (qq_data *) gc->proto_data;
@@ -383,16 +547,8 @@ static void tcp_pending(gpointer data, gint source, PurpleInputCondition cond)
 	conn = connection_find(qd, source);
 	g_return_if_fail(conn != NULL);
 
-	/* test code, not using tcp_rxqueue
-	memset(pkt,0, sizeof(pkt));
-	buf_len = read(qd->fd, pkt, sizeof(pkt));
-	if (buf_len > 2) {
-		packet_process(gc, pkt + 2, buf_len - 2);
-	}
-	return;
-	*/
-
-	buf_len = read(source, buf, sizeof(buf));
+	buf = qq_tcp_rx_space(conn, &buf_len);
+	buf_len = read(source, buf, buf_len);
 	if (buf_len < 0) {
 		if (errno == EAGAIN)
 			/* No worries */
@@ -414,88 +570,106 @@ static void tcp_pending(gpointer data, gint source, PurpleInputCondition cond)
 	 *  QQ need a keep alive packet in every 60 seconds
 	 gc->last_received = time(NULL);
 	*/
-	/* purple_debug_info("TCP_PENDING", "Read %d bytes, rxlen is %d\n", buf_len, conn->tcp_rxlen); */
-	conn->tcp_rxqueue = g_realloc(conn->tcp_rxqueue, buf_len + conn->tcp_rxlen);
-	memcpy(conn->tcp_rxqueue + conn->tcp_rxlen, buf, buf_len);
-	conn->tcp_rxlen += buf_len;
+	/* purple_debug_info("TCP_PENDING", "Read %d bytes, rxlen is %d\n", buf_len, conn->tcp_rxtail - conn->tcp_rxhead); */
+	conn->tcp_rxtail += buf_len;
+	qd->net_stat.rcved_calls++;
 
-	pkt = g_newa(guint8, MAX_PACKET_SIZE);
 	while (PURPLE_CONNECTION_IS_VALID(gc)) {
 		if (qd->openconns == NULL) {
 			break;
 		}
-		if (conn->tcp_rxqueue == NULL) {
-			conn->tcp_rxlen = 0;
-			break;
-		}
-		if (conn->tcp_rxlen < QQ_TCP_HEADER_LENGTH) {
+		pkt_len = qq_tcp_rx_next(conn, &pkt);
+		if (pkt_len == 0) {
 			break;
 		}
+		bytes = 2;	/* skip packet length */
 
-		bytes = 0;
-		bytes += qq_get16(&pkt_len, conn->tcp_rxqueue + bytes);
-		if (conn->tcp_rxlen < pkt_len) {
+		/* qq_tcp_rx_next has jumped to next packet already.
+		 * packet_process may call disconnect and destory data like conn
+		 * break if packet_process return FALSE */
+		if (packet_process(gc, pkt + bytes, pkt_len - bytes) == FALSE) {
+			purple_debug_info("TCP_PENDING", "Connection has been destory\n");
 			break;
 		}
+	}
+}
 
-		/* purple_debug_info("TCP_PENDING", "Packet len=%d, rxlen=%d\n", pkt_len, conn->tcp_rxlen); */
-		if ( pkt_len < QQ_TCP_HEADER_LENGTH
-		    || *(conn->tcp_rxqueue + bytes) != QQ_PACKET_TAG
-			|| *(conn->tcp_rxqueue + pkt_len - 1) != QQ_PACKET_TAIL) {
-			/* HEY! This isn't even a QQ. What are you trying to pull? */
-			purple_debug_warning("TCP_PENDING", "Packet error, no header or tail tag\n");
-
-			jump = memchr(conn->tcp_rxqueue + 1, QQ_PACKET_TAIL, conn->tcp_rxlen - 1);
-			if ( !jump ) {
-				purple_debug_warning("TCP_PENDING", "Failed to find next tail, clear receive buffer\n");
-				g_free(conn->tcp_rxqueue);
-				conn->tcp_rxqueue = NULL;
-				conn->tcp_rxlen = 0;
-				return;
-			}
-
-			/* jump and over QQ_PACKET_TAIL */
-			jump_len = (jump - conn->tcp_rxqueue) + 1;
-			purple_debug_warning("TCP_PENDING", "Find next tail at %d, jump %d\n", jump_len, jump_len + 1);
-			g_memmove(conn->tcp_rxqueue, jump, conn->tcp_rxlen - jump_len);
-			conn->tcp_rxlen -= jump_len;
-			continue;
+static gboolean udp_packet_process(PurpleConnection *gc, guint8 *buf, gint buf_len)
+{
+	if (buf_len < QQ_UDP_HEADER_LENGTH) {
+		if (buf[0] != QQ_PACKET_TAG || buf[buf_len - 1] != QQ_PACKET_TAIL) {
+			qq_hex_dump(PURPLE_DEBUG_ERROR, "UDP_PENDING",
+					buf, buf_len,
+					"Received packet is too short, or no header and tail tag");
+			return TRUE;
 		}
+	}
+	return packet_process(gc, buf, buf_len);
+}
 
-		memset(pkt, 0, MAX_PACKET_SIZE);
-		g_memmove(pkt, conn->tcp_rxqueue + bytes, pkt_len - bytes);
-
-		/* jump to next packet */
-		conn->tcp_rxlen -= pkt_len;
-		if (conn->tcp_rxlen) {
-			/* purple_debug_info("TCP_PENDING", "shrink tcp_rxqueue to %d\n", conn->tcp_rxlen);	*/
-			jump = g_memdup(conn->tcp_rxqueue + pkt_len, conn->tcp_rxlen);
-			g_free(conn->tcp_rxqueue);
-			conn->tcp_rxqueue = jump;
-		} else {
-			/* purple_debug_info("TCP_PENDING", "free tcp_rxqueue\n"); */
-			g_free(conn->tcp_rxqueue);
-			conn->tcp_rxqueue = NULL;
+#ifdef HAVE_RECVMMSG
+/* Drain up to QQ_UDP_BATCH datagrams in one call.
+ * return number of packets processed, or -1 if recvmmsg is not usable */
+static gint udp_pending_batch(PurpleConnection *gc, qq_connection *conn)
+{
+	qq_data *qd = (qq_data *) gc->proto_data;
+	struct mmsghdr msgs[QQ_UDP_BATCH];
+	struct iovec iovs[QQ_UDP_BATCH];
+	gint count, i;
+
+	if (conn->udp_rxpool == NULL) {
+		conn->udp_rxpool = g_new(guint8, QQ_UDP_BATCH * MAX_PACKET_SIZE);
+	}
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < QQ_UDP_BATCH; i++) {
+		iovs[i].iov_base = conn->udp_rxpool + i * MAX_PACKET_SIZE;
+		iovs[i].iov_len = MAX_PACKET_SIZE;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	count = recvmmsg(conn->fd, msgs, QQ_UDP_BATCH, MSG_DONTWAIT, NULL);
+	if (count < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)	return 0;
+		if (errno == ENOSYS || errno == EOPNOTSUPP) {
+			purple_debug_warning("UDP_PENDING", "recvmmsg unavailable, read one by one\n");
+			conn->udp_no_batch = TRUE;
+			return -1;
 		}
+		purple_connection_error_reason(gc,
+				PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+				_("Unable to read from socket"));
+		return 0;
+	}
+	qd->net_stat.rcved_calls++;
 
+	for (i = 0; i < count; i++) {
+		if (msgs[i].msg_len == 0)	continue;
 		/* packet_process may call disconnect and destory data like conn
-		 * do not call packet_process before jump,
 		 * break if packet_process return FALSE */
-		if (packet_process(gc, pkt, pkt_len - bytes) == FALSE) {
-			purple_debug_info("TCP_PENDING", "Connection has been destory\n");
+		if (udp_packet_process(gc, iovs[i].iov_base, msgs[i].msg_len) == FALSE) {
+			break;
+		}
+		if (!PURPLE_CONNECTION_IS_VALID(gc) || qd->openconns == NULL) {
 			break;
 		}
 	}
+	return count;
 }
+#endif
 
 static void udp_pending(gpointer data, gint source, PurpleInputCondition cond)
 {
 	PurpleConnection *gc = NULL;
+	qq_data *qd;
+	qq_connection *conn;
 	guint8 *buf;
 	gint buf_len;
 
 	gc = (PurpleConnection *) data;
-	g_return_if_fail(gc != NULL);
+	g_return_if_fail(gc != NULL && gc->proto_data != NULL);
+	qd = (qq_data *) gc->proto_data;
 
 	if(cond != PURPLE_INPUT_READ) {
 		purple_connection_error_reason(gc,
@@ -504,6 +678,15 @@ static void udp_pending(gpointer data, gint source, PurpleInputCondition cond)
 		return;
 	}
 
+	conn = connection_find(qd, source);
+	g_return_if_fail(conn != NULL);
+
+#ifdef HAVE_RECVMMSG
+	if (!conn->udp_no_batch && udp_pending_batch(gc, conn) >= 0) {
+		return;
+	}
+#endif
+
 	buf = g_newa(guint8, MAX_PACKET_SIZE);
 
 	/* here we have UDP proxy suppport */
@@ -514,43 +697,33 @@ static void udp_pending(gpointer data, gint source, PurpleInputCondition cond)
 				_("Unable to read from socket"));
 		return;
 	}
+	qd->net_stat.rcved_calls++;
 
 	/* keep alive will be sent in 30 seconds since last_receive
 	 *  QQ need a keep alive packet in every 60 seconds
 	 gc->last_received = time(NULL);
 	*/
 
-	if (buf_len < QQ_UDP_HEADER_LENGTH) {
-		if (buf[0] != QQ_PACKET_TAG || buf[buf_len - 1] != QQ_PACKET_TAIL) {
-			qq_hex_dump(PURPLE_DEBUG_ERROR, "UDP_PENDING",
-					buf, buf_len,
-					"Received packet is too short, or no header and tail tag");
-			return;
-		}
-	}
-
-	/* packet_process may call disconnect and destory data like conn
-	 * do not call packet_process before jump,
-	 * break if packet_process return FALSE */
-	packet_process(gc, buf, buf_len);
+	/* packet_process may call disconnect and destory data like conn */
+	udp_packet_process(gc, buf, buf_len);
 }
 
-static gint udp_send_out(PurpleConnection *gc, guint8 *data, gint data_len)
+static gint udp_send_out(PurpleConnection *gc, struct iovec *iov, gint iov_cnt)
 {
 	qq_data *qd;
 	gint ret;
 
-	g_return_val_if_fail(data != NULL && data_len > 0, -1);
+	g_return_val_if_fail(iov != NULL && iov_cnt > 0, -1);
 
 	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, -1);
 	qd = (qq_data *) gc->proto_data;
 
 #if 0
-	purple_debug_info("UDP_SEND_OUT", "Send %d bytes to socket %d\n", data_len, qd->fd);
+	purple_debug_info("UDP_SEND_OUT", "Send %d bytes to socket %d\n", iov_total(iov, iov_cnt), qd->fd);
 #endif
 
 	errno = 0;
-	ret = send(qd->fd, data, data_len, 0);
+	ret = iov_send(qd->fd, iov, iov_cnt);
 	if (ret < 0 && errno == EAGAIN) {
 		return ret;
 	}
@@ -570,6 +743,8 @@ static void tcp_can_write(gpointer data, gint source, PurpleInputCondition cond)
 	PurpleConnection *gc = (PurpleConnection *) data;
 	qq_data *qd;
 	qq_connection *conn;
+	struct iovec iov[2];
+	gint iov_cnt;
 	int ret, writelen;
 
 	g_return_if_fail(gc != NULL && gc->proto_data != NULL);
@@ -578,14 +753,21 @@ static void tcp_can_write(gpointer data, gint source, PurpleInputCondition cond)
 	conn = connection_find(qd, source);
 	g_return_if_fail(conn != NULL);
 
-	writelen = purple_circ_buffer_get_max_read(conn->tcp_txbuf);
+	writelen = conn->tcp_txbuf->bufused;
 	if (writelen == 0) {
 		purple_input_remove(conn->can_write_handler);
 		conn->can_write_handler = 0;
 		return;
 	}
 
-	ret = write(source, conn->tcp_txbuf->outptr, writelen);
+	/* flush all queued packets at once, the buffer may wrap around */
+	iov[0].iov_base = conn->tcp_txbuf->outptr;
+	iov[0].iov_len = purple_circ_buffer_get_max_read(conn->tcp_txbuf);
+	iov[1].iov_base = conn->tcp_txbuf->buffer;
+	iov[1].iov_len = writelen - iov[0].iov_len;
+	iov_cnt = (iov[1].iov_len > 0) ? 2 : 1;
+
+	ret = iov_send(source, iov, iov_cnt);
 	purple_debug_info("TCP_CAN_WRITE", "total %d bytes is sent %d\n", writelen, ret);
 
 	if (ret < 0 && errno == EAGAIN)
@@ -600,16 +782,22 @@ static void tcp_can_write(gpointer data, gint source, PurpleInputCondition cond)
 		return;
 	}
 
+	/* mark_read can not cross the end of buffer */
+	if (ret > (gint) iov[0].iov_len) {
+		purple_circ_buffer_mark_read(conn->tcp_txbuf, iov[0].iov_len);
+		ret -= iov[0].iov_len;
+	}
 	purple_circ_buffer_mark_read(conn->tcp_txbuf, ret);
 }
 
-static gint tcp_send_out(PurpleConnection *gc, guint8 *data, gint data_len)
+static gint tcp_send_out(PurpleConnection *gc, struct iovec *iov, gint iov_cnt)
 {
 	qq_data *qd;
 	qq_connection *conn;
-	gint ret;
+	gint data_len;
+	gint ret, skip, i;
 
-	g_return_val_if_fail(data != NULL && data_len > 0, -1);
+	g_return_val_if_fail(iov != NULL && iov_cnt > 0, -1);
 
 	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, -1);
 	qd = (qq_data *) gc->proto_data;
@@ -617,12 +805,13 @@ static gint tcp_send_out(PurpleConnection *gc, guint8 *data, gint data_len)
 	conn = connection_find(qd, qd->fd);
 	g_return_val_if_fail(conn, -1);
 
+	data_len = iov_total(iov, iov_cnt);
 #if 0
 	purple_debug_info("TCP_SEND_OUT", "Send %d bytes to socket %d\n", data_len, qd->fd);
 #endif
 
 	if (conn->can_write_handler == 0) {
-		ret = write(qd->fd, data, data_len);
+		ret = iov_send(qd->fd, iov, iov_cnt);
 	} else {
 		ret = -1;
 		errno = EAGAIN;
@@ -656,7 +845,17 @@ static gint tcp_send_out(PurpleConnection *gc, guint8 *data, gint data_len)
 		if (conn->tcp_txbuf == NULL) {
 			conn->tcp_txbuf = purple_circ_buffer_new(4096);
 		}
-		purple_circ_buffer_append(conn->tcp_txbuf, data + ret, data_len - ret);
+		/* queue what is left, tcp_can_write flushes it with later packets */
+		skip = ret;
+		for (i = 0; i < iov_cnt; i++) {
+			if (skip >= (gint) iov[i].iov_len) {
+				skip -= iov[i].iov_len;
+				continue;
+			}
+			purple_circ_buffer_append(conn->tcp_txbuf,
+					(guint8 *) iov[i].iov_base + skip, iov[i].iov_len - skip);
+			skip = 0;
+		}
 	}
 	return ret;
 }
@@ -665,19 +864,11 @@ static gboolean network_timeout(gpointer data)
 {
 	PurpleConnection *gc = (PurpleConnection *) data;
 	qq_data *qd;
-	gboolean is_lost_conn;
 
 	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, TRUE);
 	qd = (qq_data *) gc->proto_data;
 
-	is_lost_conn = qq_trans_scan(gc);
-	if (is_lost_conn) {
-		purple_connection_error_reason(gc,
-			PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
-			_("Lost connection with server"));
-		return TRUE;
-	}
-
+	/* resend and lost of transactions are handled by their own timer in qq_trans.c */
 	if ( !qd->is_login ) {
 		return TRUE;
 	}
@@ -731,6 +922,7 @@ static void set_all_keys(PurpleConnection *gc)
 		qd->ld.random_key[bytes] = (guint8) (rand() & 0xff);
 	}
 #endif
+	qq_crypt_ctx_init(&qd->ld.random_ctx, qd->ld.random_key);
 
 	/* now generate md5 processed passwd */
 	passwd = purple_account_get_password(purple_connection_get_account(gc));
@@ -1042,11 +1234,23 @@ void qq_disconnect(PurpleConnection *gc)
 	memset(qd->ld.pwd_twice_md5, 0, sizeof(qd->ld.pwd_twice_md5));
 	memset(qd->ld.pwd_qq_md5, 0, sizeof(qd->ld.pwd_qq_md5));
 	memset(qd->session_key, 0, sizeof(qd->session_key));
+	memset(&qd->session_ctx, 0, sizeof(qd->session_ctx));
+	memset(qd->ld.keys_ctx, 0, sizeof(qd->ld.keys_ctx));
+	memset(&qd->ld.random_ctx, 0, sizeof(qd->ld.random_ctx));
 	memset(qd->session_md5, 0, sizeof(qd->session_md5));
 
 	g_slist_foreach(qd->group_list,g_free,NULL);
 	g_slist_free(qd->group_list);
 	qd->group_list = NULL;
+
+	if (qd->level_uids) {
+		g_array_free(qd->level_uids, TRUE);
+		qd->level_uids = NULL;
+	}
+	if (qd->sign_uids) {
+		g_array_free(qd->sign_uids, TRUE);
+		qd->sign_uids = NULL;
+	}
 	
 
 	qd->my_local_ip.s_addr = 0;
@@ -1057,12 +1261,13 @@ void qq_disconnect(PurpleConnection *gc)
 	qq_buddy_data_free_all(gc);
 }
 
-static gint packet_encap(qq_data *qd, guint8 *buf, gint maxlen, guint16 cmd, guint16 seq,
-	guint8 *data, gint data_len)
+/* build the packet header in buf, the body and tail are sent from where they are */
+static gint packet_encap_header(qq_data *qd, guint8 *buf, gint maxlen, guint16 cmd, guint16 seq,
+	gint data_len)
 {
 	gint bytes = 0;
-	g_return_val_if_fail(qd != NULL && buf != NULL && maxlen > 0, -1);
-	g_return_val_if_fail(data != NULL && data_len > 0, -1);
+	g_return_val_if_fail(qd != NULL && buf != NULL && maxlen >= QQ_PACKET_HEADER_MAX, -1);
+	g_return_val_if_fail(data_len > 0, -1);
 
 	/* QQ TCP packet has two bytes in the begining defines packet length
 	 * so leave room here to store packet size */
@@ -1081,12 +1286,9 @@ static gint packet_encap(qq_data *qd, guint8 *buf, gint maxlen, guint16 cmd, gui
 
 	bytes += qq_putdata(buf + bytes,header_fill,sizeof(header_fill));
 
-	bytes += qq_putdata(buf + bytes, data, data_len);
-	bytes += qq_put8(buf + bytes, QQ_PACKET_TAIL);
-
-	/* set TCP packet length at begin of the packet */
+	/* set TCP packet length at begin of the packet, data and tail included */
 	if (qd->use_tcp) {
-		qq_put16(buf, bytes);
+		qq_put16(buf, bytes + data_len + 1);
 	}
 
 	return bytes;
@@ -1095,27 +1297,34 @@ static gint packet_encap(qq_data *qd, guint8 *buf, gint maxlen, guint16 cmd, gui
 /* data has been encrypted before */
 static gint packet_send_out(PurpleConnection *gc, guint16 cmd, guint16 seq, guint8 *data, gint data_len)
 {
+	static guint8 tail = QQ_PACKET_TAIL;
 	qq_data *qd;
-	guint8 *buf;
-	gint buf_len;
+	guint8 header[QQ_PACKET_HEADER_MAX];
+	struct iovec iov[3];
+	gint header_len;
 	gint bytes_sent;
 
 	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, -1);
 	qd = (qq_data *)gc->proto_data;
 	g_return_val_if_fail(data != NULL && data_len > 0, -1);
 
-	buf = g_newa(guint8, MAX_PACKET_SIZE);
-	memset(buf, 0, MAX_PACKET_SIZE);
-	buf_len = packet_encap(qd, buf, MAX_PACKET_SIZE, cmd, seq, data, data_len);
-	if (buf_len <= 0) {
+	header_len = packet_encap_header(qd, header, sizeof(header), cmd, seq, data_len);
+	if (header_len <= 0 || header_len + data_len + 1 > MAX_PACKET_SIZE) {
 		return -1;
 	}
 
+	iov[0].iov_base = header;
+	iov[0].iov_len = header_len;
+	iov[1].iov_base = data;
+	iov[1].iov_len = data_len;
+	iov[2].iov_base = &tail;
+	iov[2].iov_len = 1;
+
 	qd->net_stat.sent++;
 	if (qd->use_tcp) {
-		bytes_sent = tcp_send_out(gc, buf, buf_len);
+		bytes_sent = tcp_send_out(gc, iov, 3);
 	} else {
-		bytes_sent = udp_send_out(gc, buf, buf_len);
+		bytes_sent = udp_send_out(gc, iov, 3);
 	}
 
 	return bytes_sent;
@@ -1155,7 +1364,7 @@ static gint send_cmd_detail(PurpleConnection *gc, guint16 cmd, guint16 seq,
 
 	/* at most 17 bytes more */
 	encrypted = g_newa(guint8, data_len + 17);
-	encrypted_len = qq_encrypt(encrypted, data, data_len, qd->session_key);
+	encrypted_len = qq_crypt_ctx_encrypt(&qd->session_ctx, encrypted, data, data_len);
 	if (encrypted_len < 16) {
 		purple_debug_error("QQ_ENCRYPT", "Error len %d: [%05d] 0x%04X %s\n",
 				encrypted_len, seq, cmd, qq_get_cmd_desc(cmd));
@@ -1232,7 +1441,7 @@ gint qq_send_server_reply(PurpleConnection *gc, guint16 cmd, guint16 seq, guint8
 #endif
 	/* at most 17 bytes more */
 	encrypted = g_newa(guint8, data_len + 17);
-	encrypted_len = qq_encrypt(encrypted, data, data_len, qd->session_key);
+	encrypted_len = qq_crypt_ctx_encrypt(&qd->session_ctx, encrypted, data, data_len);
 	if (encrypted_len < 16) {
 		purple_debug_error("QQ_ENCRYPT", "Error len %d: [%05d] 0x%04X %s\n",
 				encrypted_len, seq, cmd, qq_get_cmd_desc(cmd));
@@ -1310,7 +1519,7 @@ static gint send_room_cmd(PurpleConnection *gc, guint8 room_cmd, guint32 room_id
 	/* Encrypt to encrypted with session_key */
 	/* at most 17 bytes more */
 	encrypted = g_newa(guint8, buf_len + 17);
-	encrypted_len = qq_encrypt(encrypted, buf, buf_len, qd->session_key);
+	encrypted_len = qq_crypt_ctx_encrypt(&qd->session_ctx, encrypted, buf, buf_len);
 	if (encrypted_len < 16) {
 		purple_debug_error("QQ_ENCRYPT", "Error len %d: [%05d] %s (0x%02X)\n",
 				encrypted_len, seq, qq_get_room_cmd_desc(room_cmd), room_cmd);
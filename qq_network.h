@@ -32,6 +32,11 @@
 
 #define QQ_CONNECT_STEPS    4	/* steps in connection */
 
+gint qq_tcp_frame(const guint8 *buf, gint len);
+guint8 *qq_tcp_rx_space(qq_connection *conn, gint *len);
+gint qq_tcp_rx_next(qq_connection *conn, guint8 **pkt);
+gboolean qq_packet_process(PurpleConnection *gc, guint8 *buf, gint buf_len);
+
 gboolean qq_connect_later(gpointer data);
 void qq_disconnect(PurpleConnection *gc);
 
@@ -43,6 +43,7 @@
 #include "qq_base.h"
 #include "im.h"
 #include "qq_process.h"
+#include "qq_cache.h"
 #include "packet_parse.h"
 #include "qq_network.h"
 #include "qq_trans.h"
@@ -459,6 +460,34 @@ static void process_server_msg(PurpleConnection *gc, guint8 *data, gint data_len
 	g_strfreev(segments);
 }
 
+/* decrypt rcved in place by ctx, or by alt if ctx fails and alt is not NULL.
+ * *data is set to the text inside rcved, *by_alt tells which key worked.
+ * rcved is copied only when there is alt to fall back on */
+static gint decrypt_rcved(const qq_crypt_ctx *ctx, const qq_crypt_ctx *alt,
+		guint8 *rcved, gint rcved_len, guint8 **data, gboolean *by_alt)
+{
+	guint8 *copy, *text;
+	gint data_len;
+
+	if (by_alt != NULL)	*by_alt = FALSE;
+	if (alt == NULL) {
+		return qq_crypt_ctx_decrypt(ctx, rcved, rcved_len, data);
+	}
+
+	copy = g_memdup(rcved, rcved_len);
+	data_len = qq_crypt_ctx_decrypt(ctx, copy, rcved_len, &text);
+	if (data_len >= 0) {
+		memcpy(rcved, text, data_len);
+		*data = rcved;
+		g_free(copy);
+		return data_len;
+	}
+	g_free(copy);
+
+	if (by_alt != NULL)	*by_alt = TRUE;
+	return qq_crypt_ctx_decrypt(alt, rcved, rcved_len, data);
+}
+
 void qq_proc_server_cmd(PurpleConnection *gc, guint16 cmd, guint16 seq, guint8 *rcved, gint rcved_len)
 {
 	qq_data *qd;
@@ -469,8 +498,7 @@ void qq_proc_server_cmd(PurpleConnection *gc, guint16 cmd, guint16 seq, guint8 *
 	g_return_if_fail (gc != NULL && gc->proto_data != NULL);
 	qd = (qq_data *) gc->proto_data;
 
-	data = g_newa(guint8, rcved_len);
-	data_len = qq_decrypt(data, rcved, rcved_len, qd->session_key);
+	data_len = decrypt_rcved(&qd->session_ctx, NULL, rcved, rcved_len, &data, NULL);
 	if (data_len < 0) {
 		purple_debug_warning("QQ",
 			"Can not decrypt server cmd by session key, [%05d], 0x%04X %s, len %d\n",
@@ -536,7 +564,7 @@ void qq_update_room(PurpleConnection *gc, guint8 room_cmd, guint32 room_id)
 					QQ_CMD_CLASS_UPDATE_ROOM, 0);
 			break;
 		case QQ_ROOM_CMD_GET_INFO:
-			ret = qq_request_room_get_members_info(gc, room_id, QQ_CMD_CLASS_UPDATE_ROOM, 0);
+			ret = qq_request_room_get_members_info(gc, room_id, QQ_CMD_CLASS_UPDATE_ROOM);
 			if (ret <= 0) {
 				qq_send_room_cmd_mess(gc, QQ_ROOM_CMD_GET_ONLINES, room_id, NULL, 0,
 						QQ_CMD_CLASS_UPDATE_ROOM, 0);
@@ -553,6 +581,17 @@ void qq_update_room(PurpleConnection *gc, guint8 room_cmd, guint32 room_id)
 	}
 }
 
+/* ask member info of room_id or the first room after it that needs any,
+ * return FALSE if the list ran out with no request sent */
+static gboolean update_rooms_members(PurpleConnection *gc, guint32 room_id)
+{
+	for (; room_id > 0; room_id = qq_room_get_next(gc, room_id)) {
+		if (qq_request_room_get_members_info(gc, room_id, QQ_CMD_CLASS_UPDATE_ALL) > 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
 void qq_update_all_rooms(PurpleConnection *gc, guint8 room_cmd, guint32 room_id)
 {
 	qq_data * qd;
@@ -572,6 +611,7 @@ void qq_update_all_rooms(PurpleConnection *gc, guint8 room_cmd, guint32 room_id)
 			purple_debug_info("QQ", "New turn, id %u\n", next_id);
 		} else {
 			purple_debug_info("QQ", "No room. Finished update\n");
+			qq_update_stage_done(gc, QQ_UPDATE_ROOMS);
 			return;
 		}
 	}
@@ -586,62 +626,183 @@ void qq_update_all_rooms(PurpleConnection *gc, guint8 room_cmd, guint32 room_id)
 			if (!is_new_turn) {
 				qq_send_room_cmd_mess(gc, QQ_ROOM_CMD_GET_INFO, next_id, NULL, 0,
 						QQ_CMD_CLASS_UPDATE_ALL, 0);
-			} else {
-				qq_request_room_get_members_info(gc, next_id, QQ_CMD_CLASS_UPDATE_ALL, 0);
+			} else if (!update_rooms_members(gc, next_id)) {
+				/* no reply to wait for */
+				purple_debug_info("QQ", "Finished update\n");
+				qq_update_stage_done(gc, QQ_UPDATE_ROOMS);
 			}
 			break;
 		case QQ_ROOM_CMD_GET_MEMBERS_INFO:
 			/* last command */
-			if (!is_new_turn) {
-				qq_request_room_get_members_info(gc, next_id, QQ_CMD_CLASS_UPDATE_ALL, 0);
-			} else {
-				purple_debug_info("QQ", "Finished update\n");
+			if (!is_new_turn && update_rooms_members(gc, next_id)) {
+				break;
 			}
+			purple_debug_info("QQ", "Finished update\n");
+			qq_update_stage_done(gc, QQ_UPDATE_ROOMS);
 			break;
 		default:
 			break;
 	}
 }
 
-void qq_update_all(PurpleConnection *gc, guint16 cmd)
-{
-	qq_data *qd;
+/* independent stages run at the same time, at most this many in flight.
+ * An unmeasured guess, time to a full buddy list was never timed */
+#define QQ_UPDATE_WINDOW 4
+
+/* stages are issued in this order once their deps are done */
+static const struct {
+	guint32 stage;
+	guint32 deps;
+} update_stages[] = {
+	{ QQ_UPDATE_MY_INFO, 0 },
+	{ QQ_UPDATE_STATUS, 0 },
+	{ QQ_UPDATE_GROUPS, 0 },
+	{ QQ_UPDATE_BUDDIES, QQ_UPDATE_GROUPS },
+	{ QQ_UPDATE_ONLINE, QQ_UPDATE_BUDDIES | QQ_UPDATE_STATUS },
+	{ QQ_UPDATE_MEMO, QQ_UPDATE_BUDDIES },
+	{ QQ_UPDATE_LEVEL, QQ_UPDATE_BUDDIES },
+	{ QQ_UPDATE_SIGN, QQ_UPDATE_BUDDIES },
+	{ QQ_UPDATE_ROOMS, QQ_UPDATE_STATUS }
+};
 
-	g_return_if_fail (gc != NULL && gc->proto_data != NULL);
-	qd = (qq_data *) gc->proto_data;
+#define QQ_UPDATE_ALL_STAGES (QQ_UPDATE_ROOMS * 2 - 1)
+#define QQ_UPDATE_BUDDY_STAGES (QQ_UPDATE_GROUPS | QQ_UPDATE_BUDDIES | QQ_UPDATE_ONLINE \
+		| QQ_UPDATE_MEMO | QQ_UPDATE_LEVEL | QQ_UPDATE_SIGN)
 
+static guint32 update_stage_of_cmd(guint16 cmd)
+{
 	switch (cmd) {
-		case 0:
+		case QQ_CMD_GET_BUDDY_INFO:
+			return QQ_UPDATE_MY_INFO;
+		case QQ_CMD_CHANGE_STATUS:
+			return QQ_UPDATE_STATUS;
+		case QQ_CMD_GET_GROUP_LIST:
+			return QQ_UPDATE_GROUPS;
+		case QQ_CMD_GET_BUDDIES_LIST:
+			return QQ_UPDATE_BUDDIES;
+		case QQ_CMD_BUDDY_MEMO:
+			return QQ_UPDATE_MEMO;
+		case QQ_CMD_GET_LEVEL:
+			return QQ_UPDATE_LEVEL;
+		case QQ_CMD_GET_BUDDIES_ONLINE:
+			return QQ_UPDATE_ONLINE;
+		case QQ_CMD_GET_BUDDIES_SIGN:
+			return QQ_UPDATE_SIGN;
+		default:
+			return 0;
+	}
+}
+
+static void update_stage_request(PurpleConnection *gc, guint32 stage)
+{
+	qq_data *qd = (qq_data *) gc->proto_data;
+
+	switch (stage) {
+		case QQ_UPDATE_MY_INFO:
 			qq_request_get_buddy_info(gc, qd->uid, QQ_CMD_CLASS_UPDATE_ALL, 0);
 			break;
-		case QQ_CMD_GET_BUDDY_INFO:
+		case QQ_UPDATE_STATUS:
 			qq_request_change_status(gc, QQ_CMD_CLASS_UPDATE_ALL);
 			break;
-		case QQ_CMD_CHANGE_STATUS:
+		case QQ_UPDATE_GROUPS:
 			qq_request_get_group_list(gc, 0, QQ_CMD_CLASS_UPDATE_ALL);
 			break;
-		case QQ_CMD_GET_GROUP_LIST:
+		case QQ_UPDATE_BUDDIES:
 			qq_request_get_buddies_list(gc, 0, QQ_CMD_CLASS_UPDATE_ALL);
 			break;
-		case QQ_CMD_GET_BUDDIES_LIST:
+		case QQ_UPDATE_MEMO:
+			/* aliases are kept in blist, ask for them again once a day */
+			if (time(NULL) - qd->memo_update < QQ_CACHE_FRESH) {
+				purple_debug_info("QQ", "Memo aliases are fresh\n");
+				qq_update_stage_done(gc, QQ_UPDATE_MEMO);
+				break;
+			}
 			qq_request_buddy_memo(gc, 0, QQ_CMD_CLASS_UPDATE_ALL, QQ_BUDDY_MEMO_ALIAS);
 			break;
-		case QQ_CMD_BUDDY_MEMO:
+		case QQ_UPDATE_LEVEL:
 			qq_request_get_buddies_level(gc, QQ_CMD_CLASS_UPDATE_ALL, 0);
 			break;
-		case QQ_CMD_GET_LEVEL:
+		case QQ_UPDATE_ONLINE:
 			qq_request_get_buddies_online(gc, 0, QQ_CMD_CLASS_UPDATE_ALL);
 			break;
-		case QQ_CMD_GET_BUDDIES_ONLINE:
+		case QQ_UPDATE_SIGN:
 			qq_request_get_buddies_sign(gc, QQ_CMD_CLASS_UPDATE_ALL, 0);
 			break;
-		case QQ_CMD_GET_BUDDIES_SIGN:
-			/* last command */
+		case QQ_UPDATE_ROOMS:
 			qq_update_all_rooms(gc, 0, 0);
 			break;
 		default:
 			break;
 	}
+}
+
+static gint update_in_flight(qq_data *qd)
+{
+	guint32 bits = qd->update_issued & ~qd->update_done;
+	gint count = 0;
+
+	for (; bits; bits &= bits - 1) count++;
+	return count;
+}
+
+static void update_schedule(PurpleConnection *gc)
+{
+	qq_data *qd = (qq_data *) gc->proto_data;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(update_stages); i++) {
+		if (update_in_flight(qd) >= QQ_UPDATE_WINDOW) break;
+		if (qd->update_issued & update_stages[i].stage) continue;
+		if ((qd->update_done & update_stages[i].deps) != update_stages[i].deps) continue;
+
+		qd->update_issued |= update_stages[i].stage;
+		update_stage_request(gc, update_stages[i].stage);
+	}
+}
+
+/* called when the last page of a stage is processed */
+void qq_update_stage_done(PurpleConnection *gc, guint32 stage)
+{
+	qq_data *qd;
+	gint elapsed;
+
+	g_return_if_fail (gc != NULL && gc->proto_data != NULL);
+	qd = (qq_data *) gc->proto_data;
+
+	/* not part of an update cycle, or a late duplicate */
+	if (!(qd->update_issued & stage) || (qd->update_done & stage)) return;
+
+	qd->update_done |= stage;
+	elapsed = g_get_monotonic_time() / 1000 - qd->update_start;
+	purple_debug_info("QQ", "Update stage 0x%X done at %d ms\n", stage, elapsed);
+
+	if ((stage & QQ_UPDATE_BUDDY_STAGES)
+			&& (qd->update_done & QQ_UPDATE_BUDDY_STAGES) == QQ_UPDATE_BUDDY_STAGES) {
+		purple_debug_info("QQ", "Buddy list populated in %d ms\n", elapsed);
+	}
+	if (qd->update_done == QQ_UPDATE_ALL_STAGES) {
+		purple_debug_info("QQ", "Finished update in %d ms\n", elapsed);
+		qq_cache_save(gc);
+		return;
+	}
+	update_schedule(gc);
+}
+
+void qq_update_all(PurpleConnection *gc, guint16 cmd)
+{
+	qq_data *qd;
+
+	g_return_if_fail (gc != NULL && gc->proto_data != NULL);
+	qd = (qq_data *) gc->proto_data;
+
+	if (cmd == 0) {
+		qd->update_issued = 0;
+		qd->update_done = 0;
+		qd->update_start = g_get_monotonic_time() / 1000;
+		update_schedule(gc);
+	} else {
+		qq_update_stage_done(gc, update_stage_of_cmd(cmd));
+	}
 	qd->online_last_update = time(NULL);
 }
 
@@ -709,8 +870,7 @@ void qq_proc_room_cmds(PurpleConnection *gc, guint16 seq,
 	g_return_if_fail (gc != NULL && gc->proto_data != NULL);
 	qd = (qq_data *) gc->proto_data;
 
-	data = g_newa(guint8, rcved_len);
-	data_len = qq_decrypt(data, rcved, rcved_len, qd->session_key);
+	data_len = decrypt_rcved(&qd->session_ctx, NULL, rcved, rcved_len, &data, NULL);
 	if (data_len < 0) {
 		purple_debug_warning("QQ",
 			"Can not decrypt room cmd by session key, [%05d], 0x%02X %s for %d, len %d\n",
@@ -809,7 +969,9 @@ void qq_proc_room_cmds(PurpleConnection *gc, guint16 seq,
 		qq_process_room_cmd_get_onlines(data + bytes, data_len - bytes, gc);
 		break;
 	case QQ_ROOM_CMD_GET_MEMBERS_INFO:
-		qq_process_room_cmd_get_members_info(data + bytes, data_len - bytes, ship_value, gc);
+		if (!qq_process_room_cmd_get_members_info(data + bytes, data_len - bytes, ship_value, gc)) {
+			return;		/* update goes on after the last reply */
+		}
 		break;
 	default:
 		purple_debug_warning("QQ", "Unknown room cmd 0x%02X %s\n",
@@ -838,49 +1000,45 @@ guint8 qq_proc_login_cmds(PurpleConnection *gc,  guint16 cmd, guint16 seq,
 	qq_data *qd;
 	guint8 *data = NULL;
 	gint data_len = 0;
+	gboolean by_alt;
 	guint ret_8 = QQ_LOGIN_REPLY_ERR;
 
 	g_return_val_if_fail (gc != NULL && gc->proto_data != NULL, QQ_LOGIN_REPLY_ERR);
 	qd = (qq_data *) gc->proto_data;
 
 	g_return_val_if_fail(rcved_len > 0, QQ_LOGIN_REPLY_ERR);
-	data = g_newa(guint8, rcved_len);
 
 	switch (cmd) {
 		case QQ_CMD_TOUCH_SERVER:
 		case QQ_CMD_CAPTCHA:
-			data_len = qq_decrypt(data, rcved, rcved_len, qd->ld.random_key);
+			data_len = decrypt_rcved(&qd->ld.random_ctx, NULL, rcved, rcved_len, &data, NULL);
 			break;
 		case QQ_CMD_AUTH:
-			data_len = qq_decrypt(data, rcved, rcved_len, qd->ld.random_key);
-			if (data_len >= 0) {
+			data_len = decrypt_rcved(&qd->ld.random_ctx, &qd->ld.keys_ctx[4],
+					rcved, rcved_len, &data, &by_alt);
+			if (data_len >= 0 && !by_alt) {
 				purple_debug_warning("QQ", "Decrypt login packet by random_key, %d bytes\n", data_len);
-			} else {
-				data_len = qq_decrypt(data, rcved, rcved_len, qd->ld.keys[4]);
-				if (data_len >= 0) {
-					purple_debug_warning("QQ", "Decrypt login packet by auth_key1, %d bytes\n", data_len);
-				}
+			} else if (data_len >= 0) {
+				purple_debug_warning("QQ", "Decrypt login packet by auth_key1, %d bytes\n", data_len);
 			}
 			break;
 		case QQ_CMD_VERIFY_DE:
-			data_len = qq_decrypt(data, rcved, rcved_len, qd->ld.keys[0]);
+			data_len = decrypt_rcved(&qd->ld.keys_ctx[0], NULL, rcved, rcved_len, &data, NULL);
 			break;
 		case QQ_CMD_VERIFY_E5:
-			data_len = qq_decrypt(data, rcved, rcved_len, qd->ld.keys[1]);
+			data_len = decrypt_rcved(&qd->ld.keys_ctx[1], NULL, rcved, rcved_len, &data, NULL);
 			break;
 		case QQ_CMD_VERIFY_E3:
-			data_len = qq_decrypt(data, rcved, rcved_len, qd->ld.keys[3]);
+			data_len = decrypt_rcved(&qd->ld.keys_ctx[3], NULL, rcved, rcved_len, &data, NULL);
 			break;
 		case QQ_CMD_LOGIN:
-			data_len = qq_decrypt(data, rcved, rcved_len, qd->ld.keys[2]);
-			if (data_len >= 0) {
+			/* network condition may has changed, then it is by Key2_Auth. please sign in again. */
+			data_len = decrypt_rcved(&qd->ld.keys_ctx[2], &qd->ld.keys_ctx[0],
+					rcved, rcved_len, &data, &by_alt);
+			if (data_len >= 0 && !by_alt) {
 				purple_debug_info("QQ", "Decrypt login packet by Key0_VerifyE5\n");
-			} else {
-				/* network condition may has changed. please sign in again. */
-				data_len = qq_decrypt(data, rcved, rcved_len, qd->ld.keys[0]);	
-				if (data_len >= 0) {
-					purple_debug_info("QQ", "Decrypt login packet rarely by Key2_Auth\n");
-				}
+			} else if (data_len >= 0) {
+				purple_debug_info("QQ", "Decrypt login packet rarely by Key2_Auth\n");
 			}
 			break;
 		case QQ_CMD_LOGIN_E9:
@@ -889,7 +1047,7 @@ guint8 qq_proc_login_cmds(PurpleConnection *gc,  guint16 cmd, guint16 seq,
 		case QQ_CMD_LOGIN_ED:
 		case QQ_CMD_LOGIN_EC:
 		default:
-			data_len = qq_decrypt(data, rcved, rcved_len, qd->session_key);
+			data_len = decrypt_rcved(&qd->session_ctx, NULL, rcved, rcved_len, &data, NULL);
 			break;
 	}
 
@@ -1022,8 +1180,7 @@ void qq_proc_client_cmds(PurpleConnection *gc, guint16 cmd, guint16 seq,
 	g_return_if_fail (gc != NULL && gc->proto_data != NULL);
 	qd = (qq_data *) gc->proto_data;
 
-	data = g_newa(guint8, rcved_len);
-	data_len = qq_decrypt(data, rcved, rcved_len, qd->session_key);
+	data_len = decrypt_rcved(&qd->session_ctx, NULL, rcved, rcved_len, &data, NULL);
 	if (data_len < 0) {
 		purple_debug_warning("QQ",
 			"Reply can not be decrypted by session key, [%05d], 0x%04X %s, len %d\n",
@@ -1078,7 +1235,8 @@ void qq_proc_client_cmds(PurpleConnection *gc, guint16 cmd, guint16 seq,
 			if (ship_value)
 			{
 				purple_debug_info("QQ", "Requesting Buddy Level pos: %d\n", ship_value);
-				qq_request_get_buddies_level(gc, 0, ship_value);
+				qq_request_get_buddies_level(gc, update_class, ship_value);
+				return;
 			}
 			break;
 		case QQ_CMD_GET_BUDDIES_SIGN:
@@ -1086,7 +1244,8 @@ void qq_proc_client_cmds(PurpleConnection *gc, guint16 cmd, guint16 seq,
 			if (ship_value)
 			{
 				purple_debug_info("QQ", "Requesting Buddy Signature pos: %d\n", ship_value);
-				qq_request_get_buddies_sign(gc, 0, ship_value);
+				qq_request_get_buddies_sign(gc, update_class, ship_value);
+				return;
 			}
 			break;
 		case QQ_CMD_GET_GROUP_LIST:
@@ -1095,7 +1254,7 @@ void qq_proc_client_cmds(PurpleConnection *gc, guint16 cmd, guint16 seq,
 			if (ret_32)
 			{
 				purple_debug_info("QQ", "Requesting for Group pos: %d\n", ret_32);
-				qq_request_get_group_list(gc, ret_32, 0);
+				qq_request_get_group_list(gc, ret_32, update_class);
 				not_to_update = TRUE;		//not to update else when get_group not finished
 			}
 			break;
@@ -1128,7 +1287,9 @@ void qq_proc_client_cmds(PurpleConnection *gc, guint16 cmd, guint16 seq,
 			break;*/
 		case QQ_CMD_BUDDY_MEMO:
 			purple_debug_info("QQ", "Receive memo from server!\n");
-			qq_process_get_buddy_memo(gc, data, data_len, update_class, ship_value);
+			if (qq_process_get_buddy_memo(gc, data, data_len, update_class, ship_value)) {
+				return;		/* more aliases requested, update when the last page comes */
+			}
 			break;
 		default:
 			process_unknown_cmd(gc, _("Unknown CLIENT CMD"), data, data_len, cmd, seq);
@@ -38,6 +38,20 @@ enum {
 	QQ_CMD_CLASS_UPDATE_ROOM
 };
 
+/* stages of qq_update_all, a bit each in qd->update_issued and update_done */
+enum {
+	QQ_UPDATE_MY_INFO = 0x01,
+	QQ_UPDATE_STATUS = 0x02,
+	QQ_UPDATE_GROUPS = 0x04,
+	QQ_UPDATE_BUDDIES = 0x08,
+	QQ_UPDATE_MEMO = 0x10,
+	QQ_UPDATE_LEVEL = 0x20,
+	QQ_UPDATE_ONLINE = 0x40,
+	QQ_UPDATE_SIGN = 0x80,
+	QQ_UPDATE_ROOMS = 0x100
+};
+
+/* rcved is decrypted in place, handlers get a view into it */
 guint8 qq_proc_login_cmds(PurpleConnection *gc,  guint16 cmd, guint16 seq,
 		guint8 *rcved, gint rcved_len, guint32 update_class, guintptr ship_value);
 void qq_proc_client_cmds(PurpleConnection *gc, guint16 cmd, guint16 seq,
@@ -49,6 +63,7 @@ void qq_proc_room_cmds(PurpleConnection *gc, guint16 seq,
 void qq_proc_server_cmd(PurpleConnection *gc, guint16 cmd, guint16 seq, guint8 *rcved, gint rcved_len);
 
 void qq_update_all(PurpleConnection *gc, guint16 cmd);
+void qq_update_stage_done(PurpleConnection *gc, guint32 stage);
 void qq_update_online(PurpleConnection *gc, guint16 cmd);
 void qq_update_room(PurpleConnection *gc, guint8 room_cmd, guint32 room_id);
 void qq_update_all_rooms(PurpleConnection *gc, guint8 room_cmd, guint32 room_id);
@@ -34,6 +34,7 @@
 #include "qq_network.h"
 #include "qq_process.h"
 #include "qq_trans.h"
+#include "trans_timer.h"
 
 enum {
 	QQ_TRANS_IS_SERVER = 0x01,			/* Is server command or client command */
@@ -43,6 +44,7 @@ enum {
 };
 
 struct _qq_transaction {
+	qq_trans_timer timer;	/* first, trans_heap holds pointers to it */
 	guint8 flag;
 	guint16 seq;
 	guint16 cmd;
@@ -56,12 +58,23 @@ struct _qq_transaction {
 	gint fd;
 	gint send_retries;
 	gint rcved_times;
-	gint scan_times;
+
+	gint64 send_time;		/* ms, when first sent, to measure rtt */
+	gint rto;				/* ms, current resend timeout, doubled on each resend */
+	gboolean is_resent;
+	GList *link;			/* node in trans_remained */
 
 	guint32 update_class;
 	guintptr ship_value;
 };
 
+/* cmd and seq are both 16 bits, pack them as the key of trans_table */
+#define TRANS_KEY(cmd, seq)	GUINT_TO_POINTER(((guint32)(cmd) << 16) | (guint16)(seq))
+
+/* received trans are kept for catching duplicated packets,
+ * in count of resend interval */
+#define QQ_TRANS_LINGER		2
+
 struct _qq_resend_data{
 	PurpleConnection *gc;
 	guint16 seq;
@@ -141,10 +154,104 @@ static qq_transaction *trans_create(PurpleConnection *gc, gint fd,
 	return trans;
 }
 
+static void trans_free(qq_transaction *trans)
+{
+	if (trans->data)	g_free(trans->data);
+	g_free(trans);
+}
+
+static gint64 trans_now(void)
+{
+	return g_get_monotonic_time() / 1000;
+}
+
+static gboolean trans_timeout(gpointer data);
+
+/* make sure trans_watcher fires not later than the first deadline */
+static void trans_timer_update(qq_data *qd)
+{
+	qq_transaction *first;
+	gint64 now;
+
+	if (qd->trans_heap == NULL || qd->trans_heap->len == 0) {
+		if (qd->trans_watcher > 0) {
+			purple_timeout_remove(qd->trans_watcher);
+			qd->trans_watcher = 0;
+		}
+		return;
+	}
+
+	first = g_ptr_array_index(qd->trans_heap, 0);
+	if (qd->trans_watcher > 0 && qd->trans_watcher_due <= first->timer.deadline) {
+		/* it fires early at worst, and will be set again then */
+		return;
+	}
+
+	if (qd->trans_watcher > 0) {
+		purple_timeout_remove(qd->trans_watcher);
+	}
+	now = trans_now();
+	qd->trans_watcher_due = MAX(first->timer.deadline, now);
+	qd->trans_watcher = purple_timeout_add(qd->trans_watcher_due - now, trans_timeout, qd->gc);
+}
+
+/* Set a new deadline of trans, it will be looked at by scan then.
+ * Call trans_timer_update after that */
+static void trans_schedule(qq_data *qd, qq_transaction *trans, gint64 deadline)
+{
+	if (trans->link != NULL) {
+		/* remained, not in heap */
+		trans->timer.deadline = deadline;
+		return;
+	}
+	qq_trans_heap_schedule(qd->trans_heap, &trans->timer, deadline);
+}
+
+static gint64 trans_linger_deadline(qq_data *qd)
+{
+	return trans_now() + (gint64) QQ_TRANS_LINGER * qd->itv_config.resend * 1000;
+}
+
+static void trans_add(qq_data *qd, qq_transaction *trans)
+{
+	gpointer key = TRANS_KEY(trans->cmd, trans->seq);
+
+	if (qd->trans_table == NULL) {
+		qd->trans_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+		qd->trans_heap = g_ptr_array_new();
+	}
+
+	/* seq wraps after 65535 packets. The old one is only shadowed here,
+	 * it stays in heap and is freed by scan */
+	g_hash_table_replace(qd->trans_table, key, trans);
+
+	if (trans->flag & QQ_TRANS_REMAINED) {
+		qd->trans_remained = g_list_prepend(qd->trans_remained, trans);
+		trans->link = qd->trans_remained;
+		return;
+	}
+
+	if (trans->flag & QQ_TRANS_IS_SERVER) {
+		trans_schedule(qd, trans, trans_linger_deadline(qd));
+		trans_timer_update(qd);
+		return;
+	}
+
+	/* no rtt measured yet, use resend interval as before */
+	if (qd->trans_rtt.rto <= 0) {
+		qq_trans_rtt_reset(&qd->trans_rtt, qd->itv_config.resend * 1000);
+	}
+	trans->rto = qd->trans_rtt.rto;
+	trans->send_time = trans_now();
+	trans_schedule(qd, trans, trans->send_time + trans->rto);
+	trans_timer_update(qd);
+}
+
 /* Remove a packet with seq from send trans */
 static void trans_remove(PurpleConnection *gc, qq_transaction *trans)
 {
 	qq_data *qd;
+	gpointer key;
 
 	g_return_if_fail(gc != NULL);
 	qd = (qq_data *) gc->proto_data;
@@ -153,36 +260,31 @@ static void trans_remove(PurpleConnection *gc, qq_transaction *trans)
 	g_return_if_fail(trans != NULL);
 #if 0
 	purple_debug_info("QQ_TRANS",
-				"Remove [%s%05d] retry %d rcved %d scan %d %s\n",
+				"Remove [%s%05d] retry %d rcved %d rto %d %s\n",
 				(trans->flag & QQ_TRANS_IS_SERVER) ? "SRV-" : "",
 				trans->seq,
-				trans->send_retries, trans->rcved_times, trans->scan_times,
+				trans->send_retries, trans->rcved_times, trans->rto,
 				qq_get_cmd_desc(trans->cmd));
 #endif
-	if (trans->data)	g_free(trans->data);
-	qd->transactions = g_list_remove(qd->transactions, trans);
-	g_free(trans);
+	key = TRANS_KEY(trans->cmd, trans->seq);
+	if (g_hash_table_lookup(qd->trans_table, key) == trans) {
+		g_hash_table_remove(qd->trans_table, key);
+	}
+	qq_trans_heap_remove(qd->trans_heap, &trans->timer);
+	trans_free(trans);
 }
 
 static qq_transaction *trans_find(PurpleConnection *gc, guint16 cmd, guint16 seq)
 {
 	qq_data *qd;
-	GList *list;
-	qq_transaction *trans;
 
 	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, NULL);
 	qd = (qq_data *) gc->proto_data;
 
-	list = qd->transactions;
-	while (list != NULL) {
-		trans = (qq_transaction *) list->data;
-		if(trans->cmd == cmd && trans->seq == seq) {
-			return trans;
-		}
-		list = list->next;
+	if (qd->trans_table == NULL) {
+		return NULL;
 	}
-
-	return NULL;
+	return (qq_transaction *) g_hash_table_lookup(qd->trans_table, TRANS_KEY(cmd, seq));
 }
 
 void qq_trans_add_client_cmd(PurpleConnection *gc,
@@ -199,7 +301,7 @@ void qq_trans_add_client_cmd(PurpleConnection *gc,
 	purple_debug_info("QQ_TRANS", "Add client cmd, seq %d, data %p, len %d\n",
 			trans->seq, trans->data, trans->data_len);
 #endif
-	qd->transactions = g_list_append(qd->transactions, trans);
+	trans_add(qd, trans);
 }
 
 static gboolean resend_timeout(gpointer data)
@@ -235,8 +337,13 @@ qq_transaction *qq_trans_find_rcved(PurpleConnection *gc, guint16 cmd, guint16 s
 		return NULL;
 	}
 
-	if (trans->rcved_times == 0) {
-		trans->scan_times = 0;
+	if (trans->rcved_times == 0 && !(trans->flag & QQ_TRANS_REMAINED)) {
+		if (!trans->is_resent) {
+			qq_trans_rtt_sample(&qd->trans_rtt, trans_now() - trans->send_time);
+		}
+		/* keep it for a while to catch duplicated replies */
+		trans_schedule(qd, trans, trans_linger_deadline(qd));
+		trans_timer_update(qd);
 	}
 	trans->rcved_times++;
 	/* server may not get our confirm reply before, send reply again*/
@@ -280,7 +387,7 @@ void qq_trans_add_room_cmd(PurpleConnection *gc,
 	purple_debug_info("QQ_TRANS", "Add room cmd, seq %d, data %p, len %d\n",
 		trans->seq, trans->data, trans->data_len);
 #endif
-	qd->transactions = g_list_append(qd->transactions, trans);
+	trans_add(qd, trans);
 }
 
 void qq_trans_add_server_cmd(PurpleConnection *gc, guint16 cmd, guint16 seq,
@@ -296,7 +403,7 @@ void qq_trans_add_server_cmd(PurpleConnection *gc, guint16 cmd, guint16 seq,
 	purple_debug_info("QQ_TRANS", "Add server cmd, seq %d, data %p, len %d\n",
 			trans->seq, trans->data, trans->data_len);
 #endif
-	qd->transactions = g_list_append(qd->transactions, trans);
+	trans_add(qd, trans);
 }
 
 void qq_trans_add_server_reply(PurpleConnection *gc, guint16 cmd, guint16 seq,
@@ -334,39 +441,39 @@ void qq_trans_add_remain(PurpleConnection *gc, guint16 cmd, guint16 seq,
 	purple_debug_info("QQ_TRANS", "Add server cmd and remained, seq %d, data %p, len %d\n",
 			trans->seq, trans->data, trans->data_len);
 #endif
-	qd->transactions = g_list_append(qd->transactions, trans);
+	trans_add(qd, trans);
 }
 
 void qq_trans_process_remained(PurpleConnection *gc)
 {
 	qq_data *qd = (qq_data *)gc->proto_data;
 	GList *curr;
-	GList *next;
 	qq_transaction *trans;
 
 	g_return_if_fail(qd != NULL);
 
-	next = qd->transactions;
-	while( (curr = next) ) {
-		next = curr->next;
+	/* trans_add prepends, process in the order of receiving.
+	 * qq_proc_server_cmd may disconnect and free all, so check list every time */
+	while (qd->trans_remained != NULL) {
+		curr = g_list_last(qd->trans_remained);
 		trans = (qq_transaction *) (curr->data);
 #if 0
 		purple_debug_info("QQ_TRANS", "Scan [%d]\n", trans->seq);
 #endif
-		if ( !(trans->flag & QQ_TRANS_IS_SERVER) ) {
-			continue;
-		}
-		if ( !(trans->flag & QQ_TRANS_REMAINED) ) {
-			continue;
-		}
+		qd->trans_remained = g_list_delete_link(qd->trans_remained, curr);
+		trans->link = NULL;
+
 		/* set QQ_TRANS_REMAINED off */
 		trans->flag &= ~QQ_TRANS_REMAINED;
+		trans_schedule(qd, trans, trans_linger_deadline(qd));
+		trans_timer_update(qd);
 
 #if 1
 		purple_debug_info("QQ_TRANS",
 				"Process server cmd remained, seq %d, data %p, len %d, send_retries %d\n",
 				trans->seq, trans->data, trans->data_len, trans->send_retries);
 #endif
+		/* trans->data is decrypted in place, not valid to process again */
 		qq_proc_server_cmd(gc, trans->cmd, trans->seq, trans->data, trans->data_len);
 	}
 
@@ -374,30 +481,43 @@ void qq_trans_process_remained(PurpleConnection *gc)
 	return;
 }
 
+static gboolean trans_timeout(gpointer data)
+{
+	PurpleConnection *gc = (PurpleConnection *) data;
+	qq_data *qd;
+
+	g_return_val_if_fail(gc != NULL && gc->proto_data != NULL, FALSE);
+	qd = (qq_data *) gc->proto_data;
+	qd->trans_watcher = 0;
+
+	if (qq_trans_scan(gc)) {
+		purple_connection_error_reason(gc,
+			PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+			_("Lost connection with server"));
+	}
+	return FALSE;		/* trans_timer_update adds a new one */
+}
+
+/* Look at expired transactions only, resend or remove them.
+ * Return TRUE if an important one is lost, and connection should be dropped */
 gboolean qq_trans_scan(PurpleConnection *gc)
 {
 	qq_data *qd = (qq_data *)gc->proto_data;
-	GList *curr;
-	GList *next;
 	qq_transaction *trans;
+	gint64 now;
 
 	g_return_val_if_fail(qd != NULL, FALSE);
 
-	next = qd->transactions;
-	while( (curr = next) ) {
-		next = curr->next;
-		trans = (qq_transaction *) (curr->data);
-		/* purple_debug_info("QQ_TRANS", "Scan [%d]\n", trans->seq); */
-
-		if (trans->flag & QQ_TRANS_REMAINED) {
-			/* keep server cmd before login*/
-			continue;
-		}
+	if (qd->trans_heap == NULL) {
+		return FALSE;
+	}
 
-		trans->scan_times++;
-		if (trans->scan_times <= 1) {
-			/* skip in 10 seconds */
-			continue;
+	now = trans_now();
+	while (qd->trans_heap->len > 0) {
+		trans = (qq_transaction *) g_ptr_array_index(qd->trans_heap, 0);
+		/* purple_debug_info("QQ_TRANS", "Scan [%d]\n", trans->seq); */
+		if (trans->timer.deadline > now) {
+			break;
 		}
 
 		if (trans->rcved_times > 0) {
@@ -407,6 +527,8 @@ gboolean qq_trans_scan(PurpleConnection *gc)
 		}
 
 		if (trans->flag & QQ_TRANS_IS_SERVER) {
+			/* server cmd is always received, should not be here */
+			trans_remove(gc, trans);
 			continue;
 		}
 
@@ -431,13 +553,18 @@ gboolean qq_trans_scan(PurpleConnection *gc)
 
 		qd->net_stat.resend++;
 		purple_debug_warning("QQ_TRANS",
-				"Resend [%d] %s data %p, len %d, send_retries %d\n",
+				"Resend [%d] %s data %p, len %d, send_retries %d, rto %d\n",
 				trans->seq, qq_get_cmd_desc(trans->cmd),
-				trans->data, trans->data_len, trans->send_retries);
+				trans->data, trans->data_len, trans->send_retries, trans->rto);
 
+		/* exponential backoff */
+		trans->is_resent = TRUE;
+		trans->rto = qq_trans_rtt_backoff(&qd->trans_rtt, trans->rto);
+		trans_schedule(qd, trans, now + trans->rto);
 		qq_send_cmd_encrypted(gc, trans->cmd, trans->seq, trans->data, trans->data_len, FALSE);
 	}
 
+	trans_timer_update(qd);
 	/* purple_debug_info("QQ_TRANS", "Scan finished\n"); */
 	return FALSE;
 }
@@ -448,16 +575,34 @@ void qq_trans_remove_all(PurpleConnection *gc)
 	qq_data *qd = (qq_data *)gc->proto_data;
 	qq_transaction *trans;
 	gint count = 0;
+	guint i;
 
-	while(qd->transactions != NULL) {
-		trans = (qq_transaction *) (qd->transactions->data);
-		qd->transactions = g_list_remove(qd->transactions, trans);
+	if (qd->trans_watcher > 0) {
+		purple_timeout_remove(qd->trans_watcher);
+		qd->trans_watcher = 0;
+	}
 
-		if (trans->data)	g_free(trans->data);
-		g_free(trans);
+	if (qd->trans_heap != NULL) {
+		for (i = 0; i < qd->trans_heap->len; i++) {
+			trans_free(g_ptr_array_index(qd->trans_heap, i));
+			count++;
+		}
+		g_ptr_array_free(qd->trans_heap, TRUE);
+		qd->trans_heap = NULL;
+	}
 
+	while (qd->trans_remained != NULL) {
+		trans = (qq_transaction *) (qd->trans_remained->data);
+		qd->trans_remained = g_list_delete_link(qd->trans_remained, qd->trans_remained);
+		trans_free(trans);
 		count++;
 	}
+
+	if (qd->trans_table != NULL) {
+		g_hash_table_destroy(qd->trans_table);
+		qd->trans_table = NULL;
+	}
+
 	if (count > 0) {
 		purple_debug_info("QQ_TRANS", "Free all %d packets\n", count);
 	}
@@ -30,6 +30,7 @@
 #include "notify.h"
 
 #include "buddy_list.h"
+#include "buddy_opt.h"
 #include "file_trans.h"
 #include "qq_define.h"
 #include "im.h"
@@ -103,31 +104,69 @@ static ssize_t _qq_xfer_udp_send(const char *buf, size_t len, PurpleXfer *xfer)
 }
 */
 
-static gssize _qq_xfer_udp_send(const guint8 *buf, size_t len, PurpleXfer *xfer)
+static void _qq_xfer_udp_addr(ft_info *info, struct sockaddr_in *sin)
 {
-	struct sockaddr_in sin;
-	ft_info *info;
-
-	info = (ft_info *) xfer->data;
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
 	if (!_qq_in_same_lan(info)) {
-		sin.sin_port = g_htons(info->remote_major_port);
-		sin.sin_addr.s_addr = g_htonl(info->remote_internet_ip);
+		sin->sin_port = g_htons(info->remote_major_port);
+		sin->sin_addr.s_addr = g_htonl(info->remote_internet_ip);
 	} else if (info->use_major) {
-		sin.sin_port = g_htons(info->remote_major_port);
-		sin.sin_addr.s_addr = g_htonl(info->remote_real_ip);
+		sin->sin_port = g_htons(info->remote_major_port);
+		sin->sin_addr.s_addr = g_htonl(info->remote_real_ip);
 	} else {
-		sin.sin_port = g_htons(info->remote_minor_port);
-		sin.sin_addr.s_addr = g_htonl(info->remote_real_ip);
+		sin->sin_port = g_htons(info->remote_minor_port);
+		sin->sin_addr.s_addr = g_htonl(info->remote_real_ip);
 	}
 	purple_debug_info("QQ", "sending to channel: %s:%d\n",
-			inet_ntoa(sin.sin_addr),
-			(int)g_ntohs(sin.sin_port)
+			inet_ntoa(sin->sin_addr),
+			(int)g_ntohs(sin->sin_port)
 		  );
+}
+
+static gssize _qq_xfer_udp_send(const guint8 *buf, size_t len, PurpleXfer *xfer)
+{
+	struct sockaddr_in sin;
+	ft_info *info;
+
+	info = (ft_info *) xfer->data;
+	_qq_xfer_udp_addr(info, &sin);
 	return sendto(info->sender_fd, buf, len, 0, (struct sockaddr *) &sin, sizeof(sin));
 }
 
+/* one datagram from several pieces, file data is sent without a copy */
+gssize _qq_xfer_writev(struct iovec *iov, gint iov_cnt, PurpleXfer *xfer)
+{
+	struct sockaddr_in sin;
+	ft_info *info;
+#ifndef _WIN32
+	struct msghdr msg;
+#else
+	guint8 *buf;
+	gint bytes = 0;
+	gint i;
+#endif
+
+	info = (ft_info *) xfer->data;
+	_qq_xfer_udp_addr(info, &sin);
+#ifndef _WIN32
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &sin;
+	msg.msg_namelen = sizeof(sin);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iov_cnt;
+	return sendmsg(info->sender_fd, &msg, 0);
+#else
+	for (i = 0; i < iov_cnt; i++) bytes += iov[i].iov_len;
+	buf = g_newa(guint8, bytes);
+	for (i = 0, bytes = 0; i < iov_cnt; i++) {
+		memcpy(buf + bytes, iov[i].iov_base, iov[i].iov_len);
+		bytes += iov[i].iov_len;
+	}
+	return sendto(info->sender_fd, buf, bytes, 0, (struct sockaddr *) &sin, sizeof(sin));
+#endif
+}
+
 /* user-defined functions for purple_xfer_read and purple_xfer_write */
 
 /*
@@ -146,8 +185,6 @@ gssize _qq_xfer_write(const guint8 *buf, size_t len, PurpleXfer *xfer)
 static void _qq_xfer_recv_packet(gpointer data, gint source, PurpleInputCondition condition)
 {
 	PurpleXfer *xfer = (PurpleXfer *) data;
-	PurpleAccount *account = purple_xfer_get_account(xfer);
-	PurpleConnection *gc = purple_account_get_connection(account);
 	guint8 *buf;
 	gint size;
 	/* FIXME: It seems that the transfer never use a packet
@@ -157,10 +194,10 @@ static void _qq_xfer_recv_packet(gpointer data, gint source, PurpleInputConditio
 	 */
 	ft_info *info;
 	info = xfer->data;
-	g_return_if_fail (source == info->recv_fd);
+	g_return_if_fail (info != NULL && source == info->recv_fd);
 	buf = g_newa(guint8, 1500);
 	size = _qq_xfer_udp_recv(buf, 1500, xfer);
-	qq_process_recv_file(gc, buf, size);
+	qq_process_recv_file(xfer, buf, size);
 }
 
 /* start file transfer process */
@@ -195,12 +232,75 @@ static void _qq_xfer_recv_start(PurpleXfer *xfer)
 }
 */
 
-static void _qq_xfer_end(PurpleXfer *xfer)
+/* Transfers to different buddies run side by side, each with its own
+ * ft_info, sockets and watchers. The registry keeps a ref on each */
+PurpleXfer *qq_xfer_find(PurpleConnection *gc, guint32 uid)
 {
-	ft_info *info;
-	g_return_if_fail(xfer != NULL && xfer->data != NULL);
-	info = (ft_info *) xfer->data;
+	qq_data *qd = (qq_data *) gc->proto_data;
+
+	if (qd->xfers == NULL) return NULL;
+	return g_hash_table_lookup(qd->xfers, GUINT_TO_POINTER(uid));
+}
+
+static void _qq_xfer_add(PurpleConnection *gc, guint32 uid, PurpleXfer *xfer)
+{
+	qq_data *qd = (qq_data *) gc->proto_data;
+
+	if (qd->xfers == NULL) {
+		qd->xfers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+				NULL, (GDestroyNotify) purple_xfer_unref);
+	}
+	purple_xfer_ref(xfer);
+	g_hash_table_insert(qd->xfers, GUINT_TO_POINTER(uid), xfer);
+}
 
+static void _qq_xfer_remove(PurpleXfer *xfer)
+{
+	PurpleConnection *gc = purple_account_get_connection(purple_xfer_get_account(xfer));
+	guint32 uid = purple_name_to_uid(xfer->who);
+
+	if (gc == NULL || gc->proto_data == NULL) return;
+	if (qq_xfer_find(gc, uid) == xfer) {
+		g_hash_table_remove(((qq_data *) gc->proto_data)->xfers, GUINT_TO_POINTER(uid));
+	}
+}
+
+/* cancel transfers still running, called when the account closes */
+void qq_xfer_remove_all(PurpleConnection *gc)
+{
+	qq_data *qd = (qq_data *) gc->proto_data;
+	GHashTable *xfers = qd->xfers;
+	GHashTableIter iter;
+	PurpleXfer *xfer;
+
+	if (xfers == NULL) return;
+	/* cancel callbacks find nothing to remove */
+	qd->xfers = NULL;
+
+	g_hash_table_iter_init(&iter, xfers);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &xfer)) {
+		if (!purple_xfer_is_completed(xfer) && !purple_xfer_is_canceled(xfer)) {
+			purple_xfer_cancel_local(xfer);
+		}
+	}
+	g_hash_table_destroy(xfers);
+}
+
+/* drop the transfer and all ft_info holds. libpurple calls either the
+ * cancel or the end callback, never both, so each of them calls this */
+static void _qq_xfer_free_info(PurpleXfer *xfer)
+{
+	ft_info *info = (ft_info *) xfer->data;
+
+	/* a send cancelled before _qq_xfer_init has no info, but is
+	 * registered since qq_send_file */
+	_qq_xfer_remove(xfer);
+	if (info == NULL) return;
+
+	qq_xfer_stop(xfer);
+	if (info->major_watcher > 0) {
+		purple_input_remove(info->major_watcher);
+	}
 	qq_xfer_close_file(xfer);
 	if (info->dest_fp != NULL) {
 		fclose(info->dest_fp);
@@ -221,6 +321,13 @@ static void _qq_xfer_end(PurpleXfer *xfer)
 	}
 	*/
 	g_free(info);
+	xfer->data = NULL;
+}
+
+static void _qq_xfer_end(PurpleXfer *xfer)
+{
+	g_return_if_fail(xfer != NULL && xfer->data != NULL);
+	_qq_xfer_free_info(xfer);
 }
 
 static void qq_show_conn_info(ft_info *info)
@@ -276,22 +383,18 @@ gint qq_fill_conn_info(guint8 *raw_data, ft_info *info)
 }
 
 
-/* fill in the common information of file transfer */
+/* fill in the common information of file transfer,
+ * info is the transfer acked or NULL for a new request */
 static gint _qq_create_packet_file_header
-(guint8 *raw_data, guint32 to_uid, guint16 message_type, qq_data *qd, gboolean seq_ack)
+(guint8 *raw_data, guint32 to_uid, guint16 message_type, qq_data *qd, ft_info *info)
 {
 	gint bytes;
 	time_t now;
 	guint16 seq;
-	ft_info *info;
 
 	bytes = 0;
 	now = time(NULL);
-	if (!seq_ack) seq = qd->send_seq;
-	else {
-		info = (ft_info *) qd->xfer->data;
-		seq = info->send_seq;
-	}
+	seq = (info == NULL) ? qd->send_seq : info->send_seq;
 
 	/* 000-003: receiver uid */
 	bytes += qq_put32 (raw_data + bytes, qd->uid);
@@ -430,7 +533,8 @@ static void _qq_xfer_init_socket(PurpleXfer *xfer)
 }
 
 /* create the QQ_FILE_TRANS_REQ packet with file infomations */
-static void _qq_send_packet_file_request (PurpleConnection *gc, guint32 to_uid, gchar *filename, gint filesize)
+static void _qq_send_packet_file_request (PurpleConnection *gc, PurpleXfer *xfer,
+		guint32 to_uid, gchar *filename, gint filesize)
 {
 	qq_data *qd;
 	guint8 *raw_data;
@@ -441,13 +545,16 @@ static void _qq_send_packet_file_request (PurpleConnection *gc, guint32 to_uid,
 	qd = (qq_data *) gc->proto_data;
 
 	info = g_new0(ft_info, 1);
+	info->src_fd = -1;
 	info->to_uid = to_uid;
 	info->send_seq = qd->send_seq;
 	info->local_internet_ip = qd->my_ip.s_addr;
 	info->local_internet_port = qd->my_port;
 	info->local_real_ip = 0x00000000;
 	info->conn_method = 0x00;
-	qd->xfer->data = info;
+	xfer->data = info;
+	/* hash while the buddy decides to accept */
+	qq_xfer_md5_start(xfer);
 
 	filename_len = strlen(filename);
 	filelen_str = g_strdup_printf("%d ?ֽ?", filesize);
@@ -458,7 +565,7 @@ static void _qq_send_packet_file_request (PurpleConnection *gc, guint32 to_uid,
 	bytes = 0;
 
 	bytes += _qq_create_packet_file_header(raw_data + bytes, to_uid,
-			QQ_FILE_TRANS_REQ, qd, FALSE);
+			QQ_FILE_TRANS_REQ, qd, NULL);
 	bytes += qq_fill_conn_info(raw_data + bytes, info);
 	/* 079: 0x20 */
 	bytes += qq_put8 (raw_data + bytes, 0x20);
@@ -482,7 +589,7 @@ static void _qq_send_packet_file_request (PurpleConnection *gc, guint32 to_uid,
 }
 
 /* tell the buddy we want to accept the file */
-static void _qq_send_packet_file_accept(PurpleConnection *gc, guint32 to_uid)
+static void _qq_send_packet_file_accept(PurpleConnection *gc, PurpleXfer *xfer, guint32 to_uid)
 {
 	qq_data *qd;
 	guint8 *raw_data;
@@ -492,10 +599,10 @@ static void _qq_send_packet_file_accept(PurpleConnection *gc, guint32 to_uid)
 	ft_info *info;
 
 	qd = (qq_data *) gc->proto_data;
-	info = (ft_info *) qd->xfer->data;
+	info = (ft_info *) xfer->data;
 
 	purple_debug_info("QQ", "I've accepted the file transfer request from %d\n", to_uid);
-	_qq_xfer_init_socket(qd->xfer);
+	_qq_xfer_init_socket(xfer);
 
 	packet_len = 79;
 	raw_data = g_newa (guint8, packet_len);
@@ -506,7 +613,7 @@ static void _qq_send_packet_file_accept(PurpleConnection *gc, guint32 to_uid)
 	info->local_minor_port = 0;
 	info->local_real_ip = 0;
 
-	bytes += _qq_create_packet_file_header(raw_data + bytes, to_uid, QQ_FILE_TRANS_ACC_UDP, qd, TRUE);
+	bytes += _qq_create_packet_file_header(raw_data + bytes, to_uid, QQ_FILE_TRANS_ACC_UDP, qd, info);
 	bytes += qq_fill_conn_info(raw_data + bytes, info);
 
 	info->local_minor_port = minor_port;
@@ -520,16 +627,14 @@ static void _qq_send_packet_file_accept(PurpleConnection *gc, guint32 to_uid)
 			    packet_len, bytes);
 }
 
-static void _qq_send_packet_file_notifyip(PurpleConnection *gc, guint32 to_uid)
+static void _qq_send_packet_file_notifyip(PurpleConnection *gc, PurpleXfer *xfer, guint32 to_uid)
 {
-	PurpleXfer *xfer;
 	ft_info *info;
 	qq_data *qd;
 	guint8 *raw_data;
 	gint packet_len, bytes;
 
 	qd = (qq_data *) gc->proto_data;
-	xfer = qd->xfer;
 	info = xfer->data;
 
 	packet_len = 79;
@@ -537,7 +642,7 @@ static void _qq_send_packet_file_notifyip(PurpleConnection *gc, guint32 to_uid)
 	bytes = 0;
 
 	purple_debug_info("QQ", "<== sending qq file notify ip packet\n");
-	bytes += _qq_create_packet_file_header(raw_data + bytes, to_uid, QQ_FILE_TRANS_NOTIFY, qd, TRUE);
+	bytes += _qq_create_packet_file_header(raw_data + bytes, to_uid, QQ_FILE_TRANS_NOTIFY, qd, info);
 	bytes += qq_fill_conn_info(raw_data + bytes, info);
 	if (packet_len == bytes)
 		qq_send_cmd(gc, QQ_CMD_SEND_IM, raw_data, bytes);
@@ -548,11 +653,12 @@ static void _qq_send_packet_file_notifyip(PurpleConnection *gc, guint32 to_uid)
 
 	if (xfer->watcher) purple_input_remove(xfer->watcher);
 	xfer->watcher = purple_input_add(info->recv_fd, PURPLE_INPUT_READ, _qq_xfer_recv_packet, xfer);
-	purple_input_add(info->major_fd, PURPLE_INPUT_READ, _qq_xfer_recv_packet, xfer);
+	if (info->major_watcher > 0) purple_input_remove(info->major_watcher);
+	info->major_watcher = purple_input_add(info->major_fd, PURPLE_INPUT_READ, _qq_xfer_recv_packet, xfer);
 }
 
 /* tell the buddy we don't want the file */
-static void _qq_send_packet_file_reject (PurpleConnection *gc, guint32 to_uid)
+static void _qq_send_packet_file_reject (PurpleConnection *gc, guint32 to_uid, ft_info *info)
 {
 	qq_data *qd;
 	guint8 *raw_data;
@@ -565,7 +671,7 @@ static void _qq_send_packet_file_reject (PurpleConnection *gc, guint32 to_uid)
 	raw_data = g_newa (guint8, packet_len);
 	bytes = 0;
 
-	bytes += _qq_create_packet_file_header(raw_data + bytes, to_uid, QQ_FILE_TRANS_DENY_UDP, qd, TRUE);
+	bytes += _qq_create_packet_file_header(raw_data + bytes, to_uid, QQ_FILE_TRANS_DENY_UDP, qd, info);
 
 	if (packet_len == bytes)
 		qq_send_cmd(gc, QQ_CMD_SEND_IM, raw_data, bytes);
@@ -576,7 +682,7 @@ static void _qq_send_packet_file_reject (PurpleConnection *gc, guint32 to_uid)
 }
 
 /* tell the buddy to cancel transfer */
-static void _qq_send_packet_file_cancel (PurpleConnection *gc, guint32 to_uid)
+static void _qq_send_packet_file_cancel (PurpleConnection *gc, guint32 to_uid, ft_info *info)
 {
 	qq_data *qd;
 	guint8 *raw_data;
@@ -590,7 +696,7 @@ static void _qq_send_packet_file_cancel (PurpleConnection *gc, guint32 to_uid)
 	bytes = 0;
 
 	purple_debug_info("_qq_send_packet_file_cancel", "before create header\n");
-	bytes += _qq_create_packet_file_header(raw_data + bytes, to_uid, QQ_FILE_TRANS_CANCEL, qd, TRUE);
+	bytes += _qq_create_packet_file_header(raw_data + bytes, to_uid, QQ_FILE_TRANS_CANCEL, qd, info);
 	purple_debug_info("_qq_send_packet_file_cancel", "end create header\n");
 
 	if (packet_len == bytes) {
@@ -627,7 +733,7 @@ _qq_xfer_init (PurpleXfer * xfer)
 
 	base_filename = g_path_get_basename(filename);
 
-	_qq_send_packet_file_request (gc, to_uid, base_filename,
+	_qq_send_packet_file_request (gc, xfer, to_uid, base_filename,
 			purple_xfer_get_size(xfer));
 	g_free(base_filename);
 }
@@ -637,22 +743,29 @@ static void _qq_xfer_cancel(PurpleXfer *xfer)
 {
 	PurpleConnection *gc;
 	PurpleAccount *account;
+	ft_info *info;
 
 	g_return_if_fail (xfer != NULL);
 	account = purple_xfer_get_account(xfer);
 	gc = purple_account_get_connection(account);
+	info = (ft_info *) xfer->data;
 
+	/* no info, no request was sent to the buddy */
+	if (info == NULL) {
+		_qq_xfer_free_info(xfer);
+		return;
+	}
 	switch (purple_xfer_get_status(xfer)) {
 		case PURPLE_XFER_STATUS_CANCEL_LOCAL:
-			_qq_send_packet_file_cancel(gc, purple_name_to_uid(xfer->who));
+			_qq_send_packet_file_cancel(gc, purple_name_to_uid(xfer->who), info);
 			break;
 		case PURPLE_XFER_STATUS_CANCEL_REMOTE:
-			_qq_send_packet_file_cancel(gc, purple_name_to_uid(xfer->who));
+			_qq_send_packet_file_cancel(gc, purple_name_to_uid(xfer->who), info);
 			break;
 		case PURPLE_XFER_STATUS_NOT_STARTED:
 			break;
 		case PURPLE_XFER_STATUS_UNKNOWN:
-			_qq_send_packet_file_reject(gc, purple_name_to_uid(xfer->who));
+			_qq_send_packet_file_reject(gc, purple_name_to_uid(xfer->who), info);
 			break;
 		case PURPLE_XFER_STATUS_DONE:
 			break;
@@ -661,6 +774,7 @@ static void _qq_xfer_cancel(PurpleXfer *xfer)
 		case PURPLE_XFER_STATUS_STARTED:
 			break;
 	}
+	_qq_xfer_free_info(xfer);
 }
 
 /* init the transfer of receiving files */
@@ -673,7 +787,7 @@ static void _qq_xfer_recv_init(PurpleXfer *xfer)
 	account = purple_xfer_get_account(xfer);
 	gc = purple_account_get_connection(account);
 
-	_qq_send_packet_file_accept(gc, purple_name_to_uid(xfer->who));
+	_qq_send_packet_file_accept(gc, xfer, purple_name_to_uid(xfer->who));
 }
 
 /* process reject im for file transfer request */
@@ -681,11 +795,11 @@ void qq_process_recv_file_reject (guint8 *data, gint data_len,
 		guint32 sender_uid, PurpleConnection *gc)
 {
 	gchar *msg, *filename;
-	qq_data *qd;
+	PurpleXfer *xfer;
 
 	g_return_if_fail (data != NULL && data_len != 0);
-	qd = (qq_data *) gc->proto_data;
-	g_return_if_fail (qd->xfer != NULL);
+	xfer = qq_xfer_find(gc, sender_uid);
+	g_return_if_fail (xfer != NULL);
 
 	/*	border has been checked before
 	if (*cursor >= (data + data_len - 1)) {
@@ -694,13 +808,14 @@ void qq_process_recv_file_reject (guint8 *data, gint data_len,
 		return;
 	}
 	*/
-	filename = g_path_get_basename(purple_xfer_get_local_filename(qd->xfer));
+	filename = g_path_get_basename(purple_xfer_get_local_filename(xfer));
 	msg = g_strdup_printf(_("%d has declined the file %s"),
 		 sender_uid, filename);
 
 	purple_notify_warning (gc, _("File Send"), msg, NULL);
-	purple_xfer_request_denied(qd->xfer);
-	qd->xfer = NULL;
+	/* no request denied callback on a send */
+	_qq_xfer_free_info(xfer);
+	purple_xfer_request_denied(xfer);
 
 	g_free(filename);
 	g_free(msg);
@@ -711,12 +826,12 @@ void qq_process_recv_file_cancel (guint8 *data, gint data_len,
 		guint32 sender_uid, PurpleConnection *gc)
 {
 	gchar *msg, *filename;
-	qq_data *qd;
+	PurpleXfer *xfer;
 
 	g_return_if_fail (data != NULL && data_len != 0);
-	qd = (qq_data *) gc->proto_data;
-	g_return_if_fail (qd->xfer != NULL
-			&& purple_xfer_get_filename(qd->xfer) != NULL);
+	xfer = qq_xfer_find(gc, sender_uid);
+	g_return_if_fail (xfer != NULL
+			&& purple_xfer_get_filename(xfer) != NULL);
 
 	/*	border has been checked before
 	if (*cursor >= (data + data_len - 1)) {
@@ -724,14 +839,13 @@ void qq_process_recv_file_cancel (guint8 *data, gint data_len,
 		return;
 	}
 	*/
-	filename = g_path_get_basename(purple_xfer_get_local_filename(qd->xfer));
+	filename = g_path_get_basename(purple_xfer_get_local_filename(xfer));
 	msg = g_strdup_printf
 		(_("%d cancelled the transfer of %s"),
 		 sender_uid, filename);
 
 	purple_notify_warning (gc, _("File Send"), msg, NULL);
-	purple_xfer_cancel_remote(qd->xfer);
-	qd->xfer = NULL;
+	purple_xfer_cancel_remote(xfer);
 
 	g_free(filename);
 	g_free(msg);
@@ -740,14 +854,13 @@ void qq_process_recv_file_cancel (guint8 *data, gint data_len,
 /* process accept im for file transfer request */
 void qq_process_recv_file_accept(guint8 *data, gint data_len, guint32 sender_uid, PurpleConnection *gc)
 {
-	qq_data *qd;
 	gint bytes;
 	ft_info *info;
 	PurpleXfer *xfer;
 
 	g_return_if_fail (data != NULL && data_len != 0);
-	qd = (qq_data *) gc->proto_data;
-	xfer = qd->xfer;
+	xfer = qq_xfer_find(gc, sender_uid);
+	g_return_if_fail (xfer != NULL && xfer->data != NULL);
 	info = (ft_info *) xfer->data;
 
 	if (data_len <= 30 + QQ_CONN_INFO_LEN) {
@@ -760,7 +873,7 @@ void qq_process_recv_file_accept(guint8 *data, gint data_len, guint32 sender_uid
 	_qq_xfer_init_socket(xfer);
 
 	_qq_xfer_init_udp_channel(info);
-	_qq_send_packet_file_notifyip(gc, sender_uid);
+	_qq_send_packet_file_notifyip(gc, xfer, sender_uid);
 }
 
 /* process request from buddy's im for file transfer request */
@@ -772,21 +885,24 @@ void qq_process_recv_file_request(guint8 *data, gint data_len, guint32 sender_ui
 	ft_info *info;
 	PurpleBuddy *b;
 	qq_buddy_data *bd;
+	qq_buddy_slot *slot;
 	gint bytes;
 
 	g_return_if_fail (data != NULL && data_len != 0);
 	qd = (qq_data *) gc->proto_data;
 
-	info = g_newa(ft_info, 1);
-	info->local_internet_ip = qd->my_ip.s_addr;
-	info->local_internet_port = qd->my_port;
-	info->local_real_ip = 0x00000000;
-	info->to_uid = sender_uid;
-
 	if (data_len <= 2 + 30 + QQ_CONN_INFO_LEN) {
 		purple_debug_warning("QQ", "Received file request message is empty\n");
 		return;
 	}
+
+	/* kept as xfer->data, freed by _qq_xfer_free_info */
+	info = g_new0(ft_info, 1);
+	info->src_fd = -1;
+	info->local_internet_ip = qd->my_ip.s_addr;
+	info->local_internet_port = qd->my_port;
+	info->local_real_ip = 0x00000000;
+	info->to_uid = sender_uid;
 	bytes = 0;
 	bytes += qq_get16(&(info->send_seq), data + bytes);
 
@@ -794,7 +910,11 @@ void qq_process_recv_file_request(guint8 *data, gint data_len, guint32 sender_ui
 	bytes += qq_get_conn_info(info, data + bytes);
 
 	fileinfo = g_strsplit((gchar *) (data + 81 + 12), "\x1f", 2);
-	g_return_if_fail (fileinfo != NULL && fileinfo[0] != NULL && fileinfo[1] != NULL);
+	if (fileinfo == NULL || fileinfo[0] == NULL || fileinfo[1] == NULL) {
+		g_strfreev(fileinfo);
+		g_free(info);
+		return;
+	}
 
 	sender_name = uid_to_purple_name(sender_uid);
 
@@ -803,7 +923,7 @@ void qq_process_recv_file_request(guint8 *data, gint data_len, guint32 sender_ui
 		purple_debug_warning("QQ",
 			    "Received a FACE ip detect from %d, so he/she must be online :)\n", sender_uid);
 
-		b = purple_find_buddy(gc->account, sender_name);
+		b = qq_buddy_find(gc, sender_uid);
 		bd = (b == NULL) ? NULL : purple_buddy_get_protocol_data(b);
 		if (bd) {
 			if(0 != info->remote_real_ip) {
@@ -815,10 +935,11 @@ void qq_process_recv_file_request(guint8 *data, gint data_len, guint32 sender_ui
 				bd->port = info->remote_major_port;
 			}
 
-			if(!is_online(bd->status)) {
-				bd->status = QQ_BUDDY_ONLINE_INVISIBLE;
-				bd->last_update = time(NULL);
-				qq_update_buddy_status(gc, bd->uid, bd->status, bd->comm_flag);
+			slot = qq_buddy_slot_find(gc, sender_uid);
+			if(!is_online(slot->status)) {
+				slot->status = QQ_BUDDY_ONLINE_INVISIBLE;
+				slot->last_update = time(NULL);
+				qq_update_buddy_status(gc, bd->uid, slot->status, bd->comm_flag);
 			}
 			else
 				purple_debug_info("QQ", "buddy %d is already online\n", sender_uid);
@@ -827,6 +948,15 @@ void qq_process_recv_file_request(guint8 *data, gint data_len, guint32 sender_ui
 		else
 			purple_debug_warning("QQ", "buddy %d is not in list\n", sender_uid);
 
+		g_free(info);
+		g_free(sender_name);
+		g_strfreev(fileinfo);
+		return;
+	}
+
+	if (qq_xfer_find(gc, sender_uid) != NULL) {
+		purple_debug_warning("QQ", "Ignore file request from %d, a transfer is running\n", sender_uid);
+		g_free(info);
 		g_free(sender_name);
 		g_strfreev(fileinfo);
 		return;
@@ -847,9 +977,11 @@ void qq_process_recv_file_request(guint8 *data, gint data_len, guint32 sender_ui
 		purple_xfer_set_write_fnc(xfer, _qq_xfer_write);
 
 		xfer->data = info;
-		qd->xfer = xfer;
+		_qq_xfer_add(gc, sender_uid, xfer);
 
 		purple_xfer_request(xfer);
+	} else {
+		g_free(info);
 	}
 
 	g_free(sender_name);
@@ -859,16 +991,14 @@ void qq_process_recv_file_request(guint8 *data, gint data_len, guint32 sender_ui
 static void _qq_xfer_send_notify_ip_ack(gpointer data, gint source, PurpleInputCondition cond)
 {
 	PurpleXfer *xfer = (PurpleXfer *) data;
-	PurpleAccount *account = purple_xfer_get_account(xfer);
-	PurpleConnection *gc = purple_account_get_connection(account);
 	ft_info *info = (ft_info *) xfer->data;
 
 	purple_input_remove(xfer->watcher);
 	xfer->watcher = purple_input_add(info->recv_fd, PURPLE_INPUT_READ, _qq_xfer_recv_packet, xfer);
-	qq_send_file_ctl_packet(gc, QQ_FILE_CMD_NOTIFY_IP_ACK, info->to_uid, 0);
+	qq_send_file_ctl_packet(xfer, QQ_FILE_CMD_NOTIFY_IP_ACK, info->to_uid, 0);
 	/*
 	info->use_major = TRUE;
-	qq_send_file_ctl_packet(gc, QQ_FILE_CMD_NOTIFY_IP_ACK, info->to_uid, 0);
+	qq_send_file_ctl_packet(xfer, QQ_FILE_CMD_NOTIFY_IP_ACK, info->to_uid, 0);
 	info->use_major = FALSE;
 	*/
 }
@@ -877,15 +1007,13 @@ void qq_process_recv_file_notify(guint8 *data, gint data_len,
 		guint32 sender_uid, PurpleConnection *gc)
 {
 	gint bytes;
-	qq_data *qd;
 	ft_info *info;
 	PurpleXfer *xfer;
 
 	g_return_if_fail (data != NULL && data_len != 0);
-	qd = (qq_data *) gc->proto_data;
-
-	xfer = qd->xfer;
-	info = (ft_info *) qd->xfer->data;
+	xfer = qq_xfer_find(gc, sender_uid);
+	g_return_if_fail (xfer != NULL && xfer->data != NULL);
+	info = (ft_info *) xfer->data;
 	if (data_len <= 2 + 30 + QQ_CONN_INFO_LEN) {
 		purple_debug_warning("QQ", "Received file notify message is empty\n");
 		return;
@@ -910,10 +1038,16 @@ gboolean qq_can_receive_file(PurpleConnection *gc, const char *who)
 
 void qq_send_file(PurpleConnection *gc, const char *who, const char *file)
 {
-	qq_data *qd;
 	PurpleXfer *xfer;
+	guint32 to_uid;
 
-	qd = (qq_data *) gc->proto_data;
+	to_uid = purple_name_to_uid(who);
+	g_return_if_fail(to_uid != 0);
+	if (qq_xfer_find(gc, to_uid) != NULL) {
+		purple_notify_error(gc, _("File Send"),
+				_("A file transfer with this buddy is already running"), NULL);
+		return;
+	}
 
 	xfer = purple_xfer_new (gc->account, PURPLE_XFER_SEND,
 			      who);
@@ -921,9 +1055,10 @@ void qq_send_file(PurpleConnection *gc, const char *who, const char *file)
 	{
 		purple_xfer_set_init_fnc (xfer, _qq_xfer_init);
 		purple_xfer_set_cancel_send_fnc (xfer, _qq_xfer_cancel);
+		purple_xfer_set_end_fnc(xfer, _qq_xfer_end);
 		purple_xfer_set_write_fnc(xfer, _qq_xfer_write);
 
-		qd->xfer = xfer;
+		_qq_xfer_add(gc, to_uid, xfer);
 		purple_xfer_request(xfer);
 	}
 }
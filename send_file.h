@@ -27,6 +27,19 @@
 
 #include "ft.h"
 #include "qq.h"
+#include "file_window.h"
+
+#ifdef _WIN32
+/* no scatter/gather io, _qq_xfer_writev copies into one buffer */
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+typedef struct _qq_file_md5_job qq_file_md5_job;
 
 typedef struct _ft_info {
 	guint32 to_uid;
@@ -46,13 +59,12 @@ typedef struct _ft_info {
 	/* we use these to control the packets sent or received */
 	guint32 fragment_num;
 	guint32 fragment_len;
-	/* The max index of sending/receiving fragment
-	 * for sender, it is the lower bolder of a slide window for sending
-	 * for receiver, it seems that packets having a fragment index lower
-	 * than max_fragment_index have been received already
-	 */
-	guint32 max_fragment_index;
-	guint32 window;
+	/* fragments sent, acked or received, see file_window.h */
+	qq_file_window window;
+	gboolean file_opened;
+	/* sender only */
+	guint resend_timeout;
+	guint fill_timeout;	/* rest of the window goes out in next main loop turn */
 
 	/* It seems that using xfer's function is not enough for our
 	 * transfer module. So I will use our own structure instead
@@ -62,9 +74,23 @@ typedef struct _ft_info {
 	int minor_fd;
 	int sender_fd;
 	int recv_fd;
+	guint major_watcher;
 	FILE *dest_fp;
-	/* guint8 *buffer; */
+	/* file to send, see _qq_xfer_fragment_view */
+	int src_fd;
+	guint8 *map;
+	gsize map_offset;
+	gsize map_len;
+	guint8 *fragment_buf;
 	gboolean use_major;
+	/* md5 of the file to send, hashed in a thread by qq_xfer_md5_start */
+	guint8 file_md5[QQ_KEY_LENGTH];
+	gboolean md5_ready;
+	gboolean basic_info_wait;	/* receiver said hello before md5 is ready */
+	qq_file_md5_job *md5_job;
+	/* receiver only, see _qq_recv_resume */
+	gboolean resume_wait;	/* hashing the file on disk before the basic info ack */
+	guint32 resume_fragment;	/* first fragment asked for in the ack */
 } ft_info;
 
 void qq_process_recv_file_accept(guint8 *data, gint data_len, guint32 sender_uid, PurpleConnection *gc);
@@ -73,9 +99,12 @@ void qq_process_recv_file_cancel(guint8 *data, gint data_len, guint32 sender_uid
 void qq_process_recv_file_request(guint8 *data, gint data_len, guint32 sender_uid, PurpleConnection *gc);
 void qq_process_recv_file_notify(guint8 *data, gint data_len, guint32 sender_uid, PurpleConnection *gc);
 gboolean qq_can_receive_file(PurpleConnection *gc, const char *who);
+PurpleXfer *qq_xfer_find(PurpleConnection *gc, guint32 uid);
+void qq_xfer_remove_all(PurpleConnection *gc);
 void qq_send_file(PurpleConnection *gc, const char *who, const char *file);
 gint qq_get_conn_info(ft_info *info, guint8 *data);
 gint qq_fill_conn_info(guint8 *data, ft_info *info);
 gssize _qq_xfer_write(const guint8 *buf, size_t len, PurpleXfer *xfer);
+gssize _qq_xfer_writev(struct iovec *iov, gint iov_cnt, PurpleXfer *xfer);
 
 #endif
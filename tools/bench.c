@@ -0,0 +1,359 @@
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eventloop.h"
+
+#include "qq.h"
+#include "char_conv.h"
+#include "im.h"
+#include "packet_parse.h"
+#include "qq_crypt.h"
+#include "qq_define.h"
+#include "qq_network.h"
+#include "qq_trans.h"
+#include "utils.h"
+
+#define BENCH_MIN_SECONDS 0.2
+#define BENCH_BATCH 1000
+#define BENCH_CRYPT_BATCH 8		/* one round of the crypt lanes */
+
+typedef void (*bench_func)(gpointer data);
+
+/* Output is one line per case, tab separated:
+ *   name  param  iterations  ns/op  MB/s
+ * MB/s is "-" for cases that do not process a byte stream */
+static void report(const gchar* name, glong param, glong iters, gdouble seconds, glong bytes) {
+	g_printf("%s\t%ld\t%ld\t%.1f\t", name, param, iters, seconds * 1e9 / iters);
+	if (bytes > 0) {
+		g_printf("%.1f\n", (gdouble) bytes * iters / seconds / 1e6);
+	} else {
+		g_printf("-\n");
+	}
+}
+
+/* call func in batches until BENCH_MIN_SECONDS passed, bytes is per call */
+static void run(const gchar* name, glong param, glong bytes, bench_func func, gpointer data) {
+	GTimer* timer;
+	glong iters, i;
+	gdouble elapsed;
+
+	timer = g_timer_new();
+	iters = 0;
+	do {
+		for (i = 0; i < BENCH_BATCH; i++, iters++) {
+			func(data);
+		}
+		elapsed = g_timer_elapsed(timer, NULL);
+	} while (elapsed < BENCH_MIN_SECONDS);
+	g_timer_destroy(timer);
+
+	report(name, param, iters, elapsed, bytes);
+}
+
+/* qq_trans arms its resend timer through libpurple. No main loop runs
+ * here, so the timers are never dispatched */
+static PurpleEventLoopUiOps eventloop_ops = {
+	g_timeout_add,
+	g_source_remove,
+	NULL,
+	NULL,
+	NULL,
+	g_timeout_add_seconds,
+	NULL, NULL, NULL
+};
+
+static void bench_trans_find(glong outstanding) {
+	PurpleConnection gc;
+	qq_data qd;
+	guint8 data[32];
+	GTimer* timer;
+	glong iters, i;
+	gdouble elapsed;
+
+	memset(&gc, 0, sizeof(gc));
+	memset(&qd, 0, sizeof(qd));
+	memset(data, 0x5a, sizeof(data));
+	gc.proto_data = &qd;
+	qd.gc = &gc;
+	qd.fd = -1;
+	qd.resend_times = 5;
+
+	/* seq is 16 bits, spread the rest over several cmd */
+	for (i = 0; i < outstanding; i++) {
+		qq_trans_add_client_cmd(&gc, QQ_CMD_GET_LEVEL + (i >> 16), i & 0xffff,
+				data, sizeof(data), 0, 0);
+	}
+
+	timer = g_timer_new();
+	iters = 0;
+	do {
+		for (i = 0; i < 100000; i++, iters++) {
+			glong n = (iters * 7919) % outstanding;
+			qq_trans_find_rcved(&gc, QQ_CMD_GET_LEVEL + (n >> 16), n & 0xffff);
+		}
+		elapsed = g_timer_elapsed(timer, NULL);
+	} while (elapsed < BENCH_MIN_SECONDS);
+	g_timer_destroy(timer);
+
+	report("trans_find", outstanding, iters, elapsed, 0);
+	qq_trans_remove_all(&gc);
+}
+
+typedef struct {
+	guint8 key[QQ_KEY_LENGTH];
+	qq_crypt_ctx ctx;
+	guint8* plain;
+	gint plain_len;
+	guint8* crypted;
+	gint crypted_len;
+	guint8* buf;
+	qq_crypt_buf bufs[BENCH_CRYPT_BATCH];
+} crypt_case;
+
+static void do_encrypt_key(gpointer data) {
+	crypt_case* c = data;
+	qq_encrypt(c->buf, c->plain, c->plain_len, c->key);
+}
+
+static void do_encrypt_ctx(gpointer data) {
+	crypt_case* c = data;
+	qq_crypt_ctx_encrypt(&c->ctx, c->buf, c->plain, c->plain_len);
+}
+
+static void do_decrypt_key(gpointer data) {
+	crypt_case* c = data;
+	qq_decrypt(c->buf, c->crypted, c->crypted_len, c->key);
+}
+
+/* same as the receive path, one copy into the frame then in place */
+static void do_decrypt_ctx(gpointer data) {
+	crypt_case* c = data;
+	guint8* text;
+	memcpy(c->buf, c->crypted, c->crypted_len);
+	qq_crypt_ctx_decrypt(&c->ctx, c->buf, c->crypted_len, &text);
+}
+
+/* a batch of the same message, so MB/s compares with the single cases */
+static void do_encrypt_batch(gpointer data) {
+	crypt_case* c = data;
+	gint i;
+	for (i = 0; i < BENCH_CRYPT_BATCH; i++) {
+		c->bufs[i].in = c->plain;
+		c->bufs[i].in_len = c->plain_len;
+	}
+	qq_encrypt_batch(&c->ctx, c->bufs, BENCH_CRYPT_BATCH);
+}
+
+/* out is not in, the batch copies as do_decrypt_ctx does */
+static void do_decrypt_batch(gpointer data) {
+	crypt_case* c = data;
+	gint i;
+	for (i = 0; i < BENCH_CRYPT_BATCH; i++) {
+		c->bufs[i].in = c->crypted;
+		c->bufs[i].in_len = c->crypted_len;
+	}
+	qq_decrypt_batch(&c->ctx, c->bufs, BENCH_CRYPT_BATCH);
+}
+
+static void bench_crypt(glong plain_len) {
+	crypt_case c;
+	gint i;
+
+	for (i = 0; i < QQ_KEY_LENGTH; i++) {
+		c.key[i] = i * 17;
+	}
+	qq_crypt_ctx_init(&c.ctx, c.key);
+	c.plain_len = plain_len;
+	c.plain = g_malloc(plain_len);
+	for (i = 0; i < plain_len; i++) {
+		c.plain[i] = i & 0xff;
+	}
+	c.crypted = g_malloc(plain_len + 17);
+	c.buf = g_malloc(plain_len + 17);
+	c.crypted_len = qq_encrypt(c.crypted, c.plain, plain_len, c.key);
+	for (i = 0; i < BENCH_CRYPT_BATCH; i++) {
+		c.bufs[i].out = g_malloc(plain_len + 17);
+	}
+
+	run("encrypt_key", plain_len, plain_len, do_encrypt_key, &c);
+	run("encrypt_ctx", plain_len, plain_len, do_encrypt_ctx, &c);
+	run("decrypt_key", plain_len, plain_len, do_decrypt_key, &c);
+	run("decrypt_ctx", plain_len, plain_len, do_decrypt_ctx, &c);
+	run("encrypt_batch", plain_len, plain_len * BENCH_CRYPT_BATCH, do_encrypt_batch, &c);
+	run("decrypt_batch", plain_len, plain_len * BENCH_CRYPT_BATCH, do_decrypt_batch, &c);
+
+	for (i = 0; i < BENCH_CRYPT_BATCH; i++) {
+		g_free(c.bufs[i].out);
+	}
+	g_free(c.plain);
+	g_free(c.crypted);
+	g_free(c.buf);
+}
+
+typedef struct {
+	guint8* data;
+	const gchar* charset;
+} vstr_case;
+
+static void do_get_vstr(gpointer data) {
+	vstr_case* c = data;
+	gchar* str;
+	qq_get_vstr(&str, c->charset, sizeof(guint16), c->data);
+	g_free(str);
+}
+
+static void bench_get_vstr(glong len) {
+	vstr_case c;
+	glong i;
+
+	/* GB18030 text of 2 byte chars, also valid input to copy as is */
+	c.data = g_malloc(len + 2);
+	qq_put16(c.data, len);
+	for (i = 0; i < len; i += 2) {
+		c.data[2 + i] = 0xc4;
+		c.data[2 + i + 1] = 0xe3;
+	}
+
+	c.charset = NULL;
+	run("get_vstr_raw", len, len, do_get_vstr, &c);
+	c.charset = QQ_CHARSET_DEFAULT;
+	run("get_vstr_conv", len, len, do_get_vstr, &c);
+
+	g_free(c.data);
+}
+
+static void do_im_get_segments(gpointer data) {
+	GSList* segments = qq_im_get_segments(data, FALSE);
+	GSList* it;
+	for (it = segments; it != NULL; it = it->next) {
+		g_string_free(it->data, TRUE);
+	}
+	g_slist_free(segments);
+}
+
+static void bench_im_get_segments(glong len) {
+	GString* msg = g_string_new("");
+
+	/* text with a smiley in every 32 bytes */
+	while (msg->len < len) {
+		g_string_append(msg, "hello world, this is qq ... /wx$");
+	}
+	g_string_truncate(msg, len);
+
+	run("im_get_segments", len, len, do_im_get_segments, msg->str);
+	g_string_free(msg, TRUE);
+}
+
+typedef struct {
+	gchar* text;
+	gchar* work;
+	gsize len;
+} emoticon_case;
+
+/* qq_emoticon_to_purple changes text, so work on a fresh copy */
+static void do_emoticon_to_purple(gpointer data) {
+	emoticon_case* c = data;
+	memcpy(c->work, c->text, c->len + 1);
+	g_free(qq_emoticon_to_purple(c->work));
+}
+
+static void bench_emoticon_to_purple(glong len) {
+	emoticon_case c;
+	GString* text = g_string_new("");
+
+	/* 0x14 and smiley symbol 0x41 in every 32 bytes */
+	while (text->len < len) {
+		g_string_append(text, "\x14\x41hello world, this is qq ......");
+	}
+	g_string_truncate(text, len);
+	c.text = text->str;
+	c.len = text->len;
+	c.work = g_malloc(c.len + 1);
+
+	run("emoticon_to_purple", len, len, do_emoticon_to_purple, &c);
+	g_free(c.work);
+	g_string_free(text, TRUE);
+}
+
+typedef struct {
+	guint8* buf;
+	gint len;
+} bytes_case;
+
+static void do_crc32(gpointer data) {
+	bytes_case* c = data;
+	qq_crc32(0xFFFFFFFF, c->buf, c->len);
+}
+
+static void bench_crc32(glong len) {
+	bytes_case c;
+
+	c.buf = g_malloc0(len);
+	c.len = len;
+	run("crc32", len, len, do_crc32, &c);
+	g_free(c.buf);
+}
+
+/* walk all packets in the stream as tcp_pending does */
+static void do_tcp_frame(gpointer data) {
+	bytes_case* c = data;
+	gint pos = 0, pkt_len;
+
+	while ((pkt_len = qq_tcp_frame(c->buf + pos, c->len - pos)) != 0) {
+		pos += (pkt_len > 0) ? pkt_len : -pkt_len;
+	}
+}
+
+static void bench_tcp_frame(glong pkt_len) {
+	bytes_case c;
+	gint pos;
+
+	/* 64KB of packets back to back */
+	c.len = (65536 / pkt_len) * pkt_len;
+	c.buf = g_malloc0(c.len);
+	for (pos = 0; pos < c.len; pos += pkt_len) {
+		qq_put16(c.buf + pos, pkt_len);
+		c.buf[pos + 2] = QQ_PACKET_TAG;
+		c.buf[pos + pkt_len - 1] = QQ_PACKET_TAIL;
+	}
+
+	run("tcp_frame", pkt_len, c.len, do_tcp_frame, &c);
+	g_free(c.buf);
+}
+
+int main(int argc, char** argv) {
+	static const glong outstanding[] = { 10, 100, 1000, 10000, 100000 };
+	static const glong sizes[] = { 16, 64, 256, 1024, 4096 };
+	static const glong pkt_lens[] = { 32, 128, 512, 1400 };
+	gsize i;
+
+	purple_eventloop_set_ui_ops(&eventloop_ops);
+
+	g_printf("# case\tparam\titerations\tns/op\tMB/s\n");
+	for (i = 0; i < G_N_ELEMENTS(outstanding); i++) {
+		bench_trans_find(outstanding[i]);
+	}
+	for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+		bench_crypt(sizes[i]);
+	}
+	for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+		bench_get_vstr(sizes[i]);
+	}
+	for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+		bench_im_get_segments(sizes[i]);
+	}
+	for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+		bench_emoticon_to_purple(sizes[i]);
+	}
+	for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+		bench_crc32(sizes[i]);
+	}
+	for (i = 0; i < G_N_ELEMENTS(pkt_lens); i++) {
+		bench_tcp_frame(pkt_lens[i]);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,267 @@
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qq.h"
+#include "packet_parse.h"
+#include "qq_crypt.h"
+#include "qq_define.h"
+#include "qq_network.h"
+
+/* Checks of kernels that need no connection, run by "make check".
+ *
+ *   qq_check [seed]
+ *
+ * Output is one line per check, tab separated:
+ *   name  cases  ok|FAILED
+ * The exit status is non zero if any check failed, the seed is printed
+ * first so a failure can be run again */
+
+#define CHECK_TCP_PACKETS 40		/* stream split at every byte boundary */
+#define CHECK_TCP_LONG_PACKETS 400	/* stream larger than the receive buffer */
+#define CHECK_TCP_ROUNDS 200		/* random splits of each stream */
+#define CHECK_CRYPT_MAXLEN 300		/* plain lengths 0 to this, in turn */
+#define CHECK_CRYPT_BATCH 19		/* batches of 0 to this, over two lane rounds */
+#define CHECK_CRYPT_ROUNDS 3000
+
+static void report(const gchar* name, glong cases, gboolean ok) {
+	g_printf("%s\t%ld\t%s\n", name, cases, ok ? "ok" : "FAILED");
+}
+
+/* Packets back to back as the server sends them, with junk in between:
+ * random bytes, packets with a bad tail tag and lengths too short to be
+ * a packet. The last packet is cut. long_packets also makes packets
+ * close to MAX_PACKET_SIZE, so the receive buffer has to compact */
+static GByteArray* tcp_stream(GRand* rand, gint packets, gboolean long_packets) {
+	static const guint8 junk[] = { 0x00, QQ_PACKET_TAG, QQ_PACKET_TAIL };
+	GByteArray* out = g_byte_array_new();
+	guint8 buf[MAX_PACKET_SIZE];
+	gint i, j, len, kind;
+
+	for (i = 0; i < packets; i++) {
+		kind = g_rand_int_range(rand, 0, 10);
+		if (long_packets && kind == 0) {
+			len = g_rand_int_range(rand, MAX_PACKET_SIZE - 2000, MAX_PACKET_SIZE + 1);
+		} else {
+			len = g_rand_int_range(rand, QQ_TCP_HEADER_LENGTH, 200);
+		}
+		/* random payload in the short stream would often claim a length
+		 * beyond its end after a jump, and the walk would stop there.
+		 * so tails are found only in junk there, and after packets */
+		for (j = 0; j < len; j++) {
+			buf[j] = g_rand_int_range(rand, long_packets ? 0 : QQ_PACKET_TAIL + 1, 256);
+		}
+
+		if (kind == 1) {
+			/* junk, may hold tag and tail bytes */
+			len = g_rand_int_range(rand, 1, 40);
+			for (j = 0; j < len && !long_packets; j++) {
+				buf[j] = junk[g_rand_int_range(rand, 0, G_N_ELEMENTS(junk))];
+			}
+		} else if (kind == 2) {
+			/* length below the header */
+			qq_put16(buf, g_rand_int_range(rand, 0, QQ_TCP_HEADER_LENGTH));
+			len = QQ_TCP_HEADER_LENGTH;
+		} else {
+			qq_put16(buf, len);
+			buf[2] = QQ_PACKET_TAG;
+			buf[len - 1] = QQ_PACKET_TAIL;
+			if (kind == 3) {
+				/* bad tail */
+				buf[len - 1] = QQ_PACKET_TAIL + 1;
+			}
+		}
+		if (i == packets - 1) {
+			len = g_rand_int_range(rand, 1, len + 1);
+		}
+		g_byte_array_append(out, buf, len);
+	}
+	return out;
+}
+
+/* packets found walking the whole stream at once, offsets then lengths */
+static GArray* tcp_expect(const GByteArray* stream) {
+	GArray* expect = g_array_new(FALSE, FALSE, sizeof(gint));
+	gint pos = 0, pkt_len;
+
+	while ((pkt_len = qq_tcp_frame(stream->data + pos, stream->len - pos)) != 0) {
+		if (pkt_len > 0) {
+			g_array_append_val(expect, pos);
+			g_array_append_val(expect, pkt_len);
+		}
+		pos += (pkt_len > 0) ? pkt_len : -pkt_len;
+	}
+	return expect;
+}
+
+/* feed stream into a connection in reads ending at cuts, as tcp_pending
+ * does, and compare the packets coming out with expect */
+static gboolean tcp_feed(const GByteArray* stream, const GArray* expect, const gint* cuts, gint cut_count) {
+	qq_connection conn;
+	guint8* space;
+	guint8* pkt;
+	gint pos = 0, end, space_len, len, pkt_len, found = 0, i;
+	gboolean ok = TRUE;
+
+	memset(&conn, 0, sizeof(conn));
+	for (i = 0; i <= cut_count && ok; i++) {
+		end = (i < cut_count) ? cuts[i] : (gint) stream->len;
+		while (pos < end && ok) {
+			space = qq_tcp_rx_space(&conn, &space_len);
+			len = MIN(space_len, end - pos);
+			memcpy(space, stream->data + pos, len);
+			conn.tcp_rxtail += len;
+			pos += len;
+
+			while (ok && (pkt_len = qq_tcp_rx_next(&conn, &pkt)) > 0) {
+				ok = found * 2 < (gint) expect->len
+					&& pkt_len == g_array_index(expect, gint, found * 2 + 1)
+					&& memcmp(pkt, stream->data + g_array_index(expect, gint, found * 2), pkt_len) == 0;
+				found++;
+			}
+		}
+	}
+	g_free(conn.tcp_rxbuf);
+	return ok && found * 2 == (gint) expect->len;
+}
+
+static gboolean check_tcp_split(GRand* rand) {
+	GByteArray* stream;
+	GArray* expect;
+	gint* cuts;
+	gint i, cut_count, step;
+	glong cases = 0;
+	gboolean ok = TRUE;
+
+	/* one read for the whole stream, then two at every byte boundary */
+	stream = tcp_stream(rand, CHECK_TCP_PACKETS, FALSE);
+	expect = tcp_expect(stream);
+	ok = tcp_feed(stream, expect, NULL, 0);
+	for (i = 1; i < (gint) stream->len && ok; i++, cases++) {
+		ok = tcp_feed(stream, expect, &i, 1);
+	}
+
+	/* a byte at a time */
+	cuts = g_new(gint, stream->len);
+	for (i = 0; i < (gint) stream->len; i++) {
+		cuts[i] = i + 1;
+	}
+	ok = ok && tcp_feed(stream, expect, cuts, stream->len - 1);
+	cases++;
+	g_free(cuts);
+	g_array_free(expect, TRUE);
+	g_byte_array_free(stream, TRUE);
+
+	/* random reads from tiny to more than the buffer holds */
+	stream = tcp_stream(rand, CHECK_TCP_LONG_PACKETS, TRUE);
+	expect = tcp_expect(stream);
+	cuts = g_new(gint, stream->len);
+	for (i = 0; i < CHECK_TCP_ROUNDS && ok; i++, cases++) {
+		step = 1 << g_rand_int_range(rand, 0, 18);
+		cut_count = 0;
+		while (cut_count == 0 || cuts[cut_count - 1] < (gint) stream->len - 1) {
+			cuts[cut_count] = (cut_count == 0 ? 0 : cuts[cut_count - 1])
+				+ g_rand_int_range(rand, 1, step + 1);
+			if (cuts[cut_count] >= (gint) stream->len) break;
+			cut_count++;
+		}
+		ok = tcp_feed(stream, expect, cuts, cut_count);
+	}
+	g_free(cuts);
+	g_array_free(expect, TRUE);
+	g_byte_array_free(stream, TRUE);
+
+	report("tcp_split", cases, ok);
+	return ok;
+}
+
+/* batch against qq_encrypt/qq_decrypt on each buffer. both pad with
+ * rand(), buffer after buffer, so they get the same seed */
+static gboolean check_crypt_batch(GRand* rand) {
+	qq_crypt_ctx ctx;
+	qq_crypt_buf bufs[CHECK_CRYPT_BATCH];
+	guint8 key[QQ_KEY_LENGTH];
+	guint8 plain[CHECK_CRYPT_BATCH][CHECK_CRYPT_MAXLEN + 17];
+	guint8 crypted[CHECK_CRYPT_BATCH][CHECK_CRYPT_MAXLEN + 17];
+	guint8 expect[CHECK_CRYPT_BATCH][CHECK_CRYPT_MAXLEN + 17];
+	gint expect_len[CHECK_CRYPT_BATCH];
+	gint round, count, i, j, len = 0;
+	guint seed;
+	glong cases = 0;
+	gboolean ok = TRUE;
+
+	for (round = 0; round < CHECK_CRYPT_ROUNDS && ok; round++) {
+		for (j = 0; j < QQ_KEY_LENGTH; j++) {
+			key[j] = g_rand_int_range(rand, 0, 256);
+		}
+		qq_crypt_ctx_init(&ctx, key);
+		count = g_rand_int_range(rand, 0, CHECK_CRYPT_BATCH + 1);
+
+		for (i = 0; i < count; i++) {
+			bufs[i].in = plain[i];
+			bufs[i].in_len = len;
+			bufs[i].out = crypted[i];
+			for (j = 0; j < len; j++) {
+				plain[i][j] = g_rand_int_range(rand, 0, 256);
+			}
+			len = (len + 1) % (CHECK_CRYPT_MAXLEN + 1);
+		}
+
+		seed = g_rand_int(rand);
+		srand(seed);
+		for (i = 0; i < count; i++) {
+			expect_len[i] = qq_encrypt(expect[i], plain[i], bufs[i].in_len, key);
+		}
+		srand(seed);
+		qq_encrypt_batch(&ctx, bufs, count);
+		for (i = 0; i < count && ok; i++, cases++) {
+			ok = bufs[i].out_len == expect_len[i]
+				&& memcmp(crypted[i], expect[i], expect_len[i]) == 0;
+		}
+
+		/* some crypted buffers are broken, or cut to any length.
+		 * every other one is decrypted in place */
+		for (i = 0; i < count; i++) {
+			bufs[i].in = crypted[i];
+			bufs[i].in_len = expect_len[i];
+			switch (g_rand_int_range(rand, 0, 4)) {
+			case 0:
+				j = g_rand_int_range(rand, 0, expect_len[i] * 8);
+				crypted[i][j / 8] ^= 1 << (j % 8);
+				break;
+			case 1:
+				bufs[i].in_len = g_rand_int_range(rand, 0, expect_len[i] + 1);
+				break;
+			}
+			bufs[i].out = (i % 2) ? crypted[i] : plain[i];
+			expect_len[i] = qq_decrypt(expect[i], crypted[i], bufs[i].in_len, key);
+		}
+		qq_decrypt_batch(&ctx, bufs, count);
+		for (i = 0; i < count && ok; i++, cases++) {
+			ok = bufs[i].out_len == expect_len[i]
+				&& (expect_len[i] <= 0 || memcmp(bufs[i].out, expect[i], expect_len[i]) == 0);
+		}
+	}
+
+	report("crypt_batch", cases, ok);
+	return ok;
+}
+
+int main(int argc, char** argv) {
+	guint32 seed;
+	GRand* rand;
+	gboolean ok = TRUE;
+
+	seed = (argc > 1) ? strtoul(argv[1], NULL, 10) : g_random_int();
+	rand = g_rand_new_with_seed(seed);
+	g_printf("# seed %u\n", seed);
+	g_printf("# check\tcases\tresult\n");
+
+	ok = check_tcp_split(rand) && ok;
+	ok = check_crypt_batch(rand) && ok;
+
+	g_rand_free(rand);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
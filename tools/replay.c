@@ -0,0 +1,497 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "blist.h"
+#include "connection.h"
+#include "core.h"
+#include "eventloop.h"
+#include "util.h"
+
+#include "qq.h"
+#include "packet_parse.h"
+#include "qq_crypt.h"
+#include "qq_define.h"
+#include "qq_network.h"
+#include "qq_trans.h"
+
+/* Replay a capture through packet_process with no network.
+ *
+ * A capture is the TCP stream from the server, QQ packets back to back
+ * as tcp_pending reads them: 2 bytes length, header, encrypted data, tail.
+ * Every packet must be encrypted by the session key given on command line.
+ *
+ * Replies to our commands need a transaction to be dispatched to
+ * qq_proc_client_cmds or qq_proc_room_cmds, so one is added for each of
+ * them before it is fed.  Packets sent by handlers go to /dev/null.
+ *
+ *   qq_replay -g buddies rooms capture   write a synthetic capture
+ *   qq_replay key capture [uid]          replay it
+ *
+ * Output is one line per command, tab separated:
+ *   cmd  count  total_ms  pkts/s  mean_us  p50_us  p99_us
+ * followed by a histogram line per command, "<=us:count" of log2 buckets */
+
+#define REPLAY_UID 10000
+#define REPLAY_BUCKETS 32
+#define REPLAY_KEY "0123456789abcdef0123456789abcdef"
+#define REPLAY_MEMBERS 100		/* members of each synthetic room */
+#define REPLAY_BUDDIES_PER_PACKET 30
+
+typedef struct {
+	gchar* name;
+	glong count;
+	gint64 total_ns;
+	glong hist[REPLAY_BUCKETS];	/* bucket i holds latency < 2^i ns */
+} cmd_stat;
+
+static gint64 now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static gboolean is_server_cmd(guint16 cmd) {
+	return cmd == QQ_CMD_RECV_IM || cmd == QQ_CMD_RECV_IM_CE
+		|| cmd == QQ_CMD_RECV_MSG_SYS || cmd == QQ_CMD_BUDDY_CHANGE_STATUS;
+}
+
+static gboolean hex_to_key(guint8* key, const gchar* hex) {
+	gint i;
+
+	if (strlen(hex) != QQ_KEY_LENGTH * 2) {
+		return FALSE;
+	}
+	for (i = 0; i < QQ_KEY_LENGTH; i++) {
+		gint hi = g_ascii_xdigit_value(hex[i * 2]);
+		gint lo = g_ascii_xdigit_value(hex[i * 2 + 1]);
+		if (hi < 0 || lo < 0) {
+			return FALSE;
+		}
+		key[i] = (hi << 4) | lo;
+	}
+	return TRUE;
+}
+
+/*
+ * synthetic capture
+ */
+
+static void put_packet(GByteArray* out, const qq_crypt_ctx* ctx, guint16 cmd, guint16 seq,
+		guint8* data, gint data_len) {
+	guint8 buf[MAX_PACKET_SIZE];
+	gint bytes = 0;
+
+	bytes += 2;	/* length, set below */
+	bytes += qq_put8(buf + bytes, QQ_PACKET_TAG);
+	bytes += qq_put16(buf + bytes, QQ_CLIENT_2227);
+	bytes += qq_put16(buf + bytes, cmd);
+	bytes += qq_put16(buf + bytes, seq);
+	bytes += qq_put32(buf + bytes, REPLAY_UID);
+	memset(buf + bytes, 0, 3);
+	bytes += 3;
+	bytes += qq_crypt_ctx_encrypt(ctx, buf + bytes, data, data_len);
+	bytes += qq_put8(buf + bytes, QQ_PACKET_TAIL);
+	qq_put16(buf, bytes);
+
+	g_byte_array_append(out, buf, bytes);
+}
+
+/* GET_BUDDIES_LIST replies, position of the last one is 0xffff */
+static guint16 gen_buddies(GByteArray* out, const qq_crypt_ctx* ctx, guint16 seq, gint buddies) {
+	guint8 data[MAX_PACKET_SIZE];
+	gchar nick[32];
+	gint bytes, i, first;
+
+	for (first = 0; first < buddies; first += REPLAY_BUDDIES_PER_PACKET) {
+		gint last = MIN(first + REPLAY_BUDDIES_PER_PACKET, buddies);
+
+		memset(data, 0, sizeof(data));
+		bytes = 10;
+		bytes += qq_put16(data + bytes, (last < buddies) ? last : 0xffff);
+		bytes += 5;
+		for (i = first; i < last; i++) {
+			g_snprintf(nick, sizeof(nick), "buddy %d", i);
+			bytes += qq_put32(data + bytes, REPLAY_UID + 1 + i);
+			bytes += qq_put16(data + bytes, i % 100 + 1);	/* face */
+			bytes += qq_put8(data + bytes, 20);	/* age */
+			bytes += qq_put8(data + bytes, i & 1);	/* gender */
+			bytes += qq_put8(data + bytes, strlen(nick));
+			bytes += qq_putdata(data + bytes, (guint8*) nick, strlen(nick));
+			bytes += 2 + 1 + 1 + 28;	/* unknown, ext_flag, comm_flag, fill */
+		}
+		bytes += 5;
+		put_packet(out, ctx, QQ_CMD_GET_BUDDIES_LIST, seq++, data, bytes);
+	}
+	return seq;
+}
+
+/* GET_INFO with members, then GET_ONLINES with half of them, for each room */
+static guint16 gen_rooms(GByteArray* out, const qq_crypt_ctx* ctx, guint16 seq, gint rooms, gint buddies) {
+	guint8 data[MAX_PACKET_SIZE];
+	gchar name[32];
+	gint bytes, r, m;
+
+	for (r = 0; r < rooms; r++) {
+		guint32 id = 100000 + r;
+
+		memset(data, 0, sizeof(data));
+		g_snprintf(name, sizeof(name), "room %d", r);
+		bytes = 0;
+		bytes += qq_put8(data + bytes, QQ_ROOM_CMD_GET_INFO);
+		bytes += qq_put8(data + bytes, 0x00);	/* reply ok */
+		bytes += qq_put32(data + bytes, id);
+		bytes += qq_put32(data + bytes, 200000 + r);	/* qun_id */
+		bytes += qq_put32(data + bytes, 0x00000003);
+		bytes += 1 + 4;	/* type8, vip */
+		bytes += qq_put32(data + bytes, REPLAY_UID + 1);	/* creator */
+		bytes += 1 + 4 + 2 + 4;	/* auth_type, old category, 00 00, category */
+		bytes += qq_put16(data + bytes, 500);	/* max_members */
+		bytes += 1 + 8;
+		bytes += qq_put8(data + bytes, strlen(name));
+		bytes += qq_putdata(data + bytes, (guint8*) name, strlen(name));
+		bytes += 2;
+		/* qq_get_vstr reads an empty string as 1 byte, so none is empty */
+		bytes += qq_put8(data + bytes, 2);
+		bytes += qq_putdata(data + bytes, (guint8*) "hi", 2);	/* bulletin */
+		bytes += qq_put8(data + bytes, 2);
+		bytes += qq_putdata(data + bytes, (guint8*) "hi", 2);	/* intro */
+		bytes += qq_put16(data + bytes, 2);
+		bytes += qq_putdata(data + bytes, (guint8*) "tk", 2);	/* token */
+		bytes += 2;
+		bytes += qq_put32(data + bytes, 0);	/* last_uid */
+		bytes += qq_put8(data + bytes, 0);	/* has_more */
+		for (m = 0; m < REPLAY_MEMBERS; m++) {
+			bytes += qq_put32(data + bytes, REPLAY_UID + 1 + (r * 7 + m) % MAX(buddies, 1));
+			bytes += qq_put8(data + bytes, 0);	/* organization */
+			bytes += qq_put8(data + bytes, 0);	/* role */
+		}
+		put_packet(out, ctx, QQ_CMD_ROOM, seq++, data, bytes);
+
+		bytes = 0;
+		bytes += qq_put8(data + bytes, QQ_ROOM_CMD_GET_ONLINES);
+		bytes += qq_put8(data + bytes, 0x00);
+		bytes += qq_put32(data + bytes, id);
+		bytes += qq_put8(data + bytes, 0x3c);
+		for (m = 0; m < REPLAY_MEMBERS; m += 2) {
+			bytes += qq_put32(data + bytes, REPLAY_UID + 1 + (r * 7 + m) % MAX(buddies, 1));
+		}
+		put_packet(out, ctx, QQ_CMD_ROOM, seq++, data, bytes);
+	}
+	return seq;
+}
+
+/* BUDDY_CHANGE_STATUS pushed by server for each buddy */
+static guint16 gen_status(GByteArray* out, const qq_crypt_ctx* ctx, guint16 seq, gint buddies) {
+	guint8 data[64];
+	gint bytes, i;
+
+	for (i = 0; i < buddies; i++) {
+		memset(data, 0, sizeof(data));
+		bytes = 0;
+		bytes += qq_put32(data + bytes, REPLAY_UID + 1 + i);
+		bytes += qq_put8(data + bytes, 0x01);
+		bytes += 4 + 2 + 1;	/* ip, port, flag2 */
+		bytes += qq_put8(data + bytes, (i & 1) ? QQ_BUDDY_ONLINE_NORMAL : QQ_BUDDY_ONLINE_AWAY);
+		bytes += 2 + QQ_KEY_LENGTH + 2 + 1 + 1;	/* version, key, unknown, ext_flag, comm_flag */
+		bytes += qq_put32(data + bytes, REPLAY_UID);
+		put_packet(out, ctx, QQ_CMD_BUDDY_CHANGE_STATUS, seq++, data, bytes);
+	}
+	return seq;
+}
+
+static int generate(gint buddies, gint rooms, const gchar* path) {
+	GByteArray* out = g_byte_array_new();
+	GError* error = NULL;
+	guint8 key[QQ_KEY_LENGTH];
+	qq_crypt_ctx ctx;
+	guint16 seq = 1;
+
+	hex_to_key(key, REPLAY_KEY);
+	qq_crypt_ctx_init(&ctx, key);
+
+	seq = gen_buddies(out, &ctx, seq, buddies);
+	seq = gen_rooms(out, &ctx, seq, rooms, buddies);
+	seq = gen_status(out, &ctx, seq, buddies);
+
+	if (!g_file_set_contents(path, (gchar*) out->data, out->len, &error)) {
+		g_fprintf(stderr, "%s\n", error->message);
+		g_error_free(error);
+		return EXIT_FAILURE;
+	}
+	g_printf("# %d packets, %u bytes, key %s\n", seq - 1, out->len, REPLAY_KEY);
+	g_byte_array_free(out, TRUE);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * headless libpurple, event loop ops from nullclient
+ */
+
+typedef struct {
+	PurpleInputFunction function;
+	guint result;
+	gpointer data;
+} replay_io_closure;
+
+static gboolean io_invoke(GIOChannel* source, GIOCondition condition, gpointer data) {
+	replay_io_closure* closure = data;
+	PurpleInputCondition cond = 0;
+
+	if (condition & (G_IO_IN | G_IO_HUP | G_IO_ERR))	cond |= PURPLE_INPUT_READ;
+	if (condition & (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL))	cond |= PURPLE_INPUT_WRITE;
+
+	closure->function(closure->data, g_io_channel_unix_get_fd(source), cond);
+	return TRUE;
+}
+
+static guint input_add(gint fd, PurpleInputCondition condition, PurpleInputFunction function, gpointer data) {
+	replay_io_closure* closure = g_new0(replay_io_closure, 1);
+	GIOChannel* channel;
+	GIOCondition cond = 0;
+
+	closure->function = function;
+	closure->data = data;
+	if (condition & PURPLE_INPUT_READ)	cond |= G_IO_IN | G_IO_HUP | G_IO_ERR;
+	if (condition & PURPLE_INPUT_WRITE)	cond |= G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+
+	channel = g_io_channel_unix_new(fd);
+	closure->result = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, cond,
+			io_invoke, closure, g_free);
+	g_io_channel_unref(channel);
+	return closure->result;
+}
+
+static PurpleEventLoopUiOps eventloop_ops = {
+	g_timeout_add,
+	g_source_remove,
+	input_add,
+	g_source_remove,
+	NULL,
+	g_timeout_add_seconds,
+	NULL, NULL, NULL
+};
+
+static PurpleConnection* replay_connect(const guint8* key, guint32 uid) {
+	PurpleAccount* account;
+	PurpleConnection* gc;
+	qq_data* qd;
+	gchar* dir;
+	gchar* name;
+
+	dir = g_build_filename(g_get_tmp_dir(), "qq_replay-XXXXXX", NULL);
+	if (mkdtemp(dir) == NULL) {
+		g_fprintf(stderr, "Can not create %s: %s\n", dir, g_strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	purple_util_set_user_dir(dir);
+	purple_eventloop_set_ui_ops(&eventloop_ops);
+	if (!purple_core_init("qq-replay")) {
+		g_fprintf(stderr, "libpurple initialization failed\n");
+		exit(EXIT_FAILURE);
+	}
+	purple_set_blist(purple_blist_new());
+
+	name = g_strdup_printf("%u", uid);
+	account = purple_account_new(name, "prpl-qq");
+	g_free(name);
+
+	gc = g_new0(PurpleConnection, 1);
+	gc->account = account;
+	gc->state = PURPLE_CONNECTED;
+	purple_account_set_connection(account, gc);
+
+	qd = g_new0(qq_data, 1);
+	qd->gc = gc;
+	gc->proto_data = qd;
+	qd->uid = uid;
+	qd->is_login = TRUE;
+	qd->use_tcp = FALSE;
+	qd->fd = open("/dev/null", O_WRONLY);
+	qd->client_tag = QQ_CLIENT_2227;
+	qd->client_version = 2011;
+	qd->resend_times = 5;
+	qd->itv_config.resend = 4;
+	memcpy(qd->session_key, key, QQ_KEY_LENGTH);
+	qq_crypt_ctx_init(&qd->session_ctx, qd->session_key);
+
+	g_free(dir);
+	return gc;
+}
+
+/*
+ * replay
+ */
+
+static cmd_stat* stat_get(GHashTable* stats, guint16 cmd, guint8 room_cmd) {
+	guint key = (cmd << 8) | room_cmd;
+	cmd_stat* st = g_hash_table_lookup(stats, GUINT_TO_POINTER(key));
+
+	if (st == NULL) {
+		st = g_new0(cmd_stat, 1);
+		if (cmd == QQ_CMD_ROOM) {
+			st->name = g_strdup_printf("ROOM/%s", qq_get_room_cmd_desc(room_cmd));
+		} else {
+			st->name = g_strdup(qq_get_cmd_desc(cmd));
+		}
+		g_hash_table_insert(stats, GUINT_TO_POINTER(key), st);
+	}
+	return st;
+}
+
+static void stat_add(cmd_stat* st, gint64 ns) {
+	gint b = 0;
+
+	while (b < REPLAY_BUCKETS - 1 && ((gint64) 1 << b) <= ns) {
+		b++;
+	}
+	st->count++;
+	st->total_ns += ns;
+	st->hist[b]++;
+}
+
+/* upper bound in us of the bucket holding the given fraction */
+static gdouble stat_percentile(const cmd_stat* st, gdouble fraction) {
+	glong need = (glong) (st->count * fraction);
+	glong seen = 0;
+	gint b;
+
+	for (b = 0; b < REPLAY_BUCKETS; b++) {
+		seen += st->hist[b];
+		if (seen > need) {
+			break;
+		}
+	}
+	return ((gint64) 1 << MIN(b, REPLAY_BUCKETS - 1)) / 1000.0;
+}
+
+static void stat_print(gpointer key, gpointer value, gpointer user_data) {
+	cmd_stat* st = value;
+	gint b;
+
+	g_printf("%s\t%ld\t%.3f\t%.0f\t%.2f\t%.2f\t%.2f\n", st->name, st->count,
+			st->total_ns / 1e6, st->count / (st->total_ns / 1e9),
+			st->total_ns / 1e3 / st->count,
+			stat_percentile(st, 0.5), stat_percentile(st, 0.99));
+	g_printf("#");
+	for (b = 0; b < REPLAY_BUCKETS; b++) {
+		if (st->hist[b] > 0) {
+			g_printf(" %.3f:%ld", ((gint64) 1 << b) / 1000.0, st->hist[b]);
+		}
+	}
+	g_printf("\n");
+}
+
+static void stat_free(gpointer data) {
+	cmd_stat* st = data;
+	g_free(st->name);
+	g_free(st);
+}
+
+/* add the transaction a reply is waiting for, room cmd and id are in the text */
+static guint8 expect_reply(PurpleConnection* gc, guint16 cmd, guint16 seq, guint8* rcved, gint rcved_len) {
+	qq_data* qd = (qq_data*) gc->proto_data;
+	guint8* buf;
+	guint8* text;
+	guint8 room_cmd = 0;
+	guint32 room_id = 0;
+	gint text_len;
+
+	if (cmd != QQ_CMD_ROOM) {
+		qq_trans_add_client_cmd(gc, cmd, seq, NULL, 0, 0, 0);
+		return 0;
+	}
+
+	buf = g_memdup(rcved, rcved_len);
+	text_len = qq_crypt_ctx_decrypt(&qd->session_ctx, buf, rcved_len, &text);
+	if (text_len >= 6) {
+		qq_get8(&room_cmd, text);
+		qq_get32(&room_id, text + 2);
+	}
+	g_free(buf);
+
+	qq_trans_add_room_cmd(gc, seq, room_cmd, room_id, NULL, 0, 0, 0);
+	return room_cmd;
+}
+
+static int replay(const guint8* key, const gchar* path, guint32 uid) {
+	PurpleConnection* gc;
+	GHashTable* stats;
+	GError* error = NULL;
+	gchar* contents;
+	gsize len;
+	gint pos, pkt_len;
+	guint16 cmd, seq;
+	guint8 room_cmd;
+	glong packets = 0;
+	gint64 start, t;
+
+	if (!g_file_get_contents(path, &contents, &len, &error)) {
+		g_fprintf(stderr, "%s\n", error->message);
+		g_error_free(error);
+		return EXIT_FAILURE;
+	}
+
+	gc = replay_connect(key, uid);
+	stats = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, stat_free);
+
+	start = now_ns();
+	pos = 0;
+	while ((pkt_len = qq_tcp_frame((guint8*) contents + pos, len - pos)) != 0) {
+		guint8* pkt = (guint8*) contents + pos;
+
+		pos += (pkt_len > 0) ? pkt_len : -pkt_len;
+		if (pkt_len < 0) {
+			g_fprintf(stderr, "Skip %d bytes of no QQ packet\n", -pkt_len);
+			continue;
+		}
+
+		/* 2 length, 1 tag, 2 version, 2 cmd, 2 seq, 7 uid and fill */
+		qq_get16(&cmd, pkt + 5);
+		qq_get16(&seq, pkt + 7);
+		room_cmd = 0;
+		if (!is_server_cmd(cmd)) {
+			room_cmd = expect_reply(gc, cmd, seq, pkt + 16, pkt_len - 16 - 1);
+		}
+
+		t = now_ns();
+		qq_packet_process(gc, pkt + 2, pkt_len - 2);
+		stat_add(stat_get(stats, cmd, room_cmd), now_ns() - t);
+		packets++;
+	}
+	t = now_ns() - start;
+
+	g_printf("# %ld packets in %.3f ms\n", packets, t / 1e6);
+	g_printf("# cmd\tcount\ttotal_ms\tpkts/s\tmean_us\tp50_us\tp99_us\n");
+	g_hash_table_foreach(stats, stat_print, NULL);
+
+	g_hash_table_destroy(stats);
+	g_free(contents);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv) {
+	guint8 key[QQ_KEY_LENGTH];
+	guint32 uid = REPLAY_UID;
+
+	if (argc == 5 && strcmp(argv[1], "-g") == 0) {
+		return generate(atoi(argv[2]), atoi(argv[3]), argv[4]);
+	}
+
+	if (argc < 3 || argc > 4 || !hex_to_key(key, argv[1])) {
+		g_fprintf(stderr, "Usage: %s -g buddies rooms capture\n", argv[0]);
+		g_fprintf(stderr, "       %s session_key_hex capture [uid]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc == 4) {
+		uid = strtoul(argv[3], NULL, 10);
+	}
+	return replay(key, argv[2], uid);
+}
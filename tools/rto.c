@@ -0,0 +1,243 @@
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trans_timer.h"
+
+/* Transactions of qq_trans.c over an in-process path that drops and
+ * delays packets. One tick is one ms.
+ *
+ *   qq_rto [seed]
+ *
+ * A command goes out every SIM_GAP ticks, SIM_COMMANDS of them, and the
+ * server replies to every copy it gets. Both ways lose a packet at
+ * random and take half the rtt plus up to jitter, so copies may pass
+ * each other. The client acts as qq_trans.c does: the first rto is the
+ * resend interval, samples come from commands never resent, each resend
+ * doubles the rto of its command, and after SIM_RETRIES sends it is lost.
+ * Deadlines of both sides sit in a qq_trans_heap.
+ *
+ * Output is one line per case, SIM_RUNS runs together, tab separated:
+ *   loss%  rtt  jitter  resend_s  mean_ms  p99_ms  sends/cmd  spurious/cmd  lost  giveup_ms
+ * mean and p99 are from the first send to the first reply of commands
+ * not lost. A resend is spurious if a reply to an earlier copy was still
+ * on its way. giveup_ms is from the first send to when a lost command is
+ * given up, "-" if none was */
+
+#define SIM_COMMANDS 2000
+#define SIM_GAP 100
+#define SIM_RETRIES 10		/* default of resend_times */
+#define SIM_RUNS 5
+
+enum {
+	SIM_RESEND,		/* client deadline */
+	SIM_TO_SERVER,
+	SIM_TO_CLIENT
+};
+
+typedef struct _sim_event sim_event;
+struct _sim_event {
+	qq_trans_timer timer;	/* first, heap holds pointers to it */
+	gint type;
+	guint cmd;
+};
+
+typedef struct _sim_cmd {
+	sim_event ev;		/* SIM_RESEND */
+	gint64 send_time;
+	gint rto;
+	gint sends;
+	gboolean done;
+	gint64 reply_due;	/* earliest reply to a copy still on its way, or 0 */
+} sim_cmd;
+
+typedef struct _sim {
+	GRand* rand;
+	gint loss;		/* per mille */
+	gint rtt;
+	gint jitter;
+	GPtrArray* heap;
+	qq_trans_rtt est;
+	sim_cmd cmds[SIM_COMMANDS];
+	gint64 last_deadline;
+	/* sums of a case */
+	GArray* latency;
+	glong sends;
+	glong spurious;
+	glong lost;
+	gint64 giveup;
+} sim;
+
+static gint sim_delay(sim* s) {
+	return s->rtt / 2 + g_rand_int_range(s->rand, 0, s->jitter + 1);
+}
+
+/* a packet of cmd on its way, or 0 if it is lost */
+static gint64 sim_packet(sim* s, gint64 now, gint type, guint cmd) {
+	sim_event* ev;
+
+	if (g_rand_int_range(s->rand, 0, 1000) < s->loss) return 0;
+	ev = g_new0(sim_event, 1);
+	ev->type = type;
+	ev->cmd = cmd;
+	qq_trans_heap_schedule(s->heap, &ev->timer, now + sim_delay(s));
+	return ev->timer.deadline;
+}
+
+static void sim_send(sim* s, gint64 now, sim_cmd* c) {
+	c->sends++;
+	s->sends++;
+	sim_packet(s, now, SIM_TO_SERVER, c->ev.cmd);
+	qq_trans_heap_schedule(s->heap, &c->ev.timer, now + c->rto);
+}
+
+static void sim_run(sim* s, gint resend) {
+	qq_trans_timer* first;
+	sim_event* ev;
+	sim_cmd* c;
+	gint64 now, due, latency, next_issue = 0;
+	guint issued = 0, i;
+
+	qq_trans_rtt_reset(&s->est, resend * 1000);
+	s->last_deadline = 0;
+	memset(s->cmds, 0, sizeof(s->cmds));
+	for (i = 0; i < SIM_COMMANDS; i++) {
+		s->cmds[i].ev.type = SIM_RESEND;
+		s->cmds[i].ev.cmd = i;
+	}
+
+	while (issued < SIM_COMMANDS || s->heap->len > 0) {
+		first = (s->heap->len > 0) ? g_ptr_array_index(s->heap, 0) : NULL;
+		if (issued < SIM_COMMANDS && (first == NULL || next_issue <= first->deadline)) {
+			c = &s->cmds[issued++];
+			c->rto = s->est.rto;
+			c->send_time = next_issue;
+			sim_send(s, next_issue, c);
+			next_issue += SIM_GAP;
+			continue;
+		}
+
+		now = first->deadline;
+		if (now < s->last_deadline) {
+			g_printf("heap out of order, %" G_GINT64_FORMAT " after %" G_GINT64_FORMAT "\n",
+					now, s->last_deadline);
+			exit(EXIT_FAILURE);
+		}
+		s->last_deadline = now;
+		qq_trans_heap_remove(s->heap, first);
+		ev = (sim_event*) first;
+		c = &s->cmds[ev->cmd];
+
+		switch (ev->type) {
+		case SIM_TO_SERVER:
+			/* the server replies to every copy */
+			due = sim_packet(s, now, SIM_TO_CLIENT, ev->cmd);
+			if (due > 0 && (c->reply_due == 0 || due < c->reply_due)) c->reply_due = due;
+			g_free(ev);
+			break;
+		case SIM_TO_CLIENT:
+			g_free(ev);
+			if (c->done) break;
+			/* qq_trans_find_rcved */
+			c->done = TRUE;
+			latency = now - c->send_time;
+			if (c->sends == 1) qq_trans_rtt_sample(&s->est, latency);
+			g_array_append_val(s->latency, latency);
+			qq_trans_heap_remove(s->heap, &c->ev.timer);
+			break;
+		case SIM_RESEND:
+			/* qq_trans_scan */
+			if (c->sends >= SIM_RETRIES) {
+				c->done = TRUE;
+				s->lost++;
+				s->giveup += now - c->send_time;
+				break;
+			}
+			if (c->reply_due > now) s->spurious++;
+			c->rto = qq_trans_rtt_backoff(&s->est, c->rto);
+			sim_send(s, now, c);
+			break;
+		}
+	}
+}
+
+static gint sim_cmp(gconstpointer a, gconstpointer b) {
+	gint64 x = *(const gint64*) a, y = *(const gint64*) b;
+
+	return (x > y) - (x < y);
+}
+
+static void sim_case(sim* s, gint loss, gint rtt, gint jitter, gint resend) {
+	gint run;
+	guint i;
+	gdouble sum = 0;
+	gint64 p99 = 0;
+
+	s->loss = loss;
+	s->rtt = rtt;
+	s->jitter = jitter;
+	g_array_set_size(s->latency, 0);
+	s->sends = 0;
+	s->spurious = 0;
+	s->lost = 0;
+	s->giveup = 0;
+	for (run = 0; run < SIM_RUNS; run++) {
+		sim_run(s, resend);
+	}
+
+	g_array_sort(s->latency, sim_cmp);
+	for (i = 0; i < s->latency->len; i++) {
+		sum += g_array_index(s->latency, gint64, i);
+	}
+	if (s->latency->len > 0) {
+		p99 = g_array_index(s->latency, gint64, s->latency->len * 99 / 100);
+	}
+
+	g_printf("%.1f\t%d\t%d\t%d\t", loss / 10.0, rtt, jitter, resend);
+	if (s->latency->len > 0) {
+		g_printf("%.0f\t%" G_GINT64_FORMAT "\t", sum / s->latency->len, p99);
+	} else {
+		g_printf("-\t-\t");
+	}
+	g_printf("%.2f\t%.3f\t%ld\t", (gdouble) s->sends / SIM_RUNS / SIM_COMMANDS,
+			(gdouble) s->spurious / SIM_RUNS / SIM_COMMANDS, s->lost);
+	if (s->lost > 0) {
+		g_printf("%.0f\n", (gdouble) s->giveup / s->lost);
+	} else {
+		g_printf("-\n");
+	}
+}
+
+int main(int argc, char** argv) {
+	static const gint losses[] = { 0, 10, 50, 200, 1000 };
+	/* rtt and jitter, the last a path whose queue fills up */
+	static const gint paths[][2] = { { 50, 10 }, { 300, 100 }, { 1500, 500 }, { 200, 2000 } };
+	static const gint resends[] = { 1, 4 };
+	sim s;
+	guint32 seed;
+	guint i, j, k;
+
+	seed = (argc > 1) ? strtoul(argv[1], NULL, 10) : g_random_int();
+	memset(&s, 0, sizeof(s));
+	s.rand = g_rand_new_with_seed(seed);
+	s.heap = g_ptr_array_new();
+	s.latency = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+	g_printf("# seed %u, %d commands %d ms apart, rto %d..%d ms\n", seed,
+			SIM_COMMANDS, SIM_GAP, QQ_TRANS_RTO_MIN, QQ_TRANS_RTO_MAX);
+	g_printf("# loss%%\trtt\tjitter\tresend_s\tmean_ms\tp99_ms\tsends/cmd\tspurious/cmd\tlost\tgiveup_ms\n");
+	for (i = 0; i < G_N_ELEMENTS(losses); i++) {
+		for (j = 0; j < G_N_ELEMENTS(paths); j++) {
+			for (k = 0; k < G_N_ELEMENTS(resends); k++) {
+				sim_case(&s, losses[i], paths[j][0], paths[j][1], resends[k]);
+			}
+		}
+	}
+
+	g_array_free(s.latency, TRUE);
+	g_ptr_array_free(s.heap, TRUE);
+	g_rand_free(s.rand);
+	return EXIT_SUCCESS;
+}
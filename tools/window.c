@@ -0,0 +1,198 @@
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_window.h"
+
+/* A sender and a receiver window of file_trans.c, over an in-process
+ * channel that drops and delays fragments. One tick is one ms.
+ *
+ *   qq_window [seed]
+ *
+ * The data path is a bottleneck of one fragment per tick, about 1MB/s,
+ * with a queue of SIM_QUEUE fragments and tail drop; both ways lose a
+ * packet at random and take half the rtt plus jitter, in order. The sender acts
+ * as file_trans.c does: fill on each ack at most QQ_FILE_SEND_BURST,
+ * the rest next tick, resend holes qq_file_window_lost gives, and check
+ * for a stall every QQ_FILE_RESEND_CHECK.
+ *
+ * Output is one line per case, mean of SIM_RUNS runs, tab separated:
+ *   loss%  rtt  cwnd_max  ticks  frag/s  sent/frag  queue_drops  util
+ * util is ticks of a perfect pipe, fragments + rtt, over ticks taken.
+ * ticks is "-" if a run did not finish in SIM_MAX_TICKS */
+
+#define SIM_FRAGMENTS 4000
+#define SIM_QUEUE 64
+#define SIM_SLOTS 1024		/* longer than any delay, ring of arrivals */
+#define SIM_MAX_TICKS 600000
+#define SIM_RUNS 5
+
+typedef struct _sim {
+	GRand* rand;
+	gint loss;		/* per mille */
+	gint rtt;
+	glong tick;
+	glong link_free;	/* tick the bottleneck sends the next fragment */
+	glong data_last;	/* arrival of the last fragment, paths keep order */
+	glong ack_last;
+	qq_file_window send;
+	qq_file_window recv;
+	gboolean fill_pending;
+	GArray* data[SIM_SLOTS];
+	GArray* acks[SIM_SLOTS];
+	glong sent;
+	glong queue_drops;
+} sim;
+
+/* half the rtt and jitter, but never before the packet sent last */
+static glong sim_arrival(sim* s, glong depart, glong* last) {
+	glong arrival = depart + s->rtt / 2 + g_rand_int_range(s->rand, 0, s->rtt / 10 + 1);
+
+	*last = MAX(*last, arrival);
+	return *last;
+}
+
+static void sim_send_data(sim* s, guint32 index) {
+	glong depart;
+
+	s->sent++;
+	if (g_rand_int_range(s->rand, 0, 1000) < s->loss) return;
+	if (s->link_free < s->tick) s->link_free = s->tick;
+	if (s->link_free - s->tick >= SIM_QUEUE) {
+		s->queue_drops++;
+		return;
+	}
+	depart = s->link_free++;
+	g_array_append_val(s->data[sim_arrival(s, depart, &s->data_last) % SIM_SLOTS], index);
+}
+
+static void sim_send_ack(sim* s, guint32 index) {
+	if (g_rand_int_range(s->rand, 0, 1000) < s->loss) return;
+	g_array_append_val(s->acks[sim_arrival(s, s->tick, &s->ack_last) % SIM_SLOTS], index);
+}
+
+/* _qq_send_window_fill */
+static void sim_fill(sim* s) {
+	guint32 index;
+	gint burst;
+
+	for (burst = 0; burst < QQ_FILE_SEND_BURST; burst++) {
+		if (!qq_file_window_next(&s->send, &index, s->tick)) return;
+		sim_send_data(s, index);
+	}
+	s->fill_pending = TRUE;
+}
+
+/* ticks to get every fragment acked, or -1 */
+static glong sim_run(sim* s, gint cwnd_max) {
+	GArray* slot;
+	guint32 index, i;
+	guint j;
+
+	qq_file_window_reset(&s->send, SIM_FRAGMENTS, cwnd_max);
+	qq_file_window_reset(&s->recv, SIM_FRAGMENTS, cwnd_max);
+	for (j = 0; j < SIM_SLOTS; j++) {
+		g_array_set_size(s->data[j], 0);
+		g_array_set_size(s->acks[j], 0);
+	}
+	s->link_free = 0;
+	s->data_last = 0;
+	s->ack_last = 0;
+	s->fill_pending = FALSE;
+
+	for (s->tick = 0; s->tick < SIM_MAX_TICKS; s->tick++) {
+		if (s->tick == 0 || s->fill_pending) {
+			s->fill_pending = FALSE;
+			sim_fill(s);
+		}
+
+		/* receiver acks every fragment, even one it has */
+		slot = s->data[s->tick % SIM_SLOTS];
+		for (j = 0; j < slot->len; j++) {
+			index = g_array_index(slot, guint32, j);
+			sim_send_ack(s, index);
+			qq_file_window_mark(&s->recv, index);
+		}
+		g_array_set_size(slot, 0);
+
+		slot = s->acks[s->tick % SIM_SLOTS];
+		for (j = 0; j < slot->len; j++) {
+			if (!qq_file_window_ack(&s->send, g_array_index(slot, guint32, j), s->tick)) continue;
+			if (s->send.max_fragment_index == SIM_FRAGMENTS) return s->tick;
+			while (qq_file_window_lost(&s->send, &index)) {
+				sim_send_data(s, index);
+			}
+			sim_fill(s);
+		}
+		g_array_set_size(slot, 0);
+
+		if (s->tick % QQ_FILE_RESEND_CHECK == 0 && qq_file_window_stalled(&s->send, s->tick)) {
+			for (i = s->send.max_fragment_index; i < s->send.next_fragment; i++) {
+				if (!qq_file_window_test(&s->send, i)) sim_send_data(s, i);
+			}
+		}
+	}
+	return -1;
+}
+
+static void sim_case(sim* s, gint loss, gint rtt, gint cwnd_max) {
+	glong ticks = 0, sent = 0, queue_drops = 0, t;
+	gint run;
+	gdouble mean;
+
+	s->loss = loss;
+	s->rtt = rtt;
+	for (run = 0; run < SIM_RUNS; run++) {
+		s->sent = 0;
+		s->queue_drops = 0;
+		t = sim_run(s, cwnd_max);
+		if (t < 0) {
+			g_printf("%.1f\t%d\t%d\t-\t-\t-\t-\t-\n", loss / 10.0, rtt, cwnd_max);
+			return;
+		}
+		ticks += t;
+		sent += s->sent;
+		queue_drops += s->queue_drops;
+	}
+
+	mean = (gdouble) ticks / SIM_RUNS;
+	g_printf("%.1f\t%d\t%d\t%.0f\t%.0f\t%.2f\t%.1f\t%.2f\n", loss / 10.0, rtt, cwnd_max,
+			mean, SIM_FRAGMENTS * 1000.0 / mean, (gdouble) sent / SIM_RUNS / SIM_FRAGMENTS,
+			(gdouble) queue_drops / SIM_RUNS, (SIM_FRAGMENTS + rtt) / mean);
+}
+
+int main(int argc, char** argv) {
+	static const gint losses[] = { 0, 10, 50, 100 };
+	static const gint rtts[] = { 20, 100, 400 };
+	static const gint cwnds[] = { 8, 64, QQ_FILE_WINDOW_DEFAULT, QQ_FILE_WINDOW_MAX };
+	sim s;
+	guint32 seed;
+	guint i, j, k;
+
+	seed = (argc > 1) ? strtoul(argv[1], NULL, 10) : g_random_int();
+	memset(&s, 0, sizeof(s));
+	s.rand = g_rand_new_with_seed(seed);
+	for (i = 0; i < SIM_SLOTS; i++) {
+		s.data[i] = g_array_new(FALSE, FALSE, sizeof(guint32));
+		s.acks[i] = g_array_new(FALSE, FALSE, sizeof(guint32));
+	}
+
+	g_printf("# seed %u, %d fragments\n", seed, SIM_FRAGMENTS);
+	g_printf("# loss%%\trtt\tcwnd_max\tticks\tfrag/s\tsent/frag\tqueue_drops\tutil\n");
+	for (i = 0; i < G_N_ELEMENTS(losses); i++) {
+		for (j = 0; j < G_N_ELEMENTS(rtts); j++) {
+			for (k = 0; k < G_N_ELEMENTS(cwnds); k++) {
+				sim_case(&s, losses[i], rtts[j], cwnds[k]);
+			}
+		}
+	}
+
+	for (i = 0; i < SIM_SLOTS; i++) {
+		g_array_free(s.data[i], TRUE);
+		g_array_free(s.acks[i], TRUE);
+	}
+	g_rand_free(s.rand);
+	return EXIT_SUCCESS;
+}
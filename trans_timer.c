@@ -0,0 +1,145 @@
+/**
+ * @file trans_timer.c
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,  USA
+ *
+ *
+ * Resend timeout and deadline heap of transactions
+ */
+
+#include "trans_timer.h"
+
+void qq_trans_rtt_reset(qq_trans_rtt *rtt, gint rto_init)
+{
+	rtt->srtt = 0;
+	rtt->var = 0;
+	rtt->rto = CLAMP(rto_init, QQ_TRANS_RTO_MIN, QQ_TRANS_RTO_MAX);
+}
+
+/* samples only come from trans never resent (Karn's algorithm),
+ * then rto = srtt + 4 * rttvar as RFC 6298 */
+void qq_trans_rtt_sample(qq_trans_rtt *rtt, gint ms)
+{
+	if (rtt->srtt <= 0) {
+		rtt->srtt = ms;
+		rtt->var = ms / 2;
+	} else {
+		rtt->var = (3 * rtt->var + ABS(rtt->srtt - ms)) / 4;
+		rtt->srtt = (7 * rtt->srtt + ms) / 8;
+	}
+	rtt->rto = CLAMP(rtt->srtt + 4 * rtt->var, QQ_TRANS_RTO_MIN, QQ_TRANS_RTO_MAX);
+}
+
+/* exponential backoff of a resent trans, return its new rto.
+ * If it timed out on the rto new trans get, they back off too until a
+ * sample comes, or on a path slower than rto every trans is resent
+ * and no sample ever comes */
+gint qq_trans_rtt_backoff(qq_trans_rtt *rtt, gint rto)
+{
+	gint next = MIN(rto * 2, QQ_TRANS_RTO_MAX);
+
+	if (rto == rtt->rto) {
+		rtt->rto = next;
+	}
+	return next;
+}
+
+static void heap_set(GPtrArray *heap, guint index, qq_trans_timer *timer)
+{
+	g_ptr_array_index(heap, index) = timer;
+	timer->heap_index = index;
+}
+
+static void heap_sift_up(GPtrArray *heap, guint index)
+{
+	qq_trans_timer *timer = g_ptr_array_index(heap, index);
+	qq_trans_timer *parent;
+
+	while (index > 0) {
+		parent = g_ptr_array_index(heap, (index - 1) / 2);
+		if (parent->deadline <= timer->deadline) {
+			break;
+		}
+		heap_set(heap, index, parent);
+		index = (index - 1) / 2;
+	}
+	heap_set(heap, index, timer);
+}
+
+static void heap_sift_down(GPtrArray *heap, guint index)
+{
+	qq_trans_timer *timer = g_ptr_array_index(heap, index);
+	qq_trans_timer *child;
+	guint len = heap->len;
+	guint i;
+
+	while ((i = index * 2 + 1) < len) {
+		child = g_ptr_array_index(heap, i);
+		if (i + 1 < len
+				&& ((qq_trans_timer *) g_ptr_array_index(heap, i + 1))->deadline < child->deadline) {
+			i++;
+			child = g_ptr_array_index(heap, i);
+		}
+		if (timer->deadline <= child->deadline) {
+			break;
+		}
+		heap_set(heap, index, child);
+		index = i;
+	}
+	heap_set(heap, index, timer);
+}
+
+gboolean qq_trans_heap_has(GPtrArray *heap, qq_trans_timer *timer)
+{
+	return timer->heap_index < heap->len && g_ptr_array_index(heap, timer->heap_index) == timer;
+}
+
+/* set a new deadline of timer, adding it to heap if not in yet */
+void qq_trans_heap_schedule(GPtrArray *heap, qq_trans_timer *timer, gint64 deadline)
+{
+	gint64 prev = timer->deadline;
+
+	timer->deadline = deadline;
+	if (qq_trans_heap_has(heap, timer)) {
+		if (deadline < prev) {
+			heap_sift_up(heap, timer->heap_index);
+		} else {
+			heap_sift_down(heap, timer->heap_index);
+		}
+	} else {
+		g_ptr_array_add(heap, timer);
+		heap_sift_up(heap, heap->len - 1);
+	}
+}
+
+void qq_trans_heap_remove(GPtrArray *heap, qq_trans_timer *timer)
+{
+	guint index = timer->heap_index;
+	qq_trans_timer *last;
+
+	last = g_ptr_array_remove_index(heap, heap->len - 1);
+	if (last == timer) {
+		return;
+	}
+	heap_set(heap, index, last);
+	heap_sift_up(heap, index);
+	heap_sift_down(heap, last->heap_index);
+}
@@ -0,0 +1,59 @@
+/**
+ * @file trans_timer.h
+ *
+ * purple
+ *
+ * Purple is the legal property of its developers, whose names are too numerous
+ * to list here.  Please refer to the COPYRIGHT file distributed with this
+ * source distribution.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,  USA
+ */
+
+#ifndef _QQ_TRANS_TIMER_H_
+#define _QQ_TRANS_TIMER_H_
+
+#include <glib.h>
+
+/* bounds of resend timeout, in ms. With resend_times 10 a dead link
+ * is given up in about 50s, tools/rto.c */
+#define QQ_TRANS_RTO_MIN		500
+#define QQ_TRANS_RTO_MAX		5000
+
+/* Round trip time of one connection, rto is for new transactions.
+ * No io in here, qq_trans.c passes rtt samples in ms */
+typedef struct _qq_trans_rtt qq_trans_rtt;
+struct _qq_trans_rtt {
+	gint srtt;		/* ms, smoothed round trip time */
+	gint var;
+	gint rto;		/* ms, resend timeout for new transactions */
+};
+
+void qq_trans_rtt_reset(qq_trans_rtt *rtt, gint rto_init);
+void qq_trans_rtt_sample(qq_trans_rtt *rtt, gint ms);
+gint qq_trans_rtt_backoff(qq_trans_rtt *rtt, gint rto);
+
+/* Deadline of a transaction, in a binary min-heap of them */
+typedef struct _qq_trans_timer qq_trans_timer;
+struct _qq_trans_timer {
+	gint64 deadline;		/* ms, when scan should look at it again */
+	guint heap_index;		/* position in heap */
+};
+
+gboolean qq_trans_heap_has(GPtrArray *heap, qq_trans_timer *timer);
+void qq_trans_heap_schedule(GPtrArray *heap, qq_trans_timer *timer, gint64 deadline);
+void qq_trans_heap_remove(GPtrArray *heap, qq_trans_timer *timer);
+
+#endif